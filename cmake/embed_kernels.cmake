@@ -0,0 +1,58 @@
+# Generates a C++ source file with the contents of the OpenCL kernel sources, so that they don't have to be
+# read from disk at runtime. Run in script mode:
+#   cmake -DINPUTS="a.cl|b.clh" -DOUTPUT=embedded_kernels.cpp -P embed_kernels.cmake
+string(REPLACE "|" ";" INPUT_LIST "${INPUTS}")
+
+set(ARRAYS "")
+set(ENTRIES "")
+set(INDEX 0)
+foreach(INPUT IN LISTS INPUT_LIST)
+  get_filename_component(NAME ${INPUT} NAME)
+  file(READ ${INPUT} HEX HEX)
+  string(LENGTH "${HEX}" HEX_LENGTH)
+  math(EXPR SIZE "${HEX_LENGTH} / 2")
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+  string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n    " BYTES "${BYTES}")
+  string(APPEND ARRAYS "static const unsigned char s_kernel${INDEX}[] = {\n    ${BYTES}0x00\n};\n\n")
+  string(APPEND ENTRIES "    { \"${NAME}\", s_kernel${INDEX}, ${SIZE} },\n")
+  math(EXPR INDEX "${INDEX} + 1")
+endforeach()
+
+set(CONTENT "// Generated by cmake/embed_kernels.cmake, do not edit.
+#include <string>
+
+${ARRAYS}struct embedded_kernel
+{
+    const char* name;
+    const unsigned char* data;
+    size_t size;
+};
+
+static const embedded_kernel s_kernels[] = {
+${ENTRIES}    { nullptr, nullptr, 0 }
+};
+
+namespace cl_kernel_sources
+{
+    bool find_embedded(const std::string& name, std::string& source)
+    {
+        for (const embedded_kernel* k = s_kernels; k->name; k++)
+        {
+            if (name == k->name)
+            {
+                source.assign((const char*)k->data, k->size);
+                return true;
+            }
+        }
+        return false;
+    }
+}
+")
+
+# Only touch the file when the content changes, to avoid needless recompilation.
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} OLD_CONTENT)
+endif()
+if(NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+  file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
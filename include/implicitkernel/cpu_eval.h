@@ -0,0 +1,258 @@
+#pragma once
+#include "host_primitives.h"
+#include <utility>
+#include <vector>
+
+namespace cpu_eval
+{
+    /**
+     * \brief Number of points evaluated together, in structure-of-arrays form,
+     * by one pass over the flattened program.
+     */
+    constexpr size_t BLOCK_SIZE = 64;
+
+    /**
+     * \brief A closed range of values, used to bound a field over a box.
+     */
+    struct interval
+    {
+        float lo;
+        float hi;
+    };
+
+    /**
+     * \brief An axis aligned box. Unbounded sides are infinite.
+     */
+    struct aabb
+    {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+
+    /**
+     * \brief Host side copy of the render data of an entity, i.e. the exact buffers
+     * produced by entities::entity::copy_render_data. This can be evaluated on the CPU
+     * for large batches of points, mirroring f_entity from kernel_primitives.clh.
+     */
+    struct program
+    {
+        std::vector<uint8_t> bytes;
+        std::vector<uint32_t> offsets;
+        std::vector<uint8_t> types;
+        std::vector<op_step> steps;
+        size_t numRegisters = 0;
+
+        program() = default;
+
+        /**
+         * \brief Creates a program by copying the given render data.
+         * \param bytes Packed bytes of the simple entities.
+         * \param nBytes Number of packed bytes.
+         * \param offsets Byte offsets of the simple entities.
+         * \param types Types of the simple entities.
+         * \param nEntities Number of simple entities.
+         * \param steps The csg steps.
+         * \param nSteps Number of csg steps.
+         */
+        program(const uint8_t* bytes, size_t nBytes, const uint32_t* offsets, const uint8_t* types,
+            size_t nEntities, const op_step* steps, size_t nSteps);
+
+        /**
+         * \brief Creates a program by flattening the given entity.
+         * \param entity The entity.
+         */
+        explicit program(const entities::ent_ref& entity);
+
+        /**
+         * \brief Number of floats of scratch memory needed by eval_block.
+         */
+        size_t scratch_size() const;
+
+        /**
+         * \brief Evaluates at most BLOCK_SIZE points.
+         * \param x The x coordinates of the points.
+         * \param y The y coordinates of the points.
+         * \param z The z coordinates of the points.
+         * \param out The values will be written here.
+         * \param n The number of points, must not be greater than BLOCK_SIZE.
+         * \param scratch Scratch memory of at least scratch_size() floats.
+         */
+        void eval_block(const float* x, const float* y, const float* z, float* out, size_t n, float* scratch) const;
+
+        /**
+         * \brief Evaluates any number of points, splitting the work across threads.
+         * \param x The x coordinates of the points.
+         * \param y The y coordinates of the points.
+         * \param z The z coordinates of the points.
+         * \param out The values will be written here.
+         * \param n The number of points.
+         * \param nThreads The number of threads to use. Zero means use all cores.
+         */
+        void eval(const float* x, const float* y, const float* z, float* out, size_t n, size_t nThreads = 0) const;
+
+        /**
+         * \brief Evaluates a single point. Use the batch functions for anything performance sensitive.
+         */
+        float eval(float x, float y, float z) const;
+
+        /**
+         * \brief Computes conservative bounds of the field inside the given box with interval arithmetic.
+         * \param min The minimum corner of the box.
+         * \param max The maximum corner of the box.
+         */
+        interval bounds(const glm::vec3& min, const glm::vec3& max) const;
+
+        /**
+         * \brief Creates a shorter program that is exactly equivalent to this one inside the given box.
+         * Operations whose result is provably equal to one of their operands everywhere in the box
+         * are replaced by that operand, e.g. a union with a far away entity, or a subtraction whose
+         * cutter does not reach the box. Steps and entities that are no longer needed are removed.
+         * \param min The minimum corner of the box.
+         * \param max The maximum corner of the box.
+         * \param bounds If not null, the bounds of the field inside the box are written here.
+         */
+        program specialize(const glm::vec3& min, const glm::vec3& max, interval* bounds = nullptr) const;
+
+        /**
+         * \brief A box containing the solid, i.e. every point where the field is not positive.
+         * Lattices, halfspaces and polyfaces are unbounded, so the box can be infinite.
+         */
+        aabb solid_bounds() const;
+
+        /**
+         * \brief Finds the subtrees of steps that the kernel can skip at points far from their box,
+         * see cull_range in primitives.clh. The ranges are sorted by their first step, and enclosing
+         * ranges come before the ranges they contain.
+         */
+        std::vector<cull_range> cull_ranges() const;
+
+        /**
+         * \brief An upper bound of the magnitude of the gradient of the field, so that the field
+         * divided by it never exceeds the distance to the surface. The blends are bounded near
+         * their surface only, where their value is small.
+         */
+        float lipschitz_bound() const;
+    };
+
+    /**
+     * \brief Two boxes of a value of a program. The solid box contains every point where the value
+     * is not positive. The distance box is such that the value is never smaller than the distance to
+     * it, at points outside it. Intersections and blends make the two different.
+     */
+    struct value_bounds
+    {
+        aabb solid;
+        aabb dist;
+    };
+
+    /**
+     * \brief The boxes of the results of all the steps of a program, see program::solid_bounds and
+     * program::cull_ranges. When a parameter of an entity or a step changes, only the boxes of the
+     * steps using its result, directly or through other steps, are computed again.
+     */
+    class step_boxes
+    {
+    public:
+        step_boxes() = default;
+
+        /**
+         * \brief Computes the boxes of all the steps of the program.
+         */
+        explicit step_boxes(const program& prog);
+
+        /**
+         * \brief Updates the boxes after the packed bytes of the simple entity changed.
+         * \param prog The program the boxes were computed for, with the new bytes.
+         * \param entity The index of the entity.
+         */
+        void entity_changed(const program& prog, size_t entity);
+
+        /**
+         * \brief Updates the boxes after the operator data of the step changed. The type of the
+         * operator must stay the same.
+         * \param prog The program the boxes were computed for, with the new step.
+         * \param step The index of the step.
+         */
+        void step_changed(const program& prog, size_t step);
+
+        /**
+         * \brief See program::solid_bounds.
+         */
+        aabb solid_bounds(const program& prog) const;
+
+        /**
+         * \brief See program::cull_ranges.
+         */
+        std::vector<cull_range> cull_ranges(const program& prog) const;
+
+    private:
+        static constexpr size_t NONE = SIZE_MAX;
+        std::vector<value_bounds> m_leaves;
+        std::vector<value_bounds> m_results;
+        // The steps producing the operands of every step through the registers, NONE for entities.
+        std::vector<std::pair<size_t, size_t>> m_producers;
+        std::vector<std::vector<size_t>> m_consumers; // The steps using the result of every step.
+        std::vector<std::vector<size_t>> m_readers; // The steps using every entity directly.
+        size_t m_root = NONE; // The step writing the result of the program.
+
+        void compute(const program& prog, size_t step);
+        void recompute_from(const program& prog, std::vector<size_t> dirty);
+    };
+
+    /**
+     * \brief Octree over a box, where every leaf holds the program specialized for that leaf.
+     * Points are evaluated with the program of the leaf they fall in, so most points only pay
+     * for the few entities near them. Points outside the box use the full program.
+     */
+    class region_tree
+    {
+    public:
+        /**
+         * \brief Builds the tree. A node is subdivided until its program has no csg steps left,
+         * or the maximum depth is reached.
+         * \param prog The program to be specialized.
+         * \param min The minimum corner of the box.
+         * \param max The maximum corner of the box.
+         * \param maxDepth The maximum depth of the tree.
+         */
+        region_tree(const program& prog, const glm::vec3& min, const glm::vec3& max, size_t maxDepth = 4);
+
+        /**
+         * \brief The program to be used for the given point.
+         */
+        const program& find(float x, float y, float z) const;
+
+        /**
+         * \brief Evaluates any number of points, grouped by the leaf they fall in.
+         * \param x The x coordinates of the points.
+         * \param y The y coordinates of the points.
+         * \param z The z coordinates of the points.
+         * \param out The values will be written here.
+         * \param n The number of points.
+         * \param nThreads The number of threads to use. Zero means use all cores.
+         */
+        void eval(const float* x, const float* y, const float* z, float* out, size_t n, size_t nThreads = 0) const;
+
+        /**
+         * \brief The number of leaves of the tree.
+         */
+        size_t num_leaves() const;
+
+    private:
+        struct node
+        {
+            glm::vec3 min;
+            glm::vec3 max;
+            size_t firstChild; // Zero for leaves, the root is never a child.
+            size_t programIndex;
+        };
+
+        program m_full;
+        std::vector<node> m_nodes;
+        std::vector<program> m_programs;
+        size_t m_numLeaves;
+
+        void build(size_t nodeIndex, size_t depth, size_t maxDepth);
+        size_t find_leaf(float x, float y, float z) const;
+    };
+}
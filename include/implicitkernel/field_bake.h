@@ -0,0 +1,126 @@
+#pragma once
+#include "cpu_eval.h"
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace field_bake
+{
+    /**
+     * \brief Samples along every edge of a brick, must match BRICK_SIZE in render.cl. A brick
+     * covers one coarse cell, with samples on both of its faces, so neighbouring bricks agree.
+     */
+    constexpr uint32_t BRICK_SIZE = 8;
+
+    /**
+     * \brief Coarse cells along the longest side of the baked box.
+     */
+    constexpr uint32_t COARSE_CELLS = 64;
+
+    /**
+     * \brief Bricks along the x and y axes of the atlas. The atlas grows in layers of
+     * ATLAS_BRICKS x ATLAS_BRICKS bricks along z, which are baked and uploaded one at a time.
+     */
+    constexpr uint32_t ATLAS_BRICKS = 32;
+
+    /**
+     * \brief The most layers of the atlas. Cells near the surface beyond that many bricks
+     * are left to the coarse grid, which only makes the rays step shorter there.
+     */
+    constexpr uint32_t MAX_LAYERS = 16;
+
+    /**
+     * \brief Cells with a corner nearer to the surface than this many cell sizes get a brick.
+     * Further away, the coarse grid alone lets the rays step by more than a cell.
+     */
+    constexpr float NARROW_BAND = 3.0f;
+
+    /**
+     * \brief Means the brick map has no layer of the atlas yet, only the coarse grid.
+     */
+    constexpr uint32_t NO_LAYER = UINT32_MAX;
+
+    /**
+     * \brief The field sampled on a coarse grid over a box, and finely in bricks of the cells near
+     * the surface. Trilinear interpolation of the samples is off from the field by less than the
+     * Lipschitz bound times sqrt(3) times the spacing of the samples, see baked_distance in render.cl.
+     */
+    struct brick_map
+    {
+        uint64_t generation = 0; // Of the scene the map was baked for, see baker::request.
+        glm::vec3 min = { 0.0f, 0.0f, 0.0f }; // The first corner of the first cell.
+        float cellSize = 0.0f;
+        uint32_t cells[3] = { 0, 0, 0 };
+        std::vector<float> coarse; // The corners of the cells, (cells + 1) per axis, x fastest.
+        /*Four per cell, x fastest: the brick of the cell in the atlas, counted in bricks, and one
+        once the brick is baked, or zero while the coarse grid has to be used.*/
+        std::vector<uint16_t> index;
+        uint32_t layers = 0; // Layers of the atlas.
+        uint32_t layer = NO_LAYER; // The layer in layerSamples.
+        std::vector<float> layerSamples; // The samples of the layer, in the layout of the atlas.
+    };
+
+    /**
+     * \brief The cells a brick map of the box would have along every axis, and their size. The
+     * cells are cubes, and cover the box. There are at least two along every axis, as 3d images
+     * need a depth of two.
+     */
+    void grid_size(const cpu_eval::aabb& box, uint32_t(&cells)[3], float& cellSize);
+
+    /**
+     * \brief Bakes brick maps of scenes on a thread of its own, and publishes every brick map
+     * as soon as its coarse grid is done, and again after every layer of bricks. A new request
+     * abandons the bake that is still running.
+     */
+    class baker
+    {
+    public:
+        /**
+         * \brief Called on the thread of the baker. The map is only valid during the call.
+         */
+        typedef std::function<void(const brick_map&)> publish_fn;
+
+        explicit baker(publish_fn publish);
+        ~baker();
+
+        baker(const baker&) = delete;
+        const baker& operator=(const baker&) = delete;
+
+        /**
+         * \brief Bakes the field inside the box, replacing the previous request.
+         * \param generation Tells the published brick maps apart from those of older requests.
+         * \param prog The field.
+         * \param lipschitz Bound of the gradient of the field.
+         * \param box The box to bake, must be finite and not empty.
+         */
+        void request(uint64_t generation, cpu_eval::program prog, float lipschitz, const cpu_eval::aabb& box);
+
+        /**
+         * \brief Abandons the requests of older generations, nothing more is published for them.
+         */
+        void cancel(uint64_t generation);
+
+    private:
+        struct job
+        {
+            uint64_t generation;
+            cpu_eval::program prog;
+            float lipschitz;
+            cpu_eval::aabb box;
+        };
+
+        publish_fn m_publish;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::unique_ptr<job> m_pending;
+        uint64_t m_latest = 0; // The generation of the last request or cancel.
+        bool m_exit = false;
+        std::thread m_thread;
+
+        void run();
+        void bake(const job& work);
+        bool stale(uint64_t generation);
+    };
+}
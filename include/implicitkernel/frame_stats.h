@@ -0,0 +1,78 @@
+#pragma once
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace frame_stats
+{
+    /**
+     * \brief Percentiles of the samples of one timer in the rolling window, in milliseconds.
+     */
+    struct summary
+    {
+        size_t count = 0;
+        double mean = 0.0;
+        double p50 = 0.0;
+        double p90 = 0.0;
+        double p99 = 0.0;
+        double max = 0.0;
+    };
+
+    /**
+     * \brief Resources used by the kernel currently rendering the frames.
+     */
+    struct kernel_info
+    {
+        std::string name; // interpreter, private stack or compiled.
+        size_t privateMemSize = 0; // Bytes of private memory per work item.
+        size_t localMemSize = 0; // Bytes of local memory per work group, as reported by the driver.
+        size_t workGroupSize = 0;
+        size_t numRegisters = 0;
+    };
+
+    struct report
+    {
+        std::map<std::string, summary> timers;
+        kernel_info kernel;
+    };
+
+    /**
+     * \brief Number of samples kept per timer.
+     */
+    constexpr size_t WINDOW_SIZE = 256;
+
+    /**
+     * \brief Adds a sample to the named timer, dropping the oldest sample when the window is full.
+     * Can be called from any thread.
+     */
+    void record(const std::string& timer, double milliseconds);
+
+    void set_kernel_info(const kernel_info& info);
+
+    /**
+     * \brief Drops the samples of all timers.
+     */
+    void reset();
+
+    /**
+     * \brief Summarizes the samples currently in the window of every timer.
+     */
+    report get_report();
+
+    /**
+     * \brief Prints the report in a readable form.
+     */
+    void print(const report& r, std::ostream& out);
+
+    /**
+     * \brief Enables periodic logging of the report, called from tick().
+     * \param intervalSeconds Seconds between two log entries, zero disables logging.
+     * \param csvPath Rows are appended to this CSV file, or printed to the console if it is empty.
+     */
+    void set_log(double intervalSeconds, const std::string& csvPath);
+
+    /**
+     * \brief Called once per frame, writes the log entry when it is due.
+     */
+    void tick();
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <cstring>
 #include <stdint.h>
 #pragma warning(push)
@@ -21,13 +22,19 @@ extern "C" {
 #include <glm/glm.hpp>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
-
-constexpr size_t MAX_ENTITY_COUNT = 32;
+#include <vector>
 
 namespace entities {
 struct entity;
+struct render_graph;
+
+/**
+ * \brief Slot of an entity whose render data can't be patched in place.
+ */
+constexpr uint32_t NO_SLOT = UINT32_MAX;
 /**
  * \brief Reference to an entity.
  * This is just a shared pointer.
@@ -66,31 +73,35 @@ public:
 
   /**
    * \brief Copies the render data into the given destination buffers.
+   * Structurally identical simple entities and subtrees are written only once.
    * \param bytes The render data will be written to this buffer.
    * \param offsets The byte offsets of the simple entities (in the above
    * buffer). \param types The types of simple entities. \param steps The csg
-   * steps to be performed on the simple entities.
+   * steps to be performed on the simple entities. \param slots If not null,
+   * receives the index of every simple entity in the offsets, and of every
+   * csg entity in the steps, so that their data can be patched in place
+   * later. Entities that share their data with a different, structurally
+   * identical entity are mapped to NO_SLOT.
    */
-  void copy_render_data(uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types,
-                        op_step *&steps) const;
+  void copy_render_data(
+      uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+      std::unordered_map<const entity *, uint32_t> *slots = nullptr) const;
 
   /**
-   * \brief Copies the render data into the given destination buffers.
-   * \param bytes The render data will be written to this buffer.
-   * \param offsets The byte offsets of the simple entities (in the above
-   * buffer). \param types The types of simple entities. \param steps The csg
-   * steps to be performed on the simple entities. \param entityIndex For
-   * internal use. \param currentOffset For internal use. \param reg For
-   * internal use.
+   * \brief Sets a parameter of this entity, e.g. "radius" of a sphere.
+   * \param name The name of the parameter.
+   * \param value The new value.
+   * \return false If this entity has no parameter with the given name.
    */
-  virtual void copy_render_data_internal(
-      uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
-      size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const = 0;
+  virtual bool set_param(const std::string &name, float value);
 
-  virtual void render_data_size_internal(
-      size_t &nBytes, size_t &nSteps,
-      std::unordered_set<entity *> &simpleEntities) const = 0;
+  /**
+   * \brief Adds this entity and its csg tree to the given graph, in which
+   * structurally identical entities and subtrees share a single node.
+   * \param graph The graph.
+   * \return uint32_t The index of the node representing this entity.
+   */
+  virtual uint32_t hash_cons(render_graph &graph) const = 0;
 
   /**
    * \brief Returns a reference to the copy of the given entity.
@@ -131,13 +142,8 @@ private:
 public:
   virtual bool simple() const;
   virtual uint8_t type() const;
-  virtual void
-  render_data_size_internal(size_t &nBytes, size_t &nSteps,
-                            std::unordered_set<entity *> &simpleEntities) const;
-  virtual void copy_render_data_internal(
-      uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
-      size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const;
+  virtual uint32_t hash_cons(render_graph &graph) const;
+  virtual bool set_param(const std::string &name, float value);
 
   comp_entity(const comp_entity &) = delete;
   const comp_entity &operator=(const comp_entity &) = delete;
@@ -239,20 +245,21 @@ public:
 struct simp_entity : public entity {
   const simp_entity &operator=(const simp_entity &) = delete;
 
+  /**
+   * \brief Gets the render bytes of this entity, as written into the render
+   * data.
+   * \param bytes Will be resized and filled with the bytes.
+   */
+  void render_bytes(std::vector<uint8_t> &bytes) const;
+
 protected:
   simp_entity() = default;
   virtual ~simp_entity() = default;
 
   virtual bool simple() const;
-  virtual void
-  render_data_size_internal(size_t &nBytes, size_t &nSteps,
-                            std::unordered_set<entity *> &simpleEntities) const;
   virtual size_t num_render_bytes() const = 0;
   virtual void write_render_bytes(uint8_t *&bytes) const = 0;
-  virtual void copy_render_data_internal(
-      uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
-      size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const;
+  virtual uint32_t hash_cons(render_graph &graph) const;
 };
 
 /**
@@ -276,6 +283,7 @@ struct box3 : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 /**
@@ -296,6 +304,7 @@ struct sphere3 : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 /**
@@ -321,6 +330,7 @@ struct cylinder3 : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 /**
@@ -339,6 +349,7 @@ struct gyroid : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 /**
@@ -357,6 +368,7 @@ struct schwarz : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 /**
@@ -376,6 +388,7 @@ struct halfspace : public simp_entity {
   virtual uint8_t type() const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
+  virtual bool set_param(const std::string &name, float value);
 };
 
 template <size_t N> struct polyface : public simp_entity {
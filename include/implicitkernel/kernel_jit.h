@@ -0,0 +1,26 @@
+#pragma once
+#include "host_primitives.h"
+#include <string>
+
+namespace kernel_jit
+{
+    /**
+     * \brief Hash of the structure of the render data, i.e. the types and offsets of the simple
+     * entities and the wiring of the csg steps, but not their parameters. Two trees with the same
+     * hash produce the same generated source.
+     */
+    uint64_t structural_hash(const uint32_t* offsets, const uint8_t* types, size_t nEntities,
+        const op_step* steps, size_t nSteps);
+
+    /**
+     * \brief Generates OpenCL C code for f_entity_jit, a straight-line version of f_entity for the given
+     * render data. The type of every simple entity, its offset in the packed buffer and the csg operation
+     * of every step are baked into the code, and the values are kept in private variables instead of
+     * the local buffers. The parameters are still read from the packed and step buffers, so that trees
+     * differing only in their parameters share the same compiled program.
+     * f_entity_jit_dual is generated alongside, returning the gradient as well for shading.
+     * The generated code must be placed before render.cl, which uses it when JIT_ENTITY is defined.
+     */
+    std::string generate(const uint32_t* offsets, const uint8_t* types, size_t nEntities,
+        const op_step* steps, size_t nSteps);
+}
@@ -10,6 +10,22 @@ static std::string load_source(const char* filename);
 
 namespace cl_kernel_sources
 {
+    /**
+     * \brief The source of the render kernel, with all includes expanded.
+     */
     std::string render_kernel();
     std::string abs_path();
+
+    /**
+     * \brief Looks up a kernel source file embedded in the binary at build time.
+     * Returns false if no file with the given name was embedded.
+     */
+    bool find_embedded(const std::string& name, std::string& source);
+
+    /**
+     * \brief Replaces the #include "..." directives in the given source with the contents of the
+     * included kernel files, recursively. This makes the source self contained, so it can be built
+     * without include paths and hashed as a whole.
+     */
+    std::string expand_includes(const std::string& source);
 }
@@ -0,0 +1,34 @@
+#pragma once
+#include "cpu_eval.h"
+#include <string>
+
+namespace mesher
+{
+    struct mesh_stats
+    {
+        size_t numVertices = 0;
+        size_t numTriangles = 0;
+        size_t numLeaves = 0; // Octree leaves that were not pruned.
+    };
+
+    /**
+     * \brief Extracts the surface of the entity as a closed triangle mesh, using dual contouring
+     * on a uniform grid of cells of the given size, and streams it to a binary STL or PLY file
+     * (chosen by the extension). The build volume is processed in slabs along the z axis. Within a
+     * slab, an octree over the grid prunes the nodes the surface can't pass through, and the remaining
+     * leaves of uniform cells are processed on all cores, so memory is bounded by the active leaves of
+     * two slabs rather than the full grid. Cells are not merged, so the triangles are all of about
+     * the cell size. The region outside the bounds is treated as empty,
+     * so the mesh is closed even where the entity touches the bounds.
+     * \param entity The entity to be meshed.
+     * \param minBounds The minimum corner of the region to be meshed.
+     * \param maxBounds The maximum corner of the region to be meshed.
+     * \param cellSize The edge length of the cells.
+     * \param path Path of the .stl or .ply file to be written.
+     * \param stats If not null, the statistics of the mesh are written here.
+     * \return true If the mesh was written.
+     * \return false If the file could not be written or the arguments are invalid.
+     */
+    bool export_mesh(const entities::ent_ref& entity, const glm::vec3& minBounds, const glm::vec3& maxBounds,
+        float cellSize, const std::string& path, mesh_stats* stats = nullptr);
+}
@@ -0,0 +1,10 @@
+#pragma once
+/*The OpenCL C++ bindings with the options of this project, for headers that need the OpenCL types
+but not the viewer. cl.hpp includes gl.h, so glew.h has to come first wherever this is included.*/
+#include <GL/glew.h>
+#define __CL_ENABLE_EXCEPTIONS
+//#define __NO_STD_STRING
+#define  _VARIADIC_MAX 16
+#define CL_USE_DEPRECATED_OPENCL_1_1_APIS
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.hpp>
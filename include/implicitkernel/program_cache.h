@@ -0,0 +1,33 @@
+#pragma once
+#include "opencl.h"
+#include <string>
+
+namespace program_cache
+{
+    /**
+     * \brief Builds the program for the device, reusing the binary from a previous build if one was
+     * cached on disk for the same device, driver version, build options and source. Otherwise the
+     * program is built from source and its binary is cached. Any problem with the cache only falls back
+     * to building from source, so this throws the same errors as cl::Program::build.
+     * The cache lives in IMPLICIT_CL_CACHE if that environment variable is set, otherwise in the
+     * user's cache directory. Setting IMPLICIT_CL_CACHE to an empty string disables the cache.
+     * \param context The OpenCL context.
+     * \param device The device to build for.
+     * \param source The complete source, with all includes expanded.
+     * \param options The build options.
+     * \param program The built program is written here, also if the build fails, to read the log.
+     */
+    void build(const cl::Context& context, const cl::Device& device, const std::string& source,
+        const std::string& options, cl::Program& program);
+
+    /**
+     * \brief The directory of the cache, or an empty string if the cache is disabled.
+     */
+    std::string directory();
+
+    /**
+     * \brief A name for a temporary file next to the given path, unique across processes and threads.
+     * Files in the cache are written under such a name and renamed, so readers never see a partial file.
+     */
+    std::string temp_path(const std::string& path);
+}
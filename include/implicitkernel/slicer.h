@@ -0,0 +1,99 @@
+#pragma once
+#include "cpu_eval.h"
+#include <string>
+
+namespace slicer
+{
+    /**
+     * \brief Pixels per edge of the square tiles a layer is sampled in. Tiles the surface can't
+     * pass through are filled without sampling.
+     */
+    constexpr uint32_t TILE_PIXELS = 64;
+
+    /**
+     * \brief The file written for every layer.
+     */
+    enum class layer_format
+    {
+        svg, // The contours as the path of an SVG drawing, in the units of the model.
+        polygons, // The contours in binary, see polygon_header.
+        rle, // The pixels inside the solid as runs of every row, see bitmap_header.
+    };
+
+    constexpr char POLYGON_MAGIC[8] = { 'I', 'M', 'P', 'S', 'L', 'C', 'P', '1' };
+    constexpr char BITMAP_MAGIC[8] = { 'I', 'M', 'P', 'S', 'L', 'C', 'R', '1' };
+    constexpr uint32_t FORMAT_VERSION = 1;
+
+    /**
+     * \brief The start of a polygon file. It is followed by the number of points of every contour
+     * as uint32, and then by the x and y of all the points as floats. The contours are closed, and
+     * the solid is on their left. All numbers are little endian.
+     */
+    struct polygon_header
+    {
+        char magic[8]; // POLYGON_MAGIC.
+        uint32_t version;
+        uint32_t numContours;
+        uint32_t numPoints;
+        float z;
+    };
+
+    /**
+     * \brief The start of a bitmap file. Pixel (i, j) is centered on origin + (i + 0.5, j + 0.5) *
+     * pixelSize. The header is followed by height + 1 uint32, where the runs of row j are those from
+     * the j-th to the (j + 1)-th, and then by the runs, each a uint32 first pixel and a uint32 length
+     * of pixels inside the solid. All numbers are little endian.
+     */
+    struct bitmap_header
+    {
+        char magic[8]; // BITMAP_MAGIC.
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        float pixelSize;
+        float origin[2];
+        float z;
+        uint32_t numRuns;
+    };
+
+    static_assert(sizeof(polygon_header) == 24, "The polygon header must not be padded");
+    static_assert(sizeof(bitmap_header) == 40, "The bitmap header must not be padded");
+
+    struct slice_stats
+    {
+        size_t numLayers = 0;
+        size_t numContours = 0;
+        size_t numTiles = 0;
+        size_t numSampledTiles = 0; // Tiles that interval arithmetic could not prove inside or outside.
+    };
+
+    /**
+     * \brief Finds the format with the given name, svg, polygons or rle.
+     * \return false If there is no format with this name.
+     */
+    bool parse_format(const std::string& name, layer_format& format);
+
+    /**
+     * \brief Slices the entity into layers along z, without meshing it. The field is sampled on a
+     * grid of pixels on the middle plane of every layer, and the contours are extracted with
+     * marching squares, separating the diagonal corners of a pixel by the value at its center.
+     * The layers are processed in parallel on all cores, and within a layer the pixels are sampled
+     * in tiles with the program specialized for the tile. Every layer is written to a file of its
+     * own as soon as it is done, named layer_00000 onwards with the extension of the format. The
+     * region outside the bounds is treated as empty, so the contours are closed where the entity
+     * touches the bounds.
+     * \param entity The entity to be sliced.
+     * \param minBounds The minimum corner of the region to be sliced, the first layer starts at its z.
+     * \param maxBounds The maximum corner of the region to be sliced.
+     * \param layerHeight The thickness of the layers.
+     * \param pixelSize The spacing of the samples within a layer.
+     * \param format The format of the layer files.
+     * \param directory The directory the layer files are written to, created if needed.
+     * \param stats If not null, the statistics of the slicing are written here.
+     * \return true If all the layers were written.
+     * \return false If a file could not be written or the arguments are invalid.
+     */
+    bool slice(const entities::ent_ref& entity, const glm::vec3& minBounds, const glm::vec3& maxBounds,
+        float layerHeight, float pixelSize, layer_format format, const std::string& directory,
+        slice_stats* stats = nullptr);
+}
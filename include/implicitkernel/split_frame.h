@@ -0,0 +1,137 @@
+#pragma once
+#include "host_primitives.h"
+#include "opencl.h"
+#include "trace_kernel.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace split_frame
+{
+    /**
+     * \brief Every OpenCL device of the machine, of all platforms, in a fixed order.
+     */
+    std::vector<cl::Device> all_devices();
+
+    /**
+     * \brief The name of the device and of its platform, for listing.
+     */
+    std::string describe(const cl::Device& device);
+
+    /**
+     * \brief The size of the grid of work items tracing a band of rows, see k_trace.
+     * \param width The width of the frame.
+     * \param rows The height of the band.
+     * \param lod The level of detail of the pass.
+     * \param refine Whether only the pixels new at the level are traced.
+     */
+    void trace_grid(uint32_t width, uint32_t rows, uint8_t lod, bool refine, size_t& nx, size_t& ny);
+
+    /**
+     * \brief Splits the rows of the frame into one band per device, in proportion to their shares.
+     * Every band starts on a multiple of the granularity, and devices with a share get at least one
+     * granule of rows if the frame is tall enough.
+     * \param shares The fraction of the frame every device can trace in the same time.
+     * \return The first row of every band, followed by the height.
+     */
+    std::vector<uint32_t> balance(const std::vector<double>& shares, uint32_t height, uint32_t granularity);
+
+    /**
+     * \brief A device that traces a band of the rows of every frame, besides the device presenting the
+     * frames. It has its own context, queue and copy of the render data, and always interprets the csg
+     * steps, without a baked field. The pixels and hit distances of the band are read back to the host,
+     * to be composited into the frame.
+     */
+    class helper
+    {
+    public:
+        /**
+         * \brief Builds the render program for the device. Throws cl::Error if that fails.
+         */
+        helper(const cl::Device& device, const std::string& source, const std::string& options);
+
+        const cl::Device& device() const;
+
+        /**
+         * \brief Reallocates the pixels and hit distances for frames of the given size.
+         */
+        void resize(uint32_t width, uint32_t height);
+
+        /**
+         * \brief Uploads the render data and waits for the upload.
+         */
+        void upload(const std::vector<uint8_t>& packed, const std::vector<uint8_t>& types,
+            const std::vector<uint32_t>& offsets, const std::vector<op_step>& steps,
+            const std::vector<cull_range>& culls, const cl_float8& sceneBounds, float lipschitz);
+
+        /**
+         * \brief Writes the parts of the render data changed by parameters, without waiting for the
+         * frames in flight. The numbers of entities and steps are those of the last upload.
+         * \param packed, steps The whole render data, only the given ranges and steps are written.
+         * \param byteRanges The changed ranges of the packed bytes, as offset and size.
+         * \param changedSteps The indices of the changed steps.
+         */
+        void patch(const std::vector<uint8_t>& packed, const std::vector<op_step>& steps,
+            const std::vector<std::pair<size_t, size_t>>& byteRanges, const std::vector<size_t>& changedSteps,
+            const std::vector<cull_range>& culls, const cl_float8& sceneBounds, float lipschitz);
+
+        /**
+         * \brief False if the render data doesn't fit on the device, or the registers of the csg steps
+         * don't fit in its local memory.
+         */
+        bool can_trace() const;
+
+        /**
+         * \brief Enqueues tracing the rows from first to end, and reading their pixels and hit distances
+         * back, without waiting. The hit distances of the band are forgotten unless refining, as the rows
+         * may have belonged to another device.
+         * \param colors, depths Receive the rows of the band, and must stay valid until finish returns.
+         */
+        void trace(const cl_float16& view, uint8_t lod, bool refine, uint32_t first, uint32_t end,
+            uint32_t* colors, float* depths);
+
+        /**
+         * \brief Waits for the last trace and its reads.
+         * \return The time from the start of the trace until the band was read, in milliseconds, or
+         * zero if the band was empty.
+         */
+        double finish();
+
+    private:
+        cl::Device m_device;
+        cl::Context m_context;
+        cl::CommandQueue m_queue;
+        cl::Program m_program;
+        std::unique_ptr<trace_kernel> m_kernel;
+        size_t m_maxBufSize = 0;
+        size_t m_maxLocalBufSize = 0;
+        size_t m_groupSize = 1; // Work items per group, along a row of the traced grid.
+        cl::Buffer m_packedBuf;
+        cl::Buffer m_typeBuf;
+        cl::Buffer m_offsetBuf;
+        cl::Buffer m_opStepBuf;
+        cl::Buffer m_cullBuf;
+        cl::Buffer m_pixels; // The whole frame, the device only writes the rows of its band.
+        cl::Buffer m_depth;
+        cl::Buffer m_cone; // Zero, the tiles are not cone marched on helpers.
+        cl::Image3D m_noBake; // Bound for the baked field, which helpers don't have.
+        cl::LocalSpaceArg m_regBuf;
+        uint32_t m_width = 0;
+        uint32_t m_height = 0;
+        size_t m_nEntities = 0;
+        size_t m_nSteps = 0;
+        size_t m_nRegisters = 0;
+        size_t m_nCulls = 0;
+        bool m_fits = false; // The last upload fit in the buffers.
+        cl_float8 m_sceneBounds = {};
+        float m_lipschitz = 1.0f;
+        cl::Event m_traced;
+        cl::Event m_read;
+        // Copies of the patched render data, read by the writes of the last patch until they finish.
+        std::vector<uint8_t> m_packed;
+        std::vector<op_step> m_steps;
+        std::vector<cull_range> m_culls;
+        std::vector<cl::Event> m_patched;
+    };
+}
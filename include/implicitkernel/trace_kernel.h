@@ -0,0 +1,15 @@
+#pragma once
+#include "opencl.h"
+
+/**
+ * \brief The arguments of k_trace, see render.cl.
+ */
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&,
+    cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uint, cl_float8, cl_float,
+    cl_float16, cl::Buffer&, cl::Buffer&, cl::Image3D&, cl::Image3D&, cl::Image3D&, cl_float4,
+    cl_uint2, cl_uint2, cl_uchar, cl_uchar, cl_uchar
+#ifdef CLDEBUG
+    , cl_uint2
+#endif // CLDEBUG
+> trace_kernel;
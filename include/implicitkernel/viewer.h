@@ -2,14 +2,9 @@
 #include <iostream>
 #include "host_primitives.h"
 
-/*glew.h, cl.hpp and glfw3.h should be included in this specific order to not get dumb warnings.*/
-#include <GL/glew.h>
-#define __CL_ENABLE_EXCEPTIONS
-//#define __NO_STD_STRING
-#define  _VARIADIC_MAX 16
-#define CL_USE_DEPRECATED_OPENCL_1_1_APIS
-#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
-#include <CL/cl.hpp>
+/*glew.h, cl.hpp (both in opencl.h) and glfw3.h should be included in this specific order to not get dumb warnings.*/
+#include "opencl.h"
+#include "trace_kernel.h"
 #include <GLFW/glfw3.h>
 
 #ifdef _DEBUG
@@ -69,6 +64,17 @@ namespace viewer
         glm::vec3 maxBounds;
     };
 
+    /**
+     * \brief Work done by the sphere tracer in one frame, see measure_march.
+     */
+    struct march_stats
+    {
+        uint64_t rays = 0; // Primary rays cast, one per pixel at the level of detail.
+        uint64_t marchedRays = 0; // Rays that hit the bounds and were marched.
+        uint64_t iterations = 0; // March iterations of all the rays.
+        uint64_t evaluations = 0; // Evaluations of the field, including the shading and the cones of the tiles.
+    };
+
     bool log_gl_errors(const char* function, const char* file, uint32_t line);
     void clear_gl_errors();
     /**
@@ -87,22 +93,107 @@ namespace viewer
 
     /**
      * \brief Initializes the OpenCL part of the environment.
+     * \param headless If true, any OpenCL device is used and the frames are rendered
+     * to a plain device buffer, without sharing anything with OpenGL. init_ogl must not be
+     * called in this mode.
      */
-    void init_ocl();
+    void init_ocl(bool headless = false);
     void init_buffers();
+    /**
+     * \brief Picks the shape of the work groups for the current kernel, from the results of earlier
+     * tuning on this device. If there are none, the shapes are benchmarked over the next frames.
+     */
     void set_work_group_size();
     static void pause_render_loop();
     static void resume_render_loop();
     static void add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities, op_step* steps, size_t nSteps);
 
     void show_entity(entities::ent_ref entity);
+    /**
+     * \brief Sets a parameter of the entity. If the entity is part of the shown entity, the change is
+     * handed to the render thread, which uploads only the bytes of that primitive or csg step before its
+     * next frame, without flattening the tree again. Throws if the entity has no parameter with the given name.
+     */
+    void set_param(entities::ent_ref entity, const std::string& name, float value);
 
     void render();
+    /**
+     * \brief Renders one frame in headless mode and waits for it to finish.
+     * \param lod The level of detail, 0 traces every pixel.
+     * \param cold If true, the hit distances and cones of the previous frame are forgotten, so the
+     * rays don't start from them even if the view is the same, e.g. to time every frame alike.
+     */
+    void render_headless(uint8_t lod = 0, bool cold = false);
+    /**
+     * \brief Changes the size of the frames. Throws if not in headless mode.
+     */
+    void set_resolution(uint32_t width, uint32_t height);
+    void set_camera(float distance, float theta, float phi, const glm::vec3& target);
+    /**
+     * \brief Counts the rays, march iterations and field evaluations of a frame traced from the current
+     * camera at the given level of detail, with the shown render data. The frame is traced like
+     * render_headless traces a cold one, with the cones and the baked field but without starting the
+     * rays from the previous hits. Waits for the counts.
+     */
+    march_stats measure_march(uint8_t lod);
+    /**
+     * \brief The entity shown with show_entity, or nullptr.
+     */
+    entities::ent_ref shown_entity();
+    /**
+     * \brief Stops showing any entity.
+     */
+    void clear();
+    void device_info(std::string& platform, std::string& device, std::string& driver);
     void update_LOD();
     void reset_LOD();
     bool exportframe(const std::string& path);
     void setbounds(float(&bounds)[6]);
+    void getbounds(float(&bounds)[6]);
     void adaptive_rendermode(uint8_t lod);
+    /**
+     * \brief Enables or disables interpolating between the traced pixels of the coarse frames when
+     * they are presented, instead of showing every traced pixel as a block.
+     */
+    void upscale_mode(bool flag);
+    /**
+     * \brief Enables or disables compiling the csg tree of every shown entity into a specialized
+     * kernel. Kernels are cached by the structure of the tree, so editing only the parameters
+     * does not recompile. Takes effect the next time an entity is shown.
+     */
+    void jit_mode(bool flag);
+    /**
+     * \brief Enables or disables tuning the shape of the work groups of the trace kernel, see
+     * set_work_group_size. Disabled, the work groups keep the default shape and the shapes stored by
+     * earlier runs are ignored, e.g. for benchmarks that must not depend on them.
+     */
+    void tune_mode(bool flag);
+    /**
+     * \brief Switches the interpreter between keeping the intermediate csg values in local memory,
+     * where the work group size shrinks as the scene grows, and keeping them in a small private
+     * stack, which leaves the work group size independent of the scene. Trees that need more
+     * registers than the private stack holds still use local memory. Takes effect immediately.
+     */
+    void private_stack_mode(bool flag);
+    /**
+     * \brief Prints every OpenCL device of the machine with its index for use_devices, marking the
+     * devices in use.
+     */
+    void list_devices();
+    /**
+     * \brief Splits every frame into bands of rows, traced by the device presenting the frames and by
+     * the given devices at the same time. The bands are balanced by how fast every device traces.
+     * Throws if an index is out of range. Devices whose program doesn't build are skipped.
+     * \param indices Indices from list_devices, empty to only use the device presenting the frames.
+     */
+    void use_devices(const std::vector<size_t>& indices);
+    /**
+     * \brief Enables or disables baking the field of the shown entity into a sparse grid of samples
+     * in the background, which the rays march before evaluating the csg tree near the surface. The
+     * bake starts over whenever the scene or the bounds change, and the rays evaluate the tree all
+     * the way until it caught up. Devices tracing bands with use_devices always evaluate the tree.
+     */
+    void bake_mode(bool flag);
 
 #ifdef CLDEBUG
     void setdebugmode(bool flag);
@@ -0,0 +1,74 @@
+#pragma once
+#include "cpu_eval.h"
+#include <string>
+
+namespace volume_export
+{
+    /**
+     * \brief Samples per edge of a tile.
+     */
+    constexpr uint32_t TILE_SIZE = 16;
+
+    /**
+     * \brief Identifies the file format, followed by FORMAT_VERSION.
+     */
+    constexpr char MAGIC[8] = { 'I', 'M', 'P', 'S', 'D', 'F', 'V', '1' };
+    constexpr uint32_t FORMAT_VERSION = 1;
+
+    /**
+     * \brief The start of the file. All numbers are little endian.
+     */
+    struct file_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t tileSize; // TILE_SIZE.
+        float origin[3]; // The position of the first sample.
+        float voxelSize; // The distance between neighbouring samples.
+        uint32_t samples[3]; // Samples of the volume along every axis, the tiles on its far sides are partly outside.
+        float bandWidth; // Values beyond this magnitude are clamped to it.
+        uint64_t tileCount;
+        uint64_t indexOffset; // Where the index starts, tileCount entries sorted by z, y and x.
+    };
+
+    /**
+     * \brief Where a tile is stored. The samples of a tile are TILE_SIZE^3 int16 values, x fastest,
+     * and the value of a sample is the int16 times the scale of the tile.
+     */
+    struct index_entry
+    {
+        uint32_t tile[3]; // The first sample of the tile divided by TILE_SIZE.
+        float scale;
+        uint64_t offset; // From the start of the file, a multiple of 8.
+    };
+
+    static_assert(sizeof(file_header) == 64, "The header must not be padded");
+    static_assert(sizeof(index_entry) == 24, "The index entries must not be padded");
+
+    struct volume_stats
+    {
+        size_t numTiles = 0; // Tiles written.
+        size_t numSampledTiles = 0; // Tiles that interval arithmetic could not prune, including those found empty when sampled.
+        uint64_t fileSize = 0;
+    };
+
+    /**
+     * \brief Samples the field of the entity on a regular grid and streams the tiles of samples near
+     * the surface to a sparse volume file, see file_header. Tiles are found by pruning an octree with
+     * interval arithmetic, and sampled tiles without any value within the band are dropped too. The
+     * volume is processed in slabs along the z axis on all cores, and a slab is written before the
+     * next one starts, so only the tiles of one slab and the index are held in memory.
+     * \param entity The entity to be sampled.
+     * \param minBounds The minimum corner of the volume.
+     * \param maxBounds The maximum corner of the volume.
+     * \param voxelSize The distance between neighbouring samples.
+     * \param bandWidth Tiles are only written if a sample in them is within this value of the surface,
+     * in units of the field.
+     * \param path Path of the file to be written.
+     * \param stats If not null, the statistics of the volume are written here.
+     * \return true If the volume was written.
+     * \return false If the file could not be written or the arguments are invalid.
+     */
+    bool export_volume(const entities::ent_ref& entity, const glm::vec3& minBounds, const glm::vec3& maxBounds,
+        float voxelSize, float bandWidth, const std::string& path, volume_stats* stats = nullptr);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "opencl.h"
+#include <string>
+#include <vector>
+
+namespace work_group_tuner
+{
+    /**
+     * \brief How the work items of a group are laid out on the pixels.
+     */
+    enum pixel_order : uint8_t
+    {
+        ORDER_ROWS = 0, // The work items follow the rows of the group's tile.
+        ORDER_MORTON = 1, // Consecutive work items cover small squares, see k_trace.
+    };
+
+    /**
+     * \brief Shape of the work groups of the trace kernel, in pixels of the traced grid.
+     */
+    struct shape
+    {
+        uint32_t x = 1;
+        uint32_t y = 1;
+        pixel_order order = ORDER_ROWS;
+    };
+
+    /**
+     * \brief The shapes worth benchmarking, with at most the given number of work items per group.
+     * Morton order is only offered for shapes it can fill, i.e. squares and 2:1 rectangles of powers of two.
+     */
+    std::vector<shape> candidates(size_t maxGroupSize);
+
+    /**
+     * \brief Identifies the device, the kernel variant and the class of the scene. The best shape is
+     * only looked up for the same key, so changing any of them tunes again.
+     * \param device The device.
+     * \param variant The kernel, e.g. interpreter or compiled.
+     * \param nRegisters The registers used by the csg steps.
+     * \param nSteps The number of csg steps.
+     */
+    std::string key(const cl::Device& device, const std::string& variant, size_t nRegisters, size_t nSteps);
+
+    /**
+     * \brief Finds the shape stored for the key, from this run or a previous one.
+     */
+    bool lookup(const std::string& key, shape& result);
+
+    /**
+     * \brief Stores the best shape for the key, in memory and in a file next to the program cache,
+     * see program_cache::directory. Nothing is written if the cache is disabled.
+     */
+    void store(const std::string& key, const shape& result);
+}
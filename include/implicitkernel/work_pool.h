@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+    /**
+     * \brief Thread pool with one task queue per worker. Workers take tasks from the back of
+     * their own queue and steal from the front of the other queues when they run out of work.
+     * Tasks pushed from inside a task go to the queue of the worker running it, so recursive
+     * work (e.g. subdividing an octree) stays local until another worker needs it.
+     */
+    class work_pool
+    {
+    public:
+        typedef std::function<void()> task;
+
+        /**
+         * \brief Creates the pool and starts the workers.
+         * \param nThreads Number of workers. Zero means one per core.
+         */
+        explicit work_pool(size_t nThreads = 0);
+        ~work_pool();
+
+        work_pool(const work_pool&) = delete;
+        const work_pool& operator=(const work_pool&) = delete;
+
+        /**
+         * \brief Schedules a task. Can be called from any thread, including from inside a task.
+         */
+        void push(task t);
+
+        /**
+         * \brief Blocks until all scheduled tasks, and the tasks they scheduled, are finished.
+         * If any task threw an exception, the first one is rethrown here.
+         * Must not be called from inside a task.
+         */
+        void wait();
+
+        /**
+         * \brief The number of workers.
+         */
+        size_t size() const;
+
+    private:
+        struct worker_queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        std::vector<std::unique_ptr<worker_queue>> m_queues;
+        std::vector<std::thread> m_workers;
+        std::atomic<size_t> m_queued;
+        std::atomic<size_t> m_pending;
+        std::atomic<size_t> m_nextQueue;
+        std::mutex m_sleepMutex;
+        std::condition_variable m_sleepCv;
+        std::mutex m_doneMutex;
+        std::condition_variable m_doneCv;
+        std::exception_ptr m_error;
+        bool m_stop;
+
+        void run_worker(size_t index);
+        bool pop_task(size_t index, task& t);
+    };
+}
@@ -7,6 +7,9 @@ extern "C"
 #include "lauxlib.h"
 #include "lualib.h"
 };
+#include <implicitkernel/mesher.h>
+#include <implicitkernel/volume_export.h>
+#include <implicitkernel/slicer.h>
 #include <implicitkernel/viewer.h>
 
 static lua_State* s_luaState = nullptr;
@@ -20,7 +23,7 @@ namespace implicit_lua
     lua_State* state();
     bool should_exit();
     void luathrow(lua_State* L, const std::string& error);
-    void run_cmd(const std::string& line);
+    bool run_cmd(const std::string& line); // Prints the error and returns false if the line raised one.
 
     template <typename T>
     T read_lua(lua_State* L, int i);
@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <implicitkernel/frame_stats.h>
+#include <implicitlua/luabindings.h>
+
+#ifndef IMPLICIT_TESTFILES_DIR
+#define IMPLICIT_TESTFILES_DIR "testfiles"
+#endif
+
+namespace fs = std::filesystem;
+
+/*Bump this when the meaning of any reported number changes, so that results from different
+versions are not compared by accident.*/
+static constexpr int SCHEMA_VERSION = 2;
+
+struct camera_pose
+{
+    float theta;
+    float phi;
+    float distanceFactor; // Multiplies the diagonal of the bounds.
+};
+
+// Fixed, so that the runs are comparable across commits and devices.
+static const camera_pose POSES[] = {
+    { 0.6f, 0.77f, 0.75f },
+    { 2.4f, 0.3f, 0.6f },
+    { 4.2f, -0.4f, 0.9f },
+};
+
+struct bench_args
+{
+    std::vector<std::string> scripts;
+    std::vector<std::pair<uint32_t, uint32_t>> resolutions;
+    std::vector<int> lods;
+    std::vector<size_t> devices; // Devices tracing bands of the frames besides the first one, see viewer::use_devices.
+    size_t frames = 30;
+    size_t warmup = 5;
+    std::string output = "implicitbench.json";
+};
+
+struct bench_result
+{
+    std::string scene;
+    std::string error;
+    size_t pose = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int lod = 0;
+    std::string kernel;
+    viewer::march_stats march;
+    frame_stats::summary frame; // Host time of a frame, until it finished on the device.
+    frame_stats::summary trace; // Device time of the trace kernel.
+};
+
+static void print_usage()
+{
+    std::cout << "Usage:\n"
+        << "\timplicitbench [--frames <n>] [--warmup <n>] [--resolution <w>x<h>]... [--lod <n>]...\n"
+        << "\t              [--device <index>]... [--output <results.json>] [script.lua]...\n"
+        << "Without scripts, every script in " << IMPLICIT_TESTFILES_DIR << " is benchmarked.\n";
+}
+
+static bool parse_args(int argc, char** argv, bench_args& args)
+{
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg(argv[i]);
+            bool hasValue = i + 1 < argc;
+            if (arg == "--frames" && hasValue)
+                args.frames = std::stoul(argv[++i]);
+            else if (arg == "--warmup" && hasValue)
+                args.warmup = std::stoul(argv[++i]);
+            else if (arg == "--output" && hasValue)
+                args.output = argv[++i];
+            else if (arg == "--lod" && hasValue)
+                args.lods.push_back(std::stoi(argv[++i]));
+            else if (arg == "--device" && hasValue)
+                args.devices.push_back(std::stoul(argv[++i]));
+            else if (arg == "--resolution" && hasValue)
+            {
+                std::string res(argv[++i]);
+                size_t x = res.find('x');
+                if (x == std::string::npos)
+                    return false;
+                args.resolutions.emplace_back((uint32_t)std::stoul(res.substr(0, x)), (uint32_t)std::stoul(res.substr(x + 1)));
+            }
+            else if (arg.rfind("--", 0) != 0)
+                args.scripts.push_back(arg);
+            else
+                return false;
+        }
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    if (args.frames == 0 || args.frames > frame_stats::WINDOW_SIZE)
+    {
+        std::cerr << "The number of frames must be between 1 and " << frame_stats::WINDOW_SIZE << std::endl;
+        return false;
+    }
+    for (int lod : args.lods)
+    {
+        if (lod < 0 || lod > 8)
+            return false;
+    }
+    if (args.resolutions.empty())
+        args.resolutions = { { 1024, 728 }, { 512, 364 } };
+    if (args.lods.empty())
+        args.lods = { 0, 2 };
+    if (args.scripts.empty())
+    {
+        std::error_code err;
+        for (const auto& entry : fs::directory_iterator(IMPLICIT_TESTFILES_DIR, err))
+        {
+            if (entry.path().extension() == ".lua")
+                args.scripts.push_back(entry.path().string());
+        }
+        // Directory order is not defined.
+        std::sort(args.scripts.begin(), args.scripts.end());
+    }
+    return !args.scripts.empty();
+}
+
+/**
+ * \brief The string as a quoted Lua string literal.
+ */
+static std::string lua_str(const std::string& str)
+{
+    std::string out = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+/**
+ * \brief Runs the script in a fresh Lua state, so nothing carries over from the previous scene.
+ * \return False if the script raised an error.
+ */
+static bool load_scene(std::string path, float(&defaultBounds)[6])
+{
+    viewer::clear();
+    viewer::setbounds(defaultBounds);
+    implicit_lua::stop();
+    implicit_lua::init_lua();
+    std::replace(path.begin(), path.end(), '\\', '/');
+    return implicit_lua::run_cmd("load(" + lua_str(path) + ")");
+}
+
+static void set_pose(const camera_pose& pose)
+{
+    float bounds[6];
+    viewer::getbounds(bounds);
+    glm::vec3 minb(bounds[0], bounds[1], bounds[2]);
+    glm::vec3 maxb(bounds[3], bounds[4], bounds[5]);
+    viewer::set_camera(glm::length(maxb - minb) * pose.distanceFactor, pose.theta, pose.phi, (minb + maxb) * 0.5f);
+}
+
+static void run_config(const bench_args& args, bench_result& result)
+{
+    // Every frame starts cold, like the frame measure_march counts, though the pose doesn't change.
+    for (size_t i = 0; i < args.warmup; i++)
+        viewer::render_headless((uint8_t)result.lod, true);
+    frame_stats::reset();
+    for (size_t i = 0; i < args.frames; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        viewer::render_headless((uint8_t)result.lod, true);
+        auto end = std::chrono::steady_clock::now();
+        frame_stats::record("frame", std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    frame_stats::report report = frame_stats::get_report();
+    result.frame = report.timers["frame"];
+    result.trace = report.timers["trace"];
+    result.kernel = report.kernel.name;
+    result.march = viewer::measure_march((uint8_t)result.lod);
+}
+
+static std::string json_str(const std::string& str)
+{
+    std::string out = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+static void write_summary(std::ostream& out, const frame_stats::summary& s)
+{
+    out << "{ \"mean\": " << s.mean << ", \"p50\": " << s.p50 << ", \"p99\": " << s.p99 << ", \"max\": " << s.max << " }";
+}
+
+static void write_json(std::ostream& out, const bench_args& args, const std::vector<bench_result>& results)
+{
+    std::string platform, device, driver;
+    viewer::device_info(platform, device, driver);
+    out << "{\n"
+        << "  \"schema\": " << SCHEMA_VERSION << ",\n"
+        << "  \"platform\": " << json_str(platform) << ",\n"
+        << "  \"device\": " << json_str(device) << ",\n"
+        << "  \"driver\": " << json_str(driver) << ",\n"
+        << "  \"frames\": " << args.frames << ",\n"
+        << "  \"warmup\": " << args.warmup << ",\n"
+        << "  \"helper_devices\": " << args.devices.size() << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result& r = results[i];
+        out << (i ? ",\n" : "\n") << "    { \"scene\": " << json_str(r.scene);
+        if (!r.error.empty())
+        {
+            out << ", \"error\": " << json_str(r.error) << " }";
+            continue;
+        }
+        double seconds = r.frame.mean * 1e-3;
+        out << ", \"pose\": " << r.pose
+            << ", \"width\": " << r.width
+            << ", \"height\": " << r.height
+            << ", \"lod\": " << r.lod
+            << ", \"kernel\": " << json_str(r.kernel)
+            << ",\n      \"rays\": " << r.march.rays
+            << ", \"marched_rays\": " << r.march.marchedRays
+            << ", \"rays_per_s\": " << (seconds > 0.0 ? r.march.rays / seconds : 0.0)
+            << ", \"sdf_evals_per_s\": " << (seconds > 0.0 ? r.march.evaluations / seconds : 0.0)
+            << ", \"mean_march_iterations\": "
+            << (r.march.marchedRays ? (double)r.march.iterations / r.march.marchedRays : 0.0)
+            << ",\n      \"frame_ms\": ";
+        write_summary(out, r.frame);
+        out << ", \"trace_ms\": ";
+        write_summary(out, r.trace);
+        out << " }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    bench_args args;
+    if (!parse_args(argc, argv, args))
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::cout << "Initializing OpenCL (headless)...\n";
+    viewer::init_ocl(true);
+    viewer::init_buffers();
+    // The shapes tuned by earlier runs would make the results depend on the state of the cache.
+    viewer::tune_mode(false);
+    if (!args.devices.empty())
+    {
+        viewer::list_devices();
+        try
+        {
+            viewer::use_devices(args.devices);
+        }
+        catch (const char* error)
+        {
+            std::cerr << error << std::endl;
+            viewer::stop();
+            return 1;
+        }
+    }
+    implicit_lua::init_lua();
+    float defaultBounds[6];
+    viewer::getbounds(defaultBounds);
+
+    std::vector<bench_result> results;
+    for (const std::string& script : args.scripts)
+    {
+        bench_result base;
+        base.scene = fs::path(script).stem().string();
+        // Load with the interpreter, instead of compiling a kernel for every intermediate entity.
+        viewer::jit_mode(false);
+        bool loaded = load_scene(script, defaultBounds);
+        entities::ent_ref scene = viewer::shown_entity();
+        if (!loaded || !scene)
+        {
+            base.error = loaded ? "The script does not show an entity" : "The script raised an error";
+            results.push_back(base);
+            continue;
+        }
+        for (bool jit : { false, true })
+        {
+            viewer::jit_mode(jit);
+            viewer::show_entity(scene);
+            for (const auto& [width, height] : args.resolutions)
+            {
+                viewer::set_resolution(width, height);
+                for (int lod : args.lods)
+                {
+                    for (size_t pi = 0; pi < sizeof(POSES) / sizeof(POSES[0]); pi++)
+                    {
+                        bench_result result = base;
+                        result.pose = pi;
+                        result.width = width;
+                        result.height = height;
+                        result.lod = lod;
+                        set_pose(POSES[pi]);
+                        run_config(args, result);
+                        std::cout << result.scene << " " << result.kernel << " " << width << "x" << height
+                            << " lod " << lod << " pose " << pi << ": " << result.frame.p50 << " ms (p50)\n";
+                        results.push_back(result);
+                    }
+                }
+            }
+        }
+    }
+
+    std::ofstream out(args.output);
+    if (!out)
+    {
+        std::cerr << "Cannot write the results to " << args.output << std::endl;
+        viewer::stop();
+        implicit_lua::stop();
+        return 1;
+    }
+    write_json(out, args, results);
+    std::cout << "Results were written to " << args.output << std::endl;
+    viewer::stop();
+    implicit_lua::stop();
+    return 0;
+}
@@ -0,0 +1,363 @@
+#include <implicitkernel/cpu_eval.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace cpu_eval;
+
+static constexpr float INF = std::numeric_limits<float>::infinity();
+// Added to every margin, so that a culled subtree always yields a clearly positive value.
+static constexpr float CULL_EPSILON = 1e-4f;
+// Smaller subtrees cost about as much to evaluate as the distance to their box.
+static constexpr size_t MIN_CULL_STEPS = 2;
+
+static constexpr float SQRT3 = 1.7320508f;
+// Fields that barely change would otherwise take huge steps.
+static constexpr float MIN_LIPSCHITZ = 1e-3f;
+
+static const aabb UNBOUNDED = {glm::vec3(-INF), glm::vec3(INF)};
+static const aabb EMPTY = {glm::vec3(INF), glm::vec3(-INF)};
+
+template <typename T>
+static T read_packed(const uint8_t* ptr)
+{
+    T val;
+    std::memcpy(&val, ptr, sizeof(T));
+    return val;
+}
+
+static bool is_empty(const aabb& b)
+{
+    return b.min.x > b.max.x || b.min.y > b.max.y || b.min.z > b.max.z;
+}
+
+static bool is_finite(const aabb& b)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (!std::isfinite(b.min[i]) || !std::isfinite(b.max[i]))
+            return false;
+    }
+    return true;
+}
+
+static float volume(const aabb& b)
+{
+    if (is_empty(b))
+        return 0.0f;
+    glm::vec3 size = b.max - b.min;
+    return size.x * size.y * size.z;
+}
+
+static aabb join(const aabb& a, const aabb& b)
+{
+    return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+}
+
+static aabb meet(const aabb& a, const aabb& b)
+{
+    return {glm::max(a.min, b.min), glm::min(a.max, b.max)};
+}
+
+static aabb expand(const aabb& a, float d)
+{
+    return is_empty(a) ? a : aabb {a.min - glm::vec3(d), a.max + glm::vec3(d)};
+}
+
+static aabb bounds_simple(const uint8_t* ptr, uint8_t type)
+{
+    // Only the entities whose value outside is the exact distance give useful boxes.
+    switch (type)
+    {
+    case ENT_TYPE_BOX:
+    {
+        i_box box = read_packed<i_box>(ptr);
+        glm::vec3 center(box.bounds[0], box.bounds[1], box.bounds[2]);
+        glm::vec3 half = glm::abs(glm::vec3(box.bounds[3], box.bounds[4], box.bounds[5]));
+        return {center - half, center + half};
+    }
+    case ENT_TYPE_SPHERE:
+    {
+        i_sphere sphere = read_packed<i_sphere>(ptr);
+        glm::vec3 center(sphere.center[0], sphere.center[1], sphere.center[2]);
+        return {center - glm::vec3(std::fabs(sphere.radius)), center + glm::vec3(std::fabs(sphere.radius))};
+    }
+    case ENT_TYPE_CYLINDER:
+    {
+        i_cylinder cyl = read_packed<i_cylinder>(ptr);
+        glm::vec3 p1(cyl.point1[0], cyl.point1[1], cyl.point1[2]);
+        glm::vec3 p2(cyl.point2[0], cyl.point2[1], cyl.point2[2]);
+        glm::vec3 axis = p2 - p1;
+        float len = glm::length(axis);
+        if (len == 0.0f || cyl.radius < 0.0f)
+            return UNBOUNDED;
+        axis /= len;
+        // Extent of the end discs along each coordinate axis.
+        glm::vec3 disc = cyl.radius * glm::sqrt(glm::max(glm::vec3(0.0f), glm::vec3(1.0f) - axis * axis));
+        return {glm::min(p1, p2) - disc, glm::max(p1, p2) + disc};
+    }
+    default: return UNBOUNDED;
+    }
+}
+
+static value_bounds apply_op(const op_defn& op, const value_bounds& a, const value_bounds& b)
+{
+    switch (op.type)
+    {
+    case OP_NONE: return a;
+    case OP_UNION:
+    {
+        float r = std::max(0.0f, op.data.blend_radius);
+        return {expand(join(a.solid, b.solid), r), expand(join(a.dist, b.dist), r)};
+    }
+    case OP_INTERSECTION:
+        // The value is at least the value of either operand, but not the distance to their overlap.
+        return {meet(a.solid, b.solid), volume(a.dist) <= volume(b.dist) ? a.dist : b.dist};
+    case OP_SUBTRACTION: return a;
+    case OP_OFFSET:
+    {
+        float d = op.data.offset_distance;
+        if (d <= 0.0f)
+            return a;
+        aabb grown = expand(a.dist, d);
+        return {grown, grown};
+    }
+    case OP_LINBLEND:
+    case OP_SMOOTHBLEND:
+        // The blend is not positive only where one of the operands is not, but it can be much
+        // smaller than both operands far away from the solids.
+        return {join(a.solid, b.solid), UNBOUNDED};
+    default: return {UNBOUNDED, UNBOUNDED};
+    }
+}
+
+static bool uses_right(const op_defn& op)
+{
+    return op.type != OP_OFFSET && op.type != OP_NONE;
+}
+
+step_boxes::step_boxes(const program& prog)
+{
+    m_leaves.resize(prog.types.size());
+    m_readers.resize(prog.types.size());
+    for (size_t i = 0; i < m_leaves.size(); i++)
+    {
+        aabb box = bounds_simple(prog.bytes.data() + prog.offsets[i], prog.types[i]);
+        m_leaves[i] = {box, box};
+    }
+    size_t nSteps = prog.steps.size();
+    m_results.resize(nSteps);
+    m_producers.assign(nSteps, {NONE, NONE});
+    m_consumers.resize(nSteps);
+    std::vector<size_t> writer(prog.numRegisters, NONE);
+    for (size_t si = 0; si < nSteps; si++)
+    {
+        const op_step& step = prog.steps[si];
+        if (step.left_src == SRC_REG)
+            m_producers[si].first = writer[step.left_index];
+        else
+            m_readers[step.left_index].push_back(si);
+        if (uses_right(step.op))
+        {
+            if (step.right_src == SRC_REG)
+                m_producers[si].second = writer[step.right_index];
+            else
+                m_readers[step.right_index].push_back(si);
+        }
+        for (size_t p : {m_producers[si].first, m_producers[si].second})
+        {
+            if (p != NONE)
+                m_consumers[p].push_back(si);
+        }
+        writer[step.dest] = si;
+        compute(prog, si);
+    }
+    if (!writer.empty())
+        m_root = writer[0];
+}
+
+void step_boxes::compute(const program& prog, size_t si)
+{
+    const op_step& step = prog.steps[si];
+    // Registers read before they are written hold nothing known.
+    auto operand = [&](uint8_t src, uint32_t index, size_t producer) -> value_bounds {
+        if (src != SRC_REG)
+            return m_leaves[index];
+        return producer == NONE ? value_bounds {UNBOUNDED, UNBOUNDED} : m_results[producer];
+    };
+    value_bounds a = operand(step.left_src, step.left_index, m_producers[si].first);
+    value_bounds b = uses_right(step.op) ? operand(step.right_src, step.right_index, m_producers[si].second) : a;
+    m_results[si] = apply_op(step.op, a, b);
+}
+
+void step_boxes::recompute_from(const program& prog, std::vector<size_t> dirty)
+{
+    // Consumers come after their producers, so the steps are recomputed in order.
+    std::vector<bool> queued(m_results.size(), false);
+    for (size_t si : dirty)
+        queued[si] = true;
+    for (size_t si = dirty.empty() ? m_results.size() : *std::min_element(dirty.begin(), dirty.end());
+         si < m_results.size(); si++)
+    {
+        if (!queued[si])
+            continue;
+        compute(prog, si);
+        for (size_t c : m_consumers[si])
+            queued[c] = true;
+    }
+}
+
+void step_boxes::entity_changed(const program& prog, size_t entity)
+{
+    aabb box = bounds_simple(prog.bytes.data() + prog.offsets[entity], prog.types[entity]);
+    m_leaves[entity] = {box, box};
+    recompute_from(prog, m_readers[entity]);
+}
+
+void step_boxes::step_changed(const program& prog, size_t step)
+{
+    recompute_from(prog, {step});
+}
+
+aabb step_boxes::solid_bounds(const program& prog) const
+{
+    if (prog.steps.empty())
+        return m_leaves.empty() ? EMPTY : m_leaves[0].solid;
+    return m_root == NONE ? UNBOUNDED : m_results[m_root].solid;
+}
+
+std::vector<cull_range> step_boxes::cull_ranges(const program& prog) const
+{
+    std::vector<cull_range> ranges;
+    size_t nSteps = prog.steps.size();
+    if (nSteps < MIN_CULL_STEPS || m_root == NONE)
+        return ranges;
+
+    // A subtree may only be culled if every step between it and the root accepts a smaller
+    // positive operand without changing the sign of its result. Consumers come after producers,
+    // so walking backwards visits all consumers of a step before the step itself.
+    std::vector<bool> safe(nSteps, false);
+    std::vector<float> margin(nSteps, 0.0f);
+    std::vector<bool> visited(nSteps, false);
+    safe[m_root] = visited[m_root] = true;
+    for (size_t si = m_root + 1; si-- > 0;)
+    {
+        if (!visited[si])
+            continue;
+        const op_defn& op = prog.steps[si].op;
+        bool passes = op.type == OP_UNION ||
+            ((op.type == OP_INTERSECTION || op.type == OP_SUBTRACTION) && op.data.blend_radius == 0.0f);
+        float childMargin = margin[si] + (op.type == OP_UNION ? std::max(0.0f, op.data.blend_radius) : 0.0f);
+        for (size_t p : {m_producers[si].first, m_producers[si].second})
+        {
+            if (p == NONE)
+                continue;
+            safe[p] = (visited[p] ? safe[p] : true) && safe[si] && passes;
+            margin[p] = visited[p] ? std::max(margin[p], childMargin) : childMargin;
+            visited[p] = true;
+        }
+    }
+
+    // The subtree must occupy a contiguous range of steps ending at its root, and none of its
+    // intermediate results may be used outside of it.
+    std::vector<size_t> first(nSteps), size(nSteps);
+    std::vector<bool> tree(nSteps);
+    for (size_t si = 0; si < nSteps; si++)
+    {
+        first[si] = si;
+        size[si] = 1;
+        tree[si] = true;
+        for (size_t p : {m_producers[si].first, m_producers[si].second})
+        {
+            if (p == NONE)
+                continue;
+            first[si] = std::min(first[si], first[p]);
+            size[si] += size[p];
+            tree[si] = tree[si] && tree[p] && m_consumers[p].size() == 1;
+        }
+        if (!visited[si] || !safe[si] || !tree[si] || size[si] < MIN_CULL_STEPS ||
+            size[si] != si - first[si] + 1 || !is_finite(m_results[si].dist))
+            continue;
+        const aabb& box = m_results[si].dist;
+        cull_range range;
+        range.start = (uint32_t)first[si];
+        range.end = (uint32_t)si;
+        range.margin = margin[si] + CULL_EPSILON;
+        for (int i = 0; i < 3; i++)
+        {
+            range.min[i] = box.min[i];
+            range.max[i] = box.max[i];
+        }
+        ranges.push_back(range);
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const cull_range& a, const cull_range& b) {
+        return a.start != b.start ? a.start < b.start : a.end > b.end;
+    });
+    return ranges;
+}
+
+aabb program::solid_bounds() const
+{
+    return step_boxes(*this).solid_bounds(*this);
+}
+
+std::vector<cull_range> program::cull_ranges() const
+{
+    return step_boxes(*this).cull_ranges(*this);
+}
+
+static float lipschitz_simple(const uint8_t* ptr, uint8_t type)
+{
+    switch (type)
+    {
+    // The magnitude of the gradient of the sums of the lattices is at most sqrt(3).
+    case ENT_TYPE_GYROID:
+    {
+        i_gyroid gyroid = read_packed<i_gyroid>(ptr);
+        return SQRT3 * std::fabs(gyroid.scale * gyroid.thickness) * 0.25f;
+    }
+    case ENT_TYPE_SCHWARZ:
+    {
+        i_schwarz lattice = read_packed<i_schwarz>(ptr);
+        return SQRT3 * std::fabs(lattice.scale * lattice.thickness) * 0.25f;
+    }
+    default: return 1.0f;
+    }
+}
+
+float program::lipschitz_bound() const
+{
+    if (steps.empty())
+        return types.empty() ? 1.0f : lipschitz_simple(bytes.data() + offsets[0], types[0]);
+    std::vector<float> leaves(types.size());
+    for (size_t i = 0; i < leaves.size(); i++)
+        leaves[i] = lipschitz_simple(bytes.data() + offsets[i], types[i]);
+    std::vector<float> regs(numRegisters, 1.0f);
+    for (const op_step& step : steps)
+    {
+        float a = step.left_src == SRC_REG ? regs[step.left_index] : leaves[step.left_index];
+        float b = !uses_right(step.op) ? a :
+            step.right_src == SRC_REG ? regs[step.right_index] : leaves[step.right_index];
+        float result = a;
+        switch (step.op.type)
+        {
+        case OP_UNION:
+        case OP_INTERSECTION:
+        case OP_SUBTRACTION:
+            // The rounded blends weigh both gradients with a unit vector.
+            result = step.op.data.blend_radius == 0.0f ? std::max(a, b) : std::sqrt(a * a + b * b);
+            break;
+        case OP_LINBLEND:
+            // The mixed gradients, plus the change of the mixing weight, at most one over the length.
+            result = std::max(a, b) + 1.0f;
+            break;
+        case OP_SMOOTHBLEND:
+            // The weight changes up to twice as fast, and the result is scaled by 0.8.
+            result = 0.8f * (std::max(a, b) + 2.0f);
+            break;
+        default: break;
+        }
+        regs[step.dest] = result;
+    }
+    return std::max(regs[0], MIN_LIPSCHITZ);
+}
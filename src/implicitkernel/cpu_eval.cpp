@@ -0,0 +1,381 @@
+#include <implicitkernel/cpu_eval.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+/*The block functions are compiled for several instruction sets and the best one is
+picked at load time. The helpers below are force-inlined into each clone, and the loops
+over the lanes of a block are written to be auto-vectorized.*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(_WIN32)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define SIMD_CLONES
+#define FORCE_INLINE __forceinline
+#else
+#define SIMD_CLONES
+#define FORCE_INLINE inline
+#endif
+#define RESTRICT __restrict
+
+using namespace cpu_eval;
+
+static constexpr size_t MIN_POINTS_PER_THREAD = BLOCK_SIZE * 64;
+
+template <typename T>
+static T read_packed(const uint8_t* ptr)
+{
+    T val;
+    std::memcpy(&val, ptr, sizeof(T));
+    return val;
+}
+
+/*Branch free sincos that the compiler can vectorize, unlike the one in the standard library.
+Cody-Waite range reduction followed by the minimax polynomials from cephes.*/
+static FORCE_INLINE void fast_sincos(float x, float& s, float& c)
+{
+    static constexpr float TWO_OVER_PI = 0.636619772367581343f;
+    static constexpr float C1 = 1.5703125f;
+    static constexpr float C2 = 4.837512969970703125e-4f;
+    static constexpr float C3 = 7.54978995489188216e-8f;
+    float q = std::floor(x * TWO_OVER_PI + 0.5f);
+    int quadrant = (int)q;
+    float r = ((x - q * C1) - q * C2) - q * C3;
+    float r2 = r * r;
+    float ps = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+    float pc = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+    bool swap = (quadrant & 1) != 0;
+    float sv = swap ? pc : ps;
+    float cv = swap ? ps : pc;
+    s = (quadrant & 2) ? -sv : sv;
+    c = ((quadrant + 1) & 2) ? -cv : cv;
+}
+
+static FORCE_INLINE void eval_box(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_box box = read_packed<i_box>(ptr);
+    const float* b = box.bounds;
+    for (size_t i = 0; i < n; i++)
+    {
+        float dx = std::fabs(x[i] - b[0]) - b[3];
+        float dy = std::fabs(y[i] - b[1]) - b[4];
+        float dz = std::fabs(z[i] - b[2]) - b[5];
+        float ox = std::max(0.0f, dx), oy = std::max(0.0f, dy), oz = std::max(0.0f, dz);
+        float ix = std::max(0.0f, -dx), iy = std::max(0.0f, -dy), iz = std::max(0.0f, -dz);
+        out[i] = std::sqrt(ox * ox + oy * oy + oz * oz) - std::min(std::min(ix, iy), iz);
+    }
+}
+
+static FORCE_INLINE void eval_sphere(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_sphere sphere = read_packed<i_sphere>(ptr);
+    float radius = std::fabs(sphere.radius);
+    for (size_t i = 0; i < n; i++)
+    {
+        float dx = x[i] - sphere.center[0];
+        float dy = y[i] - sphere.center[1];
+        float dz = z[i] - sphere.center[2];
+        out[i] = std::sqrt(dx * dx + dy * dy + dz * dz) - radius;
+    }
+}
+
+static FORCE_INLINE void eval_cylinder(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_cylinder cyl = read_packed<i_cylinder>(ptr);
+    float lx = cyl.point2[0] - cyl.point1[0];
+    float ly = cyl.point2[1] - cyl.point1[1];
+    float lz = cyl.point2[2] - cyl.point1[2];
+    float halfLen = std::sqrt(lx * lx + ly * ly + lz * lz) * 0.5f;
+    lx /= halfLen * 2.0f;
+    ly /= halfLen * 2.0f;
+    lz /= halfLen * 2.0f;
+    float mx = (cyl.point1[0] + cyl.point2[0]) * 0.5f;
+    float my = (cyl.point1[1] + cyl.point2[1]) * 0.5f;
+    float mz = (cyl.point1[2] + cyl.point2[2]) * 0.5f;
+    float radius = cyl.radius;
+    for (size_t i = 0; i < n; i++)
+    {
+        float rx = x[i] - mx, ry = y[i] - my, rz = z[i] - mz;
+        float proj = lx * rx + ly * ry + lz * rz;
+        float px = rx - lx * proj, py = ry - ly * proj, pz = rz - lz * proj;
+        float yv = std::sqrt(px * px + py * py + pz * pz);
+        float xv = std::fabs(proj);
+        float ox = std::max(0.0f, xv - halfLen), oy = std::max(0.0f, yv - radius);
+        out[i] = std::sqrt(ox * ox + oy * oy) -
+            std::min(std::max(0.0f, radius - yv), std::max(0.0f, halfLen - xv));
+    }
+}
+
+static FORCE_INLINE void eval_gyroid(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_gyroid gyroid = read_packed<i_gyroid>(ptr);
+    float scale = gyroid.scale;
+    float factor = 4.0f / gyroid.thickness;
+    float offset = gyroid.thickness / factor;
+    for (size_t i = 0; i < n; i++)
+    {
+        float sx, cx, sy, cy, sz, cz;
+        fast_sincos(x[i] * scale, sx, cx);
+        fast_sincos(y[i] * scale, sy, cy);
+        fast_sincos(z[i] * scale, sz, cz);
+        out[i] = std::fabs((sx * cy + sy * cz + sz * cx) / factor) - offset;
+    }
+}
+
+static FORCE_INLINE void eval_schwarz(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_schwarz lattice = read_packed<i_schwarz>(ptr);
+    float scale = lattice.scale;
+    float factor = 4.0f / lattice.thickness;
+    float offset = lattice.thickness / factor;
+    for (size_t i = 0; i < n; i++)
+    {
+        float sx, cx, sy, cy, sz, cz;
+        fast_sincos(x[i] * scale, sx, cx);
+        fast_sincos(y[i] * scale, sy, cy);
+        fast_sincos(z[i] * scale, sz, cz);
+        out[i] = std::fabs((cx + cy + cz) / factor) - offset;
+    }
+}
+
+static FORCE_INLINE void eval_halfspace(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    i_halfspace hspace = read_packed<i_halfspace>(ptr);
+    float nx = hspace.normal[0], ny = hspace.normal[1], nz = hspace.normal[2];
+    float len = std::sqrt(nx * nx + ny * ny + nz * nz);
+    nx /= -len;
+    ny /= -len;
+    nz /= -len;
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = (x[i] - hspace.origin[0]) * nx + (y[i] - hspace.origin[1]) * ny + (z[i] - hspace.origin[2]) * nz;
+    }
+}
+
+static FORCE_INLINE void eval_polyface(const uint8_t* ptr, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    uint32_t nVerts = read_packed<uint32_t>(ptr);
+    if (nVerts == 0 || nVerts > 100)
+    {
+        std::fill(out, out + n, 1.0f);
+        return;
+    }
+    /*f_polyface only ever looks at the first vertex and its two neighbours,
+    which reduces to the signed distance from the plane of those vertices.*/
+    const uint8_t* coords = ptr + sizeof(uint32_t);
+    glm::vec3 v0 = read_packed<glm::vec3>(coords);
+    glm::vec3 v1 = read_packed<glm::vec3>(coords + sizeof(glm::vec3) * (nVerts - 1));
+    glm::vec3 v2 = read_packed<glm::vec3>(coords + sizeof(glm::vec3) * (1 % nVerts));
+    glm::vec3 norm = glm::normalize(glm::cross(v2 - v0, v1 - v0));
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = norm.x * (x[i] - v0.x) + norm.y * (y[i] - v0.y) + norm.z * (z[i] - v0.z);
+    }
+}
+
+static FORCE_INLINE void eval_simple(const uint8_t* ptr, uint8_t type, const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    switch (type)
+    {
+    case ENT_TYPE_BOX: eval_box(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_SPHERE: eval_sphere(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_GYROID: eval_gyroid(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_SCHWARZ: eval_schwarz(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_CYLINDER: eval_cylinder(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_HALFSPACE: eval_halfspace(ptr, x, y, z, out, n); return;
+    case ENT_TYPE_POLYFACE: eval_polyface(ptr, x, y, z, out, n); return;
+    default: std::fill(out, out + n, 1.0f); return;
+    }
+}
+
+static FORCE_INLINE void apply_union(float blendRadius, const float* a, const float* b, float* RESTRICT out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float da = blendRadius - a[i], db = blendRadius - b[i];
+        float blended = blendRadius - std::sqrt(da * da + db * db);
+        out[i] = (a[i] < blendRadius && b[i] < blendRadius) ? blended : std::min(a[i], b[i]);
+    }
+}
+
+static FORCE_INLINE void apply_intersection(float blendRadius, const float* a, const float* b, float sign, float* RESTRICT out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float bv = sign * b[i];
+        float da = a[i] + blendRadius, db = bv + blendRadius;
+        float blended = std::sqrt(da * da + db * db) - blendRadius;
+        bool blend = blendRadius != 0.0f && a[i] > -blendRadius && bv > -blendRadius;
+        out[i] = blend ? blended : std::max(a[i], bv);
+    }
+}
+
+template <bool Smooth>
+static FORCE_INLINE void apply_blend(const float (&p1)[3], const float (&p2)[3], const float* a, const float* b,
+    const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    float lx = p2[0] - p1[0], ly = p2[1] - p1[1], lz = p2[2] - p1[2];
+    float modL2 = lx * lx + ly * ly + lz * lz;
+    float modL = std::sqrt(modL2);
+    lx /= modL2;
+    ly /= modL2;
+    lz /= modL2;
+    for (size_t i = 0; i < n; i++)
+    {
+        float lambda = (x[i] - p1[0]) * lx + (y[i] - p1[1]) * ly + (z[i] - p1[2]) * lz;
+        lambda = std::min(1.0f, std::max(0.0f, lambda));
+        if (Smooth)
+        {
+            // Same as 1 / (1 + (lambda / (1 - lambda))^-2), without the division by zero.
+            float inv = 1.0f - lambda;
+            lambda = (lambda * lambda) / (lambda * lambda + inv * inv);
+        }
+        float diff = a[i] - b[i];
+        float val = (lambda * b[i] + (1.0f - lambda) * a[i]) * modL / std::sqrt(modL2 + diff * diff);
+        out[i] = Smooth ? val * 0.8f : val;
+    }
+}
+
+static FORCE_INLINE void apply_op(const op_defn& op, const float* a, const float* b,
+    const float* x, const float* y, const float* z, float* RESTRICT out, size_t n)
+{
+    switch (op.type)
+    {
+    case OP_UNION: apply_union(op.data.blend_radius, a, b, out, n); return;
+    case OP_INTERSECTION: apply_intersection(op.data.blend_radius, a, b, 1.0f, out, n); return;
+    case OP_SUBTRACTION: apply_intersection(op.data.blend_radius, a, b, -1.0f, out, n); return;
+    case OP_OFFSET:
+        for (size_t i = 0; i < n; i++) out[i] = a[i] - op.data.offset_distance;
+        return;
+    case OP_LINBLEND: apply_blend<false>(op.data.lin_blend.p1, op.data.lin_blend.p2, a, b, x, y, z, out, n); return;
+    case OP_SMOOTHBLEND: apply_blend<true>(op.data.smooth_blend.p1, op.data.smooth_blend.p2, a, b, x, y, z, out, n); return;
+    case OP_NONE:
+    default:
+        std::copy(a, a + n, out);
+        return;
+    }
+}
+
+SIMD_CLONES
+static void eval_block_impl(const program& prog, const float* x, const float* y, const float* z, float* out, size_t n, float* scratch)
+{
+    size_t nEntities = prog.types.size();
+    if (prog.steps.empty())
+    {
+        if (nEntities > 0)
+            eval_simple(prog.bytes.data(), prog.types[0], x, y, z, out, n);
+        else
+            std::fill(out, out + n, 1.0f);
+        return;
+    }
+
+    float* valBuf = scratch;
+    float* regBuf = scratch + nEntities * BLOCK_SIZE;
+    // Compute the values of simple entities.
+    for (size_t ei = 0; ei < nEntities; ei++)
+    {
+        eval_simple(prog.bytes.data() + prog.offsets[ei], prog.types[ei], x, y, z, valBuf + ei * BLOCK_SIZE, n);
+    }
+
+    /*The destination register is often one of the operands. The result goes to a separate
+    block first so the operations can be vectorized without worrying about aliasing.*/
+    float* result = regBuf + prog.numRegisters * BLOCK_SIZE;
+    // Perform the csg operations.
+    for (const op_step& step : prog.steps)
+    {
+        const float* l = (step.left_src == SRC_REG ? regBuf : valBuf) + step.left_index * BLOCK_SIZE;
+        const float* r = (step.right_src == SRC_REG ? regBuf : valBuf) + step.right_index * BLOCK_SIZE;
+        apply_op(step.op, l, r, x, y, z, result, n);
+        std::copy(result, result + n, regBuf + step.dest * BLOCK_SIZE);
+    }
+    std::copy(regBuf, regBuf + n, out);
+}
+
+cpu_eval::program::program(const uint8_t* b, size_t nBytes, const uint32_t* o, const uint8_t* t,
+    size_t nEntities, const op_step* s, size_t nSteps) :
+    bytes(b, b + nBytes),
+    offsets(o, o + nEntities),
+    types(t, t + nEntities),
+    steps(s, s + nSteps)
+{
+    for (const op_step& step : steps)
+    {
+        numRegisters = std::max(numRegisters, (size_t)step.dest + 1);
+        if (step.left_src == SRC_REG) numRegisters = std::max(numRegisters, (size_t)step.left_index + 1);
+        if (step.right_src == SRC_REG) numRegisters = std::max(numRegisters, (size_t)step.right_index + 1);
+    }
+}
+
+cpu_eval::program::program(const entities::ent_ref& entity)
+{
+    size_t nBytes = 0, nEntities = 0, nSteps = 0;
+    entity->render_data_size(nBytes, nEntities, nSteps);
+    std::vector<uint8_t> b(nBytes);
+    std::vector<uint32_t> o(nEntities);
+    std::vector<uint8_t> t(nEntities);
+    std::vector<op_step> s(nSteps);
+    {
+        uint8_t* bptr = b.data();
+        uint32_t* optr = o.data();
+        uint8_t* tptr = t.data();
+        op_step* sptr = s.data();
+        entity->copy_render_data(bptr, optr, tptr, sptr);
+    }
+    *this = program(b.data(), nBytes, o.data(), t.data(), nEntities, s.data(), nSteps);
+}
+
+size_t cpu_eval::program::scratch_size() const
+{
+    // One extra block for the result of the current operation.
+    return (types.size() + numRegisters + 1) * BLOCK_SIZE;
+}
+
+void cpu_eval::program::eval_block(const float* x, const float* y, const float* z, float* out, size_t n, float* scratch) const
+{
+    eval_block_impl(*this, x, y, z, out, std::min(n, BLOCK_SIZE), scratch);
+}
+
+void cpu_eval::program::eval(const float* x, const float* y, const float* z, float* out, size_t n, size_t nThreads) const
+{
+    if (nThreads == 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    nThreads = std::max((size_t)1, std::min(nThreads, n / MIN_POINTS_PER_THREAD));
+
+    auto evalRange = [this, x, y, z, out](size_t begin, size_t end) {
+        std::vector<float> scratch(scratch_size());
+        for (size_t i = begin; i < end; i += BLOCK_SIZE)
+        {
+            eval_block_impl(*this, x + i, y + i, z + i, out + i, std::min(BLOCK_SIZE, end - i), scratch.data());
+        }
+    };
+
+    if (nThreads == 1)
+    {
+        evalRange(0, n);
+        return;
+    }
+
+    // Split the points into whole blocks, one contiguous range per thread.
+    size_t nBlocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t blocksPerThread = (nBlocks + nThreads - 1) / nThreads;
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads);
+    for (size_t ti = 0; ti < nThreads; ti++)
+    {
+        size_t begin = std::min(n, ti * blocksPerThread * BLOCK_SIZE);
+        size_t end = std::min(n, begin + blocksPerThread * BLOCK_SIZE);
+        if (begin < end)
+            threads.emplace_back(evalRange, begin, end);
+    }
+    for (std::thread& t : threads)
+        t.join();
+}
+
+float cpu_eval::program::eval(float x, float y, float z) const
+{
+    std::vector<float> scratch(scratch_size());
+    float val;
+    eval_block_impl(*this, &x, &y, &z, &val, 1, scratch.data());
+    return val;
+}
@@ -0,0 +1,591 @@
+#include <implicitkernel/cpu_eval.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+using namespace cpu_eval;
+
+// Relative and absolute slack added to every bound, to cover rounding and the approximate sincos.
+static constexpr float BOUND_EPSILON = 1e-5f;
+static constexpr float PI = 3.14159265358979f;
+static constexpr float TWO_PI = 2.0f * PI;
+
+template <typename T>
+static T read_packed(const uint8_t* ptr)
+{
+    T val;
+    std::memcpy(&val, ptr, sizeof(T));
+    return val;
+}
+
+static interval widen(interval a)
+{
+    return {a.lo - BOUND_EPSILON * (1.0f + std::fabs(a.lo)), a.hi + BOUND_EPSILON * (1.0f + std::fabs(a.hi))};
+}
+
+static interval add(interval a, interval b)
+{
+    return {a.lo + b.lo, a.hi + b.hi};
+}
+
+static interval mul(interval a, interval b)
+{
+    float p[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+    return {*std::min_element(p, p + 4), *std::max_element(p, p + 4)};
+}
+
+static interval scale(interval a, float s)
+{
+    return s < 0.0f ? interval {a.hi * s, a.lo * s} : interval {a.lo * s, a.hi * s};
+}
+
+static interval abs(interval a)
+{
+    if (a.lo >= 0.0f)
+        return a;
+    if (a.hi <= 0.0f)
+        return {-a.hi, -a.lo};
+    return {0.0f, std::max(-a.lo, a.hi)};
+}
+
+static interval sin(interval a)
+{
+    if (a.hi - a.lo >= TWO_PI)
+        return {-1.0f, 1.0f};
+    float slo = std::sin(a.lo), shi = std::sin(a.hi);
+    interval result = {std::min(slo, shi), std::max(slo, shi)};
+    // The extrema inside the range, at pi / 2 + 2k pi and -pi / 2 + 2k pi.
+    if (std::ceil((a.lo - 0.5f * PI) / TWO_PI) <= std::floor((a.hi - 0.5f * PI) / TWO_PI))
+        result.hi = 1.0f;
+    if (std::ceil((a.lo + 0.5f * PI) / TWO_PI) <= std::floor((a.hi + 0.5f * PI) / TWO_PI))
+        result.lo = -1.0f;
+    return result;
+}
+
+static interval cos(interval a)
+{
+    return sin({a.lo + 0.5f * PI, a.hi + 0.5f * PI});
+}
+
+/**
+ * \brief Bounds of a field with a Lipschitz constant of one, from its value at the center of the box.
+ */
+static interval lipschitz_bounds(float centerValue, const glm::vec3& min, const glm::vec3& max)
+{
+    float halfDiag = 0.5f * glm::length(max - min);
+    return {centerValue - halfDiag, centerValue + halfDiag};
+}
+
+/**
+ * \brief Exact bounds of the linear function n . (p - origin) over the box.
+ */
+static interval linear_bounds(const glm::vec3& n, const glm::vec3& origin, const glm::vec3& min, const glm::vec3& max)
+{
+    glm::vec3 center = (min + max) * 0.5f;
+    glm::vec3 half = (max - min) * 0.5f;
+    float mid = glm::dot(n, center - origin);
+    float spread = std::fabs(n.x) * half.x + std::fabs(n.y) * half.y + std::fabs(n.z) * half.z;
+    return {mid - spread, mid + spread};
+}
+
+static interval bounds_box(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_box box = read_packed<i_box>(ptr);
+    const float* b = box.bounds;
+    glm::vec3 c = (min + max) * 0.5f;
+    float dx = std::fabs(c.x - b[0]) - b[3];
+    float dy = std::fabs(c.y - b[1]) - b[4];
+    float dz = std::fabs(c.z - b[2]) - b[5];
+    float ox = std::max(0.0f, dx), oy = std::max(0.0f, dy), oz = std::max(0.0f, dz);
+    float ix = std::max(0.0f, -dx), iy = std::max(0.0f, -dy), iz = std::max(0.0f, -dz);
+    return lipschitz_bounds(std::sqrt(ox * ox + oy * oy + oz * oz) - std::min(std::min(ix, iy), iz), min, max);
+}
+
+static interval bounds_sphere(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_sphere sphere = read_packed<i_sphere>(ptr);
+    glm::vec3 center(sphere.center[0], sphere.center[1], sphere.center[2]);
+    float radius = std::fabs(sphere.radius);
+    glm::vec3 nearest = glm::min(glm::max(center, min), max);
+    glm::vec3 farthest = glm::max(glm::abs(center - min), glm::abs(center - max));
+    return {glm::distance(center, nearest) - radius, glm::length(farthest) - radius};
+}
+
+static interval bounds_cylinder(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_cylinder cyl = read_packed<i_cylinder>(ptr);
+    glm::vec3 p1(cyl.point1[0], cyl.point1[1], cyl.point1[2]);
+    glm::vec3 p2(cyl.point2[0], cyl.point2[1], cyl.point2[2]);
+    glm::vec3 axis = p2 - p1;
+    float halfLen = glm::length(axis) * 0.5f;
+    axis /= halfLen * 2.0f;
+    glm::vec3 r = (min + max) * 0.5f - (p1 + p2) * 0.5f;
+    float proj = glm::dot(axis, r);
+    float yv = glm::length(r - axis * proj);
+    float xv = std::fabs(proj);
+    float ox = std::max(0.0f, xv - halfLen), oy = std::max(0.0f, yv - cyl.radius);
+    float val = std::sqrt(ox * ox + oy * oy) -
+        std::min(std::max(0.0f, cyl.radius - yv), std::max(0.0f, halfLen - xv));
+    return lipschitz_bounds(val, min, max);
+}
+
+static interval bounds_halfspace(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_halfspace hspace = read_packed<i_halfspace>(ptr);
+    glm::vec3 n(hspace.normal[0], hspace.normal[1], hspace.normal[2]);
+    return linear_bounds(-glm::normalize(n), glm::vec3(hspace.origin[0], hspace.origin[1], hspace.origin[2]), min, max);
+}
+
+static interval bounds_polyface(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    uint32_t nVerts = read_packed<uint32_t>(ptr);
+    if (nVerts == 0 || nVerts > 100)
+        return {1.0f, 1.0f};
+    // Same plane as eval_polyface in cpu_eval.cpp.
+    const uint8_t* coords = ptr + sizeof(uint32_t);
+    glm::vec3 v0 = read_packed<glm::vec3>(coords);
+    glm::vec3 v1 = read_packed<glm::vec3>(coords + sizeof(glm::vec3) * (nVerts - 1));
+    glm::vec3 v2 = read_packed<glm::vec3>(coords + sizeof(glm::vec3) * (1 % nVerts));
+    return linear_bounds(glm::normalize(glm::cross(v2 - v0, v1 - v0)), v0, min, max);
+}
+
+/**
+ * \brief Bounds of the sines and cosines of the scaled coordinates, for the lattices.
+ */
+static void trig_bounds(float s, const glm::vec3& min, const glm::vec3& max, interval (&sines)[3], interval (&cosines)[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        interval arg = scale({min[i], max[i]}, s);
+        sines[i] = sin(arg);
+        cosines[i] = cos(arg);
+    }
+}
+
+static interval bounds_gyroid(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_gyroid gyroid = read_packed<i_gyroid>(ptr);
+    float factor = 4.0f / gyroid.thickness;
+    float offset = gyroid.thickness / factor;
+    interval sn[3], cs[3];
+    trig_bounds(gyroid.scale, min, max, sn, cs);
+    interval sum = add(add(mul(sn[0], cs[1]), mul(sn[1], cs[2])), mul(sn[2], cs[0]));
+    interval val = abs(scale(sum, 1.0f / factor));
+    return {val.lo - offset, val.hi - offset};
+}
+
+static interval bounds_schwarz(const uint8_t* ptr, const glm::vec3& min, const glm::vec3& max)
+{
+    i_schwarz lattice = read_packed<i_schwarz>(ptr);
+    float factor = 4.0f / lattice.thickness;
+    float offset = lattice.thickness / factor;
+    interval sn[3], cs[3];
+    trig_bounds(lattice.scale, min, max, sn, cs);
+    interval val = abs(scale(add(add(cs[0], cs[1]), cs[2]), 1.0f / factor));
+    return {val.lo - offset, val.hi - offset};
+}
+
+static interval bounds_simple(const uint8_t* ptr, uint8_t type, const glm::vec3& min, const glm::vec3& max)
+{
+    switch (type)
+    {
+    case ENT_TYPE_BOX: return widen(bounds_box(ptr, min, max));
+    case ENT_TYPE_SPHERE: return widen(bounds_sphere(ptr, min, max));
+    case ENT_TYPE_GYROID: return widen(bounds_gyroid(ptr, min, max));
+    case ENT_TYPE_SCHWARZ: return widen(bounds_schwarz(ptr, min, max));
+    case ENT_TYPE_CYLINDER: return widen(bounds_cylinder(ptr, min, max));
+    case ENT_TYPE_HALFSPACE: return widen(bounds_halfspace(ptr, min, max));
+    case ENT_TYPE_POLYFACE: return widen(bounds_polyface(ptr, min, max));
+    default: return {1.0f, 1.0f};
+    }
+}
+
+/*The csg operations are continuous and non-decreasing in both operands (see apply_union
+and apply_intersection in cpu_eval.cpp), so their bounds are the operation applied to the
+bounds of the operands.*/
+static float union_value(float r, float a, float b)
+{
+    float da = r - a, db = r - b;
+    return (a < r && b < r) ? r - std::sqrt(da * da + db * db) : std::min(a, b);
+}
+
+static float intersection_value(float r, float a, float b)
+{
+    float da = a + r, db = b + r;
+    return (r != 0.0f && a > -r && b > -r) ? std::sqrt(da * da + db * db) - r : std::max(a, b);
+}
+
+static interval bounds_blend(const float (&p1)[3], const float (&p2)[3], bool smooth, interval a, interval b,
+    const glm::vec3& min, const glm::vec3& max)
+{
+    glm::vec3 start(p1[0], p1[1], p1[2]);
+    glm::vec3 line = glm::vec3(p2[0], p2[1], p2[2]) - start;
+    float modL2 = glm::dot(line, line);
+    interval lambda = linear_bounds(line / modL2, start, min, max);
+    lambda = {std::min(1.0f, std::max(0.0f, lambda.lo)), std::min(1.0f, std::max(0.0f, lambda.hi))};
+    if (smooth)
+    {
+        // Increasing on [0, 1].
+        auto s = [](float l) { return (l * l) / (l * l + (1.0f - l) * (1.0f - l)); };
+        lambda = {s(lambda.lo), s(lambda.hi)};
+    }
+    // (lambda * b + (1 - lambda) * a) scaled by a factor in (0, 1].
+    interval mixed = add(a, mul(lambda, {b.lo - a.hi, b.hi - a.lo}));
+    float maxDiff = std::max(std::fabs(a.hi - b.lo), std::fabs(b.hi - a.lo));
+    float modL = std::sqrt(modL2);
+    interval factor = {modL / std::sqrt(modL2 + maxDiff * maxDiff), 1.0f};
+    interval val = mul(mixed, factor);
+    return smooth ? scale(val, 0.8f) : val;
+}
+
+static interval bounds_op(const op_defn& op, interval a, interval b, const glm::vec3& min, const glm::vec3& max)
+{
+    switch (op.type)
+    {
+    case OP_UNION:
+    {
+        float r = op.data.blend_radius;
+        return widen({union_value(r, a.lo, b.lo), union_value(r, a.hi, b.hi)});
+    }
+    case OP_INTERSECTION:
+    {
+        float r = op.data.blend_radius;
+        return widen({intersection_value(r, a.lo, b.lo), intersection_value(r, a.hi, b.hi)});
+    }
+    case OP_SUBTRACTION:
+    {
+        float r = op.data.blend_radius;
+        return widen({intersection_value(r, a.lo, -b.hi), intersection_value(r, a.hi, -b.lo)});
+    }
+    case OP_OFFSET:
+        return {a.lo - op.data.offset_distance, a.hi - op.data.offset_distance};
+    case OP_LINBLEND:
+        return widen(bounds_blend(op.data.lin_blend.p1, op.data.lin_blend.p2, false, a, b, min, max));
+    case OP_SMOOTHBLEND:
+        return widen(bounds_blend(op.data.smooth_blend.p1, op.data.smooth_blend.p2, true, a, b, min, max));
+    case OP_NONE:
+    default:
+        return a;
+    }
+}
+
+enum class operand_choice
+{
+    none,
+    left,
+    right
+};
+
+/**
+ * \brief Checks if the result of the operation is exactly one of its operands everywhere in the box.
+ */
+static operand_choice simplify_op(const op_defn& op, interval a, interval b)
+{
+    switch (op.type)
+    {
+    case OP_UNION:
+    {
+        // min(a, b) without blending requires one of them to be at least the blend radius.
+        float r = op.data.blend_radius;
+        if (a.lo >= r && a.lo >= b.hi)
+            return operand_choice::right;
+        if (b.lo >= r && b.lo >= a.hi)
+            return operand_choice::left;
+        return operand_choice::none;
+    }
+    case OP_INTERSECTION:
+    {
+        float r = op.data.blend_radius;
+        if (b.hi <= a.lo && (r == 0.0f || b.hi <= -r))
+            return operand_choice::left;
+        if (a.hi <= b.lo && (r == 0.0f || a.hi <= -r))
+            return operand_choice::right;
+        return operand_choice::none;
+    }
+    case OP_SUBTRACTION:
+    {
+        // The cutter does not reach the box.
+        float r = op.data.blend_radius;
+        if (-b.lo <= a.lo && (r == 0.0f || -b.lo <= -r))
+            return operand_choice::left;
+        return operand_choice::none;
+    }
+    case OP_NONE:
+        return operand_choice::left;
+    default:
+        return operand_choice::none;
+    }
+}
+
+interval cpu_eval::program::bounds(const glm::vec3& min, const glm::vec3& max) const
+{
+    interval result;
+    specialize(min, max, &result);
+    return result;
+}
+
+cpu_eval::program cpu_eval::program::specialize(const glm::vec3& min, const glm::vec3& max, interval* boundsOut) const
+{
+    size_t nEntities = types.size();
+    if (nEntities == 0)
+    {
+        if (boundsOut)
+            *boundsOut = {1.0f, 1.0f};
+        return *this;
+    }
+    std::vector<interval> entityBounds(nEntities);
+    for (size_t ei = 0; ei < nEntities; ei++)
+        entityBounds[ei] = bounds_simple(bytes.data() + offsets[ei], types[ei], min, max);
+
+    /*A value is either a simple entity (SRC_VAL) or the result of a step (SRC_REG, with the index
+    of the step). Registers are tracked to find which value each operand refers to.*/
+    struct value
+    {
+        uint32_t src;
+        uint32_t index;
+    };
+    std::vector<value> regValues(numRegisters, {SRC_VAL, 0});
+    std::vector<interval> regBounds(numRegisters, {1.0f, 1.0f});
+    std::vector<value> stepOperands(2 * steps.size());
+    auto resolve = [&](uint32_t src, uint32_t index, interval& bnd) {
+        if (src == SRC_REG)
+        {
+            bnd = regBounds[index];
+            return regValues[index];
+        }
+        bnd = entityBounds[index];
+        return value {SRC_VAL, index};
+    };
+    for (size_t si = 0; si < steps.size(); si++)
+    {
+        const op_step& step = steps[si];
+        interval lb, rb;
+        value l = resolve(step.left_src, step.left_index, lb);
+        // Offsets and OP_NONE steps have no right operand, and its index may not be valid.
+        bool binary = step.op.type != OP_OFFSET && step.op.type != OP_NONE;
+        value r = binary ? resolve(step.right_src, step.right_index, rb) : l;
+        if (!binary)
+            rb = lb;
+        switch (simplify_op(step.op, lb, rb))
+        {
+        case operand_choice::left:
+            regValues[step.dest] = l;
+            regBounds[step.dest] = lb;
+            break;
+        case operand_choice::right:
+            regValues[step.dest] = r;
+            regBounds[step.dest] = rb;
+            break;
+        case operand_choice::none:
+            stepOperands[2 * si] = l;
+            stepOperands[2 * si + 1] = r;
+            regValues[step.dest] = {SRC_REG, (uint32_t)si};
+            regBounds[step.dest] = bounds_op(step.op, lb, rb, min, max);
+            break;
+        }
+    }
+    value root = steps.empty() ? value {SRC_VAL, 0} : regValues[0];
+    if (boundsOut)
+        *boundsOut = steps.empty() ? entityBounds[0] : regBounds[0];
+
+    // Find the steps and entities that the result depends on.
+    std::vector<bool> liveSteps(steps.size(), false);
+    std::vector<bool> liveEntities(nEntities, false);
+    std::vector<value> stack = {root};
+    while (!stack.empty())
+    {
+        value v = stack.back();
+        stack.pop_back();
+        if (v.src == SRC_VAL)
+        {
+            liveEntities[v.index] = true;
+            continue;
+        }
+        if (liveSteps[v.index])
+            continue;
+        liveSteps[v.index] = true;
+        stack.push_back(stepOperands[2 * v.index]);
+        stack.push_back(stepOperands[2 * v.index + 1]);
+    }
+
+    // Copy the live entities, keeping their order, with the root first if it is an entity.
+    program result;
+    std::vector<uint32_t> entityMap(nEntities, 0);
+    auto copyEntity = [&](size_t ei) {
+        size_t end = ei + 1 < nEntities ? offsets[ei + 1] : bytes.size();
+        entityMap[ei] = (uint32_t)result.types.size();
+        result.offsets.push_back((uint32_t)result.bytes.size());
+        result.types.push_back(types[ei]);
+        result.bytes.insert(result.bytes.end(), bytes.begin() + offsets[ei], bytes.begin() + end);
+        liveEntities[ei] = false;
+    };
+    if (root.src == SRC_VAL)
+    {
+        copyEntity(root.index);
+        return result;
+    }
+    for (size_t ei = 0; ei < nEntities; ei++)
+        if (liveEntities[ei])
+            copyEntity(ei);
+
+    // The live steps keep their order. Registers are reassigned, and freed after their last use.
+    std::vector<size_t> lastUse(steps.size(), 0);
+    for (size_t si = 0; si < steps.size(); si++)
+    {
+        if (!liveSteps[si])
+            continue;
+        for (int side = 0; side < 2; side++)
+        {
+            const value& v = stepOperands[2 * si + side];
+            if (v.src == SRC_REG)
+                lastUse[v.index] = si;
+        }
+    }
+    std::vector<uint32_t> stepRegs(steps.size(), 0);
+    std::vector<bool> busy;
+    for (size_t si = 0; si < steps.size(); si++)
+    {
+        if (!liveSteps[si])
+            continue;
+        op_step step = steps[si];
+        uint32_t* srcs[2] = {&step.left_src, &step.right_src};
+        uint32_t* indices[2] = {&step.left_index, &step.right_index};
+        for (int side = 0; side < 2; side++)
+        {
+            const value& v = stepOperands[2 * si + side];
+            *srcs[side] = v.src;
+            *indices[side] = v.src == SRC_REG ? stepRegs[v.index] : entityMap[v.index];
+            if (v.src == SRC_REG && lastUse[v.index] == si)
+                busy[stepRegs[v.index]] = false;
+        }
+        uint32_t reg = (uint32_t)(std::find(busy.begin(), busy.end(), false) - busy.begin());
+        if (reg == busy.size())
+            busy.push_back(true);
+        else
+            busy[reg] = true;
+        step.dest = reg;
+        stepRegs[si] = reg;
+        result.steps.push_back(step);
+    }
+
+    // The result is expected in the first register.
+    uint32_t rootReg = stepRegs[root.index];
+    if (rootReg != 0)
+    {
+        auto swapReg = [rootReg](uint32_t& reg) {
+            if (reg == 0)
+                reg = rootReg;
+            else if (reg == rootReg)
+                reg = 0;
+        };
+        for (op_step& step : result.steps)
+        {
+            if (step.left_src == SRC_REG)
+                swapReg(step.left_index);
+            if (step.right_src == SRC_REG)
+                swapReg(step.right_index);
+            swapReg(step.dest);
+        }
+    }
+    result.numRegisters = busy.size();
+    return result;
+}
+
+cpu_eval::region_tree::region_tree(const program& prog, const glm::vec3& min, const glm::vec3& max, size_t maxDepth) :
+    m_full(prog),
+    m_numLeaves(0)
+{
+    m_programs.push_back(prog);
+    m_nodes.push_back({min, max, 0, 0});
+    build(0, 0, maxDepth);
+}
+
+void cpu_eval::region_tree::build(size_t nodeIndex, size_t depth, size_t maxDepth)
+{
+    const node current = m_nodes[nodeIndex];
+    m_programs[current.programIndex] = m_programs[current.programIndex].specialize(current.min, current.max);
+    if (depth >= maxDepth || m_programs[current.programIndex].steps.empty())
+    {
+        m_numLeaves++;
+        return;
+    }
+    size_t first = m_nodes.size();
+    m_nodes[nodeIndex].firstChild = first;
+    glm::vec3 mid = (current.min + current.max) * 0.5f;
+    for (int c = 0; c < 8; c++)
+    {
+        glm::vec3 cmin((c & 1) ? mid.x : current.min.x, (c & 2) ? mid.y : current.min.y, (c & 4) ? mid.z : current.min.z);
+        glm::vec3 cmax((c & 1) ? current.max.x : mid.x, (c & 2) ? current.max.y : mid.y, (c & 4) ? current.max.z : mid.z);
+        // Children start from the program of the parent, which is already shorter.
+        m_programs.push_back(m_programs[current.programIndex]);
+        m_nodes.push_back({cmin, cmax, 0, m_programs.size() - 1});
+    }
+    for (int c = 0; c < 8; c++)
+        build(first + c, depth + 1, maxDepth);
+}
+
+size_t cpu_eval::region_tree::find_leaf(float x, float y, float z) const
+{
+    const node& root = m_nodes[0];
+    if (x < root.min.x || y < root.min.y || z < root.min.z || x > root.max.x || y > root.max.y || z > root.max.z)
+        return SIZE_MAX;
+    size_t ni = 0;
+    while (m_nodes[ni].firstChild != 0)
+    {
+        const node& nd = m_nodes[ni];
+        glm::vec3 mid = (nd.min + nd.max) * 0.5f;
+        ni = nd.firstChild + (x >= mid.x ? 1 : 0) + (y >= mid.y ? 2 : 0) + (z >= mid.z ? 4 : 0);
+    }
+    return ni;
+}
+
+const program& cpu_eval::region_tree::find(float x, float y, float z) const
+{
+    size_t leaf = find_leaf(x, y, z);
+    // The root program was specialized to the box, so points outside need the original.
+    return leaf == SIZE_MAX ? m_full : m_programs[m_nodes[leaf].programIndex];
+}
+
+void cpu_eval::region_tree::eval(const float* x, const float* y, const float* z, float* out, size_t n, size_t nThreads) const
+{
+    // Counting sort of the points by node, with the points outside the box in the last bucket.
+    size_t nBuckets = m_nodes.size() + 1;
+    std::vector<size_t> buckets(n);
+    std::vector<size_t> starts(nBuckets + 1, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t leaf = find_leaf(x[i], y[i], z[i]);
+        buckets[i] = leaf == SIZE_MAX ? m_nodes.size() : leaf;
+        starts[buckets[i] + 1]++;
+    }
+    std::partial_sum(starts.begin(), starts.end(), starts.begin());
+    std::vector<size_t> order(n);
+    {
+        std::vector<size_t> cursor(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            order[cursor[buckets[i]]++] = i;
+    }
+    std::vector<float> buf(4 * n);
+    float *sx = buf.data(), *sy = sx + n, *sz = sy + n, *sv = sz + n;
+    for (size_t i = 0; i < n; i++)
+    {
+        sx[i] = x[order[i]];
+        sy[i] = y[order[i]];
+        sz[i] = z[order[i]];
+    }
+    for (size_t bi = 0; bi < nBuckets; bi++)
+    {
+        size_t begin = starts[bi], end = starts[bi + 1];
+        if (begin == end)
+            continue;
+        const program& prog = bi == m_nodes.size() ? m_full : m_programs[m_nodes[bi].programIndex];
+        prog.eval(sx + begin, sy + begin, sz + begin, sv + begin, end - begin, nThreads);
+    }
+    for (size_t i = 0; i < n; i++)
+        out[order[i]] = sv[i];
+}
+
+size_t cpu_eval::region_tree::num_leaves() const
+{
+    return m_numLeaves;
+}
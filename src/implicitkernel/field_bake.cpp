@@ -0,0 +1,188 @@
+#include <implicitkernel/field_bake.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace field_bake;
+
+static constexpr uint32_t BRICKS_PER_LAYER = ATLAS_BRICKS * ATLAS_BRICKS;
+static constexpr uint32_t LAYER_WIDTH = ATLAS_BRICKS * BRICK_SIZE; // Samples along x and y of a layer.
+
+void field_bake::grid_size(const cpu_eval::aabb& box, uint32_t(&cells)[3], float& cellSize)
+{
+    glm::vec3 extent = box.max - box.min;
+    cellSize = std::max({ extent.x, extent.y, extent.z }) / COARSE_CELLS;
+    for (int i = 0; i < 3; i++)
+        cells[i] = std::max(2u, std::min(COARSE_CELLS, (uint32_t)std::ceil(extent[i] / cellSize)));
+}
+
+baker::baker(publish_fn publish)
+    : m_publish(std::move(publish))
+{
+    m_thread = std::thread(&baker::run, this);
+}
+
+baker::~baker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+}
+
+void baker::request(uint64_t generation, cpu_eval::program prog, float lipschitz, const cpu_eval::aabb& box)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.reset(new job{ generation, std::move(prog), lipschitz, box });
+        m_latest = generation;
+    }
+    m_cv.notify_one();
+}
+
+void baker::cancel(uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pending && m_pending->generation < generation)
+        m_pending.reset();
+    m_latest = std::max(m_latest, generation);
+}
+
+bool baker::stale(uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_exit || generation != m_latest;
+}
+
+void baker::run()
+{
+    while (true)
+    {
+        std::unique_ptr<job> work;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_exit || m_pending; });
+            if (m_exit)
+                return;
+            work = std::move(m_pending);
+        }
+        bake(*work);
+    }
+}
+
+/**
+ * \brief A cell that gets a brick, with the smallest magnitude of the field at its corners.
+ */
+struct surface_cell
+{
+    uint32_t cell;
+    float nearest;
+};
+
+void baker::bake(const job& work)
+{
+    brick_map map;
+    map.generation = work.generation;
+    map.min = work.box.min;
+    grid_size(work.box, map.cells, map.cellSize);
+    glm::vec3 max = map.min + glm::vec3(map.cells[0], map.cells[1], map.cells[2]) * map.cellSize;
+    // Most cells are far from all but a few entities.
+    cpu_eval::region_tree tree(work.prog, map.min, max);
+
+    uint32_t nx = map.cells[0] + 1, ny = map.cells[1] + 1, nz = map.cells[2] + 1;
+    size_t nCorners = (size_t)nx * ny * nz;
+    std::vector<float> x(nCorners), y(nCorners), z(nCorners);
+    for (size_t i = 0; i < nCorners; i++)
+    {
+        x[i] = map.min.x + (i % nx) * map.cellSize;
+        y[i] = map.min.y + ((i / nx) % ny) * map.cellSize;
+        z[i] = map.min.z + (i / ((size_t)nx * ny)) * map.cellSize;
+    }
+    map.coarse.resize(nCorners);
+    tree.eval(x.data(), y.data(), z.data(), map.coarse.data(), nCorners);
+    if (stale(work.generation))
+        return;
+
+    /*The surface can only pass through cells with a corner within sqrt(3) cell sizes of it. The
+    band is wider, so that the rays still step by whole cells in the cells around it.*/
+    std::vector<surface_cell> surface;
+    size_t nCells = (size_t)map.cells[0] * map.cells[1] * map.cells[2];
+    float band = NARROW_BAND * map.cellSize * work.lipschitz;
+    for (uint32_t cell = 0; cell < nCells; cell++)
+    {
+        uint32_t cx = cell % map.cells[0];
+        uint32_t cy = (cell / map.cells[0]) % map.cells[1];
+        uint32_t cz = cell / (map.cells[0] * map.cells[1]);
+        float nearest = INFINITY;
+        for (uint32_t corner = 0; corner < 8; corner++)
+        {
+            size_t i = (cx + (corner & 1)) + (cy + ((corner >> 1) & 1)) * nx + (cz + (corner >> 2)) * (size_t)nx * ny;
+            nearest = std::min(nearest, std::fabs(map.coarse[i]));
+        }
+        if (nearest <= band)
+            surface.push_back({ cell, nearest });
+    }
+    // The cells the surface passes through are baked first, and kept if there are too many.
+    std::sort(surface.begin(), surface.end(),
+        [](const surface_cell& a, const surface_cell& b) { return a.nearest < b.nearest; });
+    surface.resize(std::min(surface.size(), (size_t)MAX_LAYERS * BRICKS_PER_LAYER));
+    map.layers = (uint32_t)((surface.size() + BRICKS_PER_LAYER - 1) / BRICKS_PER_LAYER);
+    map.index.assign(nCells * 4, 0);
+    for (size_t slot = 0; slot < surface.size(); slot++)
+    {
+        uint16_t* entry = map.index.data() + surface[slot].cell * 4;
+        entry[0] = (uint16_t)(slot % ATLAS_BRICKS);
+        entry[1] = (uint16_t)((slot / ATLAS_BRICKS) % ATLAS_BRICKS);
+        entry[2] = (uint16_t)(slot / BRICKS_PER_LAYER);
+    }
+    m_publish(map);
+
+    size_t samplesPerBrick = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+    float spacing = map.cellSize / (BRICK_SIZE - 1);
+    std::vector<float> values;
+    std::vector<size_t> targets;
+    for (uint32_t layer = 0; layer < map.layers; layer++)
+    {
+        if (stale(work.generation))
+            return;
+        size_t first = (size_t)layer * BRICKS_PER_LAYER;
+        size_t end = std::min(surface.size(), first + BRICKS_PER_LAYER);
+        size_t n = (end - first) * samplesPerBrick;
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        values.resize(n);
+        targets.resize(n);
+        size_t p = 0;
+        for (size_t slot = first; slot < end; slot++)
+        {
+            uint32_t cell = surface[slot].cell;
+            glm::vec3 corner = map.min + glm::vec3(cell % map.cells[0], (cell / map.cells[0]) % map.cells[1],
+                cell / (map.cells[0] * map.cells[1])) * map.cellSize;
+            size_t ax = (slot % ATLAS_BRICKS) * BRICK_SIZE;
+            size_t ay = ((slot / ATLAS_BRICKS) % ATLAS_BRICKS) * BRICK_SIZE;
+            for (uint32_t k = 0; k < BRICK_SIZE; k++)
+            {
+                for (uint32_t j = 0; j < BRICK_SIZE; j++)
+                {
+                    for (uint32_t i = 0; i < BRICK_SIZE; i++, p++)
+                    {
+                        x[p] = corner.x + i * spacing;
+                        y[p] = corner.y + j * spacing;
+                        z[p] = corner.z + k * spacing;
+                        targets[p] = (ax + i) + (ay + j) * LAYER_WIDTH + k * (size_t)LAYER_WIDTH * LAYER_WIDTH;
+                    }
+                }
+            }
+        }
+        tree.eval(x.data(), y.data(), z.data(), values.data(), n);
+        map.layerSamples.assign((size_t)LAYER_WIDTH * LAYER_WIDTH * BRICK_SIZE, 0.0f);
+        for (size_t i = 0; i < n; i++)
+            map.layerSamples[targets[i]] = values[i];
+        for (size_t slot = first; slot < end; slot++)
+            map.index[surface[slot].cell * 4 + 3] = 1;
+        map.layer = layer;
+        m_publish(map);
+    }
+}
@@ -0,0 +1,154 @@
+#include <implicitkernel/frame_stats.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace frame_stats
+{
+    /**
+     * \brief Ring buffer of the latest samples of a timer.
+     */
+    struct window
+    {
+        std::vector<double> samples;
+        size_t next = 0;
+
+        void add(double value)
+        {
+            if (samples.size() < WINDOW_SIZE)
+                samples.push_back(value);
+            else
+                samples[next] = value;
+            next = (next + 1) % WINDOW_SIZE;
+        }
+    };
+}
+
+typedef std::chrono::steady_clock stats_clock;
+
+static std::mutex s_mutex;
+static std::map<std::string, frame_stats::window> s_windows;
+static frame_stats::kernel_info s_kernelInfo;
+static double s_logInterval = 0.0;
+static std::string s_logPath;
+static stats_clock::time_point s_lastLog;
+
+static frame_stats::summary summarize(std::vector<double> samples)
+{
+    frame_stats::summary s;
+    s.count = samples.size();
+    if (samples.empty())
+        return s;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        return samples[std::min(samples.size() - 1, (size_t)(p * (samples.size() - 1) + 0.5))];
+    };
+    double sum = 0.0;
+    for (double v : samples)
+        sum += v;
+    s.mean = sum / samples.size();
+    s.p50 = percentile(0.5);
+    s.p90 = percentile(0.9);
+    s.p99 = percentile(0.99);
+    s.max = samples.back();
+    return s;
+}
+
+void frame_stats::record(const std::string& timer, double milliseconds)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_windows[timer].add(milliseconds);
+}
+
+void frame_stats::set_kernel_info(const kernel_info& info)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_kernelInfo = info;
+}
+
+void frame_stats::reset()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_windows.clear();
+}
+
+frame_stats::report frame_stats::get_report()
+{
+    report r;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for (const auto& pair : s_windows)
+        r.timers.emplace(pair.first, summarize(pair.second.samples));
+    r.kernel = s_kernelInfo;
+    return r;
+}
+
+void frame_stats::print(const report& r, std::ostream& out)
+{
+    out << std::fixed << std::setprecision(3);
+    out << std::left << std::setw(16) << "timer (ms)" << std::right
+        << std::setw(8) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+        << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    for (const auto& [name, s] : r.timers)
+    {
+        out << std::left << std::setw(16) << name << std::right
+            << std::setw(8) << s.count << std::setw(10) << s.mean << std::setw(10) << s.p50
+            << std::setw(10) << s.p90 << std::setw(10) << s.p99 << std::setw(10) << s.max << std::endl;
+    }
+    out << "kernel: " << r.kernel.name
+        << ", private memory " << r.kernel.privateMemSize << " B"
+        << ", local memory " << r.kernel.localMemSize << " B"
+        << ", work group size " << r.kernel.workGroupSize
+        << ", registers " << r.kernel.numRegisters << std::endl;
+    out.unsetf(std::ios::floatfield);
+}
+
+void frame_stats::set_log(double intervalSeconds, const std::string& csvPath)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_logInterval = intervalSeconds;
+    s_logPath = csvPath;
+    s_lastLog = stats_clock::now();
+}
+
+static void write_csv(const frame_stats::report& r, const std::string& path)
+{
+    bool exists = std::ifstream(path).good();
+    std::ofstream f(path, std::ios::app);
+    if (!f)
+    {
+        std::cerr << "Cannot write the stats log to " << path << std::endl;
+        return;
+    }
+    if (!exists)
+        f << "time,timer,count,mean,p50,p90,p99,max,kernel,private_mem,local_mem,work_group_size,registers\n";
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    for (const auto& [name, s] : r.timers)
+    {
+        f << time << ',' << name << ',' << s.count << ',' << s.mean << ',' << s.p50 << ',' << s.p90 << ','
+            << s.p99 << ',' << s.max << ',' << r.kernel.name << ',' << r.kernel.privateMemSize << ','
+            << r.kernel.localMemSize << ',' << r.kernel.workGroupSize << ',' << r.kernel.numRegisters << '\n';
+    }
+}
+
+void frame_stats::tick()
+{
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        auto now = stats_clock::now();
+        if (s_logInterval <= 0.0 || std::chrono::duration<double>(now - s_lastLog).count() < s_logInterval)
+            return;
+        s_lastLog = now;
+        path = s_logPath;
+    }
+    report r = get_report();
+    if (path.empty())
+        print(r, std::cout);
+    else
+        write_csv(r, path);
+}
@@ -5,6 +5,221 @@
 #pragma warning(push)
 #pragma warning(disable : 26812)
 
+namespace entities {
+/**
+ * \brief The csg tree of an entity with structurally identical simple entities
+ * and subtrees merged into a single node, including copies with equal
+ * parameters that were built by separate calls. When flattened into render
+ * data, every node is computed once and its result is reused by all its
+ * parents.
+ */
+struct render_graph {
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  struct node {
+    bool simple;
+    uint8_t type;
+    std::vector<uint8_t> bytes; // Render bytes of a simple entity.
+    op_defn op;
+    uint32_t left = NONE;
+    uint32_t right = NONE;
+  };
+
+  std::vector<node> nodes;
+  std::unordered_map<std::string, uint32_t> lookup; // Structural key -> node.
+  std::unordered_map<const entity *, uint32_t> visited; // Entity -> node.
+
+  // Flattened render data.
+  std::vector<uint32_t> entityNodes; // Nodes of the simple entities.
+  std::vector<uint32_t> stepNodes;   // Nodes of the csg steps, in order.
+  std::vector<uint32_t> index;    // Entity index of each simple node.
+  std::vector<op_step> opSteps;
+  size_t numBytes = 0;
+
+  uint32_t add(node &&n);
+  void flatten(uint32_t root);
+  void write(uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types,
+             op_step *&steps) const;
+  void write_slots(std::unordered_map<const entity *, uint32_t> &slots) const;
+};
+} // namespace entities
+
+/**
+ * \brief The bytes of the operation data that are used by the given type of
+ * operation. The rest of the union is not initialized.
+ */
+static size_t op_data_size(op_type type) {
+  switch (type) {
+  case OP_UNION:
+  case OP_INTERSECTION:
+  case OP_SUBTRACTION:
+  case OP_OFFSET:
+    return sizeof(float);
+  case OP_LINBLEND:
+    return sizeof(lin_blend_data);
+  case OP_SMOOTHBLEND:
+    return sizeof(smooth_blend_data);
+  default:
+    return 0;
+  }
+}
+
+template <typename T> static void append_key(std::string &key, const T &value) {
+  key.append((const char *)&value, sizeof(T));
+}
+
+uint32_t entities::render_graph::add(node &&n) {
+  std::string key;
+  append_key(key, n.type);
+  if (n.simple) {
+    key.append((const char *)n.bytes.data(), n.bytes.size());
+  } else {
+    append_key(key, n.op.type);
+    key.append((const char *)&n.op.data, op_data_size(n.op.type));
+    append_key(key, n.left);
+    append_key(key, n.right);
+  }
+  auto match = lookup.find(key);
+  if (match != lookup.end())
+    return match->second;
+  uint32_t i = (uint32_t)nodes.size();
+  nodes.push_back(std::move(n));
+  lookup.emplace(std::move(key), i);
+  return i;
+}
+
+void entities::render_graph::flatten(uint32_t root) {
+  /* Simple entities with a single parent are evaluated where they are used. The
+  shared ones are evaluated once by an OP_NONE step that loads them into a
+  register, which all their parents read.*/
+  std::vector<uint32_t> parents(nodes.size(), 0);
+  for (const node &n : nodes) {
+    if (n.left != NONE)
+      parents[n.left]++;
+    if (n.right != NONE)
+      parents[n.right]++;
+  }
+  auto inRegister = [&](uint32_t ni) {
+    return ni != NONE && (!nodes[ni].simple || parents[ni] > 1);
+  };
+
+  /* Sethi-Ullman numbering. The children of a node are added before the node,
+  so the nodes are already in topological order. Of the two children, the one
+  that needs more registers is computed first, so that fewer registers are held
+  while computing the other one.*/
+  std::vector<uint32_t> need(nodes.size(), 0);
+  std::vector<bool> rightFirst(nodes.size(), false);
+  for (size_t ni = 0; ni < nodes.size(); ni++) {
+    const node &n = nodes[ni];
+    if (n.simple) {
+      need[ni] = inRegister((uint32_t)ni) ? 1 : 0;
+      continue;
+    }
+    uint32_t l = n.left == NONE ? 0 : need[n.left];
+    uint32_t r = n.right == NONE ? 0 : need[n.right];
+    uint32_t lres = inRegister(n.left) ? 1 : 0;
+    uint32_t rres = inRegister(n.right) ? 1 : 0;
+    uint32_t leftFirstNeed = std::max(l, lres + r);
+    uint32_t rightFirstNeed = std::max(r, rres + l);
+    rightFirst[ni] = rightFirstNeed < leftFirstNeed;
+    need[ni] = std::max(1u, std::min(leftFirstNeed, rightFirstNeed));
+  }
+
+  // Order the nodes depth first, each node only once.
+  index.assign(nodes.size(), NONE);
+  std::vector<bool> done(nodes.size(), false);
+  std::vector<std::pair<uint32_t, bool>> stack = {{root, false}};
+  while (!stack.empty()) {
+    auto [ni, expanded] = stack.back();
+    stack.pop_back();
+    if (done[ni])
+      continue;
+    const node &n = nodes[ni];
+    if (n.simple) {
+      done[ni] = true;
+      index[ni] = (uint32_t)entityNodes.size();
+      entityNodes.push_back(ni);
+      numBytes += n.bytes.size();
+      if (inRegister(ni))
+        stepNodes.push_back(ni); // Loaded before its first use.
+    } else if (expanded) {
+      done[ni] = true;
+      stepNodes.push_back(ni);
+    } else {
+      stack.push_back({ni, true});
+      uint32_t first = rightFirst[ni] ? n.right : n.left;
+      uint32_t second = rightFirst[ni] ? n.left : n.right;
+      if (second != NONE)
+        stack.push_back({second, false});
+      if (first != NONE)
+        stack.push_back({first, false});
+    }
+  }
+
+  /* Liveness based allocation. The register holding the result of a step is
+  released after its last use, and every step writes to the lowest free
+  register, which may be one of its own operands.*/
+  std::vector<uint32_t> uses = parents;
+  std::vector<uint32_t> regs(nodes.size(), NONE); // Register of each result.
+  std::vector<bool> busy;
+  auto operand = [&](uint32_t child, uint32_t &src, uint32_t &idx) {
+    if (child == NONE) {
+      src = SRC_VAL;
+      idx = 0;
+      return;
+    }
+    if (!inRegister(child)) {
+      src = SRC_VAL;
+      idx = index[child];
+      return;
+    }
+    src = SRC_REG;
+    idx = regs[child];
+    if (--uses[child] == 0)
+      busy[idx] = false;
+  };
+  opSteps.clear();
+  for (uint32_t ni : stepNodes) {
+    const node &n = nodes[ni];
+    op_step step;
+    if (n.simple) {
+      step.op = {};
+      step.op.type = OP_NONE;
+      step.left_src = SRC_VAL;
+      step.left_index = index[ni];
+      operand(NONE, step.right_src, step.right_index);
+    } else {
+      step.op = n.op;
+      operand(n.left, step.left_src, step.left_index);
+      operand(n.right, step.right_src, step.right_index);
+    }
+    uint32_t reg =
+        (uint32_t)(std::find(busy.begin(), busy.end(), false) - busy.begin());
+    if (reg == busy.size())
+      busy.push_back(true);
+    else
+      busy[reg] = true;
+    step.dest = reg;
+    regs[ni] = reg;
+    opSteps.push_back(step);
+  }
+}
+
+void entities::render_graph::write(uint8_t *&bytes, uint32_t *&offsets,
+                                   uint8_t *&types, op_step *&steps) const {
+  uint32_t offset = 0;
+  for (uint32_t ni : entityNodes) {
+    const node &n = nodes[ni];
+    *(offsets++) = offset;
+    offset += (uint32_t)n.bytes.size();
+    std::memcpy(bytes, n.bytes.data(), n.bytes.size());
+    bytes += n.bytes.size();
+    *(types++) = n.type;
+  }
+  for (const op_step &step : opSteps)
+    *(steps++) = step;
+}
+
 entities::box3::box3(float xcenter, float ycenter, float zcenter, float xhalf,
                      float yhalf, float zhalf)
     : center(xcenter, ycenter, zcenter), halfsize(xhalf, yhalf, zhalf) {}
@@ -22,26 +237,19 @@ void entities::box3::write_render_bytes(uint8_t *&bytes) const {
 
 bool entities::simp_entity::simple() const { return true; }
 
-void entities::simp_entity::render_data_size_internal(
-    size_t &nBytes, size_t &nSteps,
-    std::unordered_set<entity *> &simpleEntities) const {
-  nBytes += num_render_bytes();
-  simpleEntities.insert((entity *)this);
-}
-
-void entities::simp_entity::copy_render_data_internal(
-    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
-    size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-    std::unordered_map<entity *, uint32_t> &regMap) const {
-  auto match = regMap.find((entity *)this);
-  if (match == regMap.end()) {
-    *(offsets++) = (uint32_t)currentOffset;
-    currentOffset += num_render_bytes();
-    write_render_bytes(bytes);
-    *(types++) = type();
-    regMap.emplace((entity *)this, (uint32_t)entityIndex);
-    entityIndex++;
-  }
+uint32_t entities::simp_entity::hash_cons(render_graph &graph) const {
+  auto match = graph.visited.find(this);
+  if (match != graph.visited.end())
+    return match->second;
+  render_graph::node n;
+  n.simple = true;
+  n.type = type();
+  n.bytes.resize(num_render_bytes());
+  uint8_t *ptr = n.bytes.data();
+  write_render_bytes(ptr);
+  uint32_t index = graph.add(std::move(n));
+  graph.visited.emplace(this, index);
+  return index;
 }
 
 entities::comp_entity::comp_entity(std::shared_ptr<entity> l,
@@ -55,52 +263,19 @@ bool entities::comp_entity::simple() const { return false; }
 
 uint8_t entities::comp_entity::type() const { return ENT_TYPE_CSG; }
 
-void entities::comp_entity::render_data_size_internal(
-    size_t &nBytes, size_t &nSteps,
-    std::unordered_set<entities::entity *> &simpleEntities) const {
-  if (left)
-    left->render_data_size_internal(nBytes, nSteps, simpleEntities);
-  if (right)
-    right->render_data_size_internal(nBytes, nSteps, simpleEntities);
-  nSteps++;
-}
-
-void entities::comp_entity::copy_render_data_internal(
-    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
-    size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
-    std::unordered_map<entity *, uint32_t> &regMap) const {
-  bool lcsg = (left) ? !left->simple() : false;
-  bool rcsg = (right) ? !right->simple() : false;
-  auto lmatch = lcsg ? regMap.end() : regMap.find(left.get());
-  auto rmatch = rcsg ? regMap.end() : regMap.find(right.get());
-
-  if (regVal >= MAX_ENTITY_COUNT - 2) {
-    std::cerr << "Too many entities. Out of resources. Aborting...\n";
-    exit(1);
-  }
-
-  uint32_t lsrc =
-      lcsg ? regVal
-           : lmatch == regMap.end() ? (uint32_t)entityIndex : lmatch->second;
-
-  if (left)
-    left->copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
-                                    currentOffset, regVal, regMap);
-
-  uint32_t rsrc = (rcsg && lcsg)
-                      ? regVal + 1
-                      : rcsg ? regVal
-                             : rmatch == regMap.end() ? (uint32_t)entityIndex
-                                                      : rmatch->second;
-
-  if (right)
-    right->copy_render_data_internal(
-        bytes, offsets, types, steps, entityIndex, currentOffset,
-        (lcsg && rcsg) ? (regVal + 1) : regVal, regMap);
-
-  *(steps++) = {op,   lcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
-                lsrc, rcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
-                rsrc, regVal};
+uint32_t entities::comp_entity::hash_cons(render_graph &graph) const {
+  auto match = graph.visited.find(this);
+  if (match != graph.visited.end())
+    return match->second;
+  render_graph::node n;
+  n.simple = false;
+  n.type = ENT_TYPE_CSG;
+  n.op = op;
+  n.left = left ? left->hash_cons(graph) : render_graph::NONE;
+  n.right = right ? right->hash_cons(graph) : render_graph::NONE;
+  uint32_t index = graph.add(std::move(n));
+  graph.visited.emplace(this, index);
+  return index;
 }
 
 entities::sphere3::sphere3(float xcenter, float ycenter, float zcenter,
@@ -176,19 +351,142 @@ void entities::halfspace::write_render_bytes(uint8_t *&bytes) const {
   bytes += sizeof(ient);
 }
 
+void entities::render_graph::write_slots(
+    std::unordered_map<const entity *, uint32_t> &slots) const {
+  std::vector<uint32_t> owners(nodes.size(), 0);
+  for (const auto &pair : visited)
+    owners[pair.second]++;
+  std::vector<uint32_t> stepIndex(nodes.size(), NO_SLOT);
+  for (size_t si = 0; si < stepNodes.size(); si++)
+    stepIndex[stepNodes[si]] = (uint32_t)si;
+  for (const auto &pair : visited) {
+    uint32_t ni = pair.second;
+    slots[pair.first] = owners[ni] > 1      ? NO_SLOT
+                        : nodes[ni].simple ? index[ni]
+                                           : stepIndex[ni];
+  }
+}
+
 void entities::entity::render_data_size(size_t &nBytes, size_t &nEntities,
                                         size_t &nSteps) const {
-  std::unordered_set<entity *> simples;
-  render_data_size_internal(nBytes, nSteps, simples);
-  nEntities = simples.size();
-}
-
-void entities::entity::copy_render_data(uint8_t *&bytes, uint32_t *&offsets,
-                                        uint8_t *&types,
-                                        op_step *&steps) const {
-  size_t entityIndex = 0;
-  size_t currentOffset = 0;
-  std::unordered_map<entity *, uint32_t> regMap;
-  copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
-                            currentOffset, 0, regMap);
+  render_graph graph;
+  graph.flatten(hash_cons(graph));
+  nBytes = graph.numBytes;
+  nEntities = graph.entityNodes.size();
+  nSteps = graph.opSteps.size();
+}
+
+void entities::entity::copy_render_data(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+    std::unordered_map<const entity *, uint32_t> *slots) const {
+  render_graph graph;
+  graph.flatten(hash_cons(graph));
+  graph.write(bytes, offsets, types, steps);
+  if (slots)
+    graph.write_slots(*slots);
+}
+
+bool entities::entity::set_param(const std::string & /*name*/,
+                                 float /*value*/) {
+  return false;
+}
+
+/**
+ * \brief Finds the component of the vector named by a coordinate followed by
+ * the given suffix, e.g. "x1" for the suffix "1".
+ */
+static float *vec_param(glm::vec3 &v, const std::string &name,
+                        const std::string &suffix = "") {
+  if (name.size() != suffix.size() + 1 ||
+      name.compare(1, std::string::npos, suffix) != 0)
+    return nullptr;
+  switch (name[0]) {
+  case 'x':
+    return &v.x;
+  case 'y':
+    return &v.y;
+  case 'z':
+    return &v.z;
+  default:
+    return nullptr;
+  }
+}
+
+template <typename T> static bool assign(T *dst, float value) {
+  if (!dst)
+    return false;
+  *dst = value;
+  return true;
+}
+
+void entities::simp_entity::render_bytes(std::vector<uint8_t> &bytes) const {
+  bytes.resize(num_render_bytes());
+  uint8_t *ptr = bytes.data();
+  write_render_bytes(ptr);
+}
+
+bool entities::box3::set_param(const std::string &name, float value) {
+  if (name.compare(0, 4, "half") == 0)
+    return assign(vec_param(halfsize, name.substr(4)), value);
+  return assign(vec_param(center, name), value);
+}
+
+bool entities::sphere3::set_param(const std::string &name, float value) {
+  if (name == "radius")
+    return assign(&radius, value);
+  return assign(vec_param(center, name), value);
+}
+
+bool entities::cylinder3::set_param(const std::string &name, float value) {
+  if (name == "radius")
+    return assign(&radius, value);
+  float *coord = vec_param(point1, name, "1");
+  return assign(coord ? coord : vec_param(point2, name, "2"), value);
+}
+
+bool entities::gyroid::set_param(const std::string &name, float value) {
+  if (name == "scale")
+    return assign(&scale, value);
+  if (name == "thickness")
+    return assign(&thickness, value);
+  return false;
+}
+
+bool entities::schwarz::set_param(const std::string &name, float value) {
+  if (name == "scale")
+    return assign(&scale, value);
+  if (name == "thickness")
+    return assign(&thickness, value);
+  return false;
+}
+
+bool entities::halfspace::set_param(const std::string &name, float value) {
+  if (name.size() == 2 && name[0] == 'n')
+    return assign(vec_param(normal, name.substr(1)), value);
+  return assign(vec_param(origin, name), value);
+}
+
+bool entities::comp_entity::set_param(const std::string &name, float value) {
+  switch (op.type) {
+  case OP_UNION:
+  case OP_INTERSECTION:
+  case OP_SUBTRACTION:
+    return name == "radius" && assign(&op.data.blend_radius, value);
+  case OP_OFFSET:
+    return name == "distance" && assign(&op.data.offset_distance, value);
+  case OP_LINBLEND:
+  case OP_SMOOTHBLEND: {
+    // Both blends share the layout of lin_blend_data.
+    float *p1 = op.data.lin_blend.p1, *p2 = op.data.lin_blend.p2;
+    glm::vec3 v1(p1[0], p1[1], p1[2]), v2(p2[0], p2[1], p2[2]);
+    float *coord = vec_param(v1, name, "1");
+    if (!assign(coord ? coord : vec_param(v2, name, "2"), value))
+      return false;
+    p1[0] = v1.x, p1[1] = v1.y, p1[2] = v1.z;
+    p2[0] = v2.x, p2[1] = v2.y, p2[2] = v2.z;
+    return true;
+  }
+  default:
+    return false;
+  }
 }
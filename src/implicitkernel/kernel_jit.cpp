@@ -0,0 +1,181 @@
+#include <implicitkernel/kernel_jit.h>
+#include <sstream>
+#include <vector>
+
+static constexpr uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static constexpr uint64_t FNV_PRIME = 1099511628211ULL;
+
+static void hash_combine(uint64_t& hash, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= FNV_PRIME;
+    }
+}
+
+uint64_t kernel_jit::structural_hash(const uint32_t* offsets, const uint8_t* types, size_t nEntities,
+    const op_step* steps, size_t nSteps)
+{
+    uint64_t hash = FNV_OFFSET;
+    hash_combine(hash, (uint32_t)nEntities);
+    hash_combine(hash, (uint32_t)nSteps);
+    for (size_t i = 0; i < nEntities; i++)
+    {
+        hash_combine(hash, types[i]);
+        hash_combine(hash, offsets[i]);
+    }
+    for (size_t i = 0; i < nSteps; i++)
+    {
+        const op_step& step = steps[i];
+        hash_combine(hash, (uint32_t)step.op.type);
+        hash_combine(hash, step.left_src);
+        hash_combine(hash, step.left_index);
+        hash_combine(hash, step.right_src);
+        hash_combine(hash, step.right_index);
+        hash_combine(hash, step.dest);
+    }
+    return hash;
+}
+
+// The simple entity functions without their prefix, f_ for the value and dual_ for the dual number.
+static const char* simple_function(uint8_t type)
+{
+    switch (type)
+    {
+    case ENT_TYPE_BOX: return "box";
+    case ENT_TYPE_SPHERE: return "sphere";
+    case ENT_TYPE_GYROID: return "gyroid";
+    case ENT_TYPE_SCHWARZ: return "schwarz";
+    case ENT_TYPE_CYLINDER: return "cylinder";
+    case ENT_TYPE_HALFSPACE: return "halfspace";
+    case ENT_TYPE_POLYFACE: return "polyface";
+    default: return nullptr;
+    }
+}
+
+/**
+ * \brief The spelling of the generated code that differs between f_entity_jit and f_entity_jit_dual.
+ */
+struct jit_flavor
+{
+    const char* name;
+    const char* type;
+    const char* simplePrefix;
+    const char* opPrefix;
+    const char* debugArg; // Only the value functions take the debug flag.
+    const char* outside; // Value of a missing entity.
+    const char* zero;
+};
+
+static const jit_flavor VALUE_FLAVOR = { "f_entity_jit", "float", "f_", "apply_", " JIT_DEBUG_ARG", "1.0f", "0.0f" };
+static const jit_flavor DUAL_FLAVOR = { "f_entity_jit_dual", "float4", "dual_", "dual_", "",
+    "(float4)(0.0f, 0.0f, 0.0f, 1.0f)", "(float4)(0.0f)" };
+
+static void write_simple(std::ostream& out, const jit_flavor& flavor, uint32_t offset, uint8_t type)
+{
+    const char* fn = simple_function(type);
+    if (fn)
+        out << flavor.simplePrefix << fn << "(packed + " << offset << ", pt)";
+    else
+        out << flavor.outside;
+}
+
+static void write_function(std::ostream& src, const jit_flavor& flavor, const uint32_t* offsets,
+    const uint8_t* types, size_t nEntities, const op_step* steps, size_t nSteps)
+{
+    bool dual = &flavor == &DUAL_FLAVOR;
+    src << flavor.type << " " << flavor.name << "(global uchar* packed,\n"
+        << "                   global op_step* steps,\n"
+        << "                   float3* pt\n";
+    if (!dual)
+    {
+        src << "#ifdef CLDEBUG\n"
+            << "                   , uchar debugFlag\n"
+            << "#endif\n";
+    }
+    src << "                   )\n{\n";
+
+    if (nSteps == 0)
+    {
+        src << "  return ";
+        if (nEntities > 0)
+            write_simple(src, flavor, offsets[0], types[0]);
+        else
+            src << flavor.outside;
+        src << ";\n}\n\n";
+        return;
+    }
+
+    for (size_t ei = 0; ei < nEntities; ei++)
+    {
+        src << "  " << flavor.type << " v" << ei << " = ";
+        write_simple(src, flavor, offsets[ei], types[ei]);
+        src << ";\n";
+    }
+
+    // Every step gets its own variable, the registers only tell which step produced an operand.
+    std::vector<std::string> regs;
+    auto operand = [&](uint32_t srcType, uint32_t index) -> std::string {
+        if (srcType == SRC_REG)
+            return index < regs.size() && !regs[index].empty() ? regs[index] : flavor.zero;
+        return index < nEntities ? "v" + std::to_string(index) : flavor.outside;
+    };
+    for (size_t si = 0; si < nSteps; si++)
+    {
+        const op_step& step = steps[si];
+        std::string l = operand(step.left_src, step.left_index);
+        std::string data = "steps[" + std::to_string(si) + "].op.data";
+        src << "  " << flavor.type << " s" << si << " = ";
+        switch (step.op.type)
+        {
+        case OP_UNION:
+            src << flavor.opPrefix << "union(" << data << ".blend_radius, " << l << ", "
+                << operand(step.right_src, step.right_index) << (dual ? ")" : ", pt JIT_DEBUG_ARG)");
+            break;
+        case OP_INTERSECTION:
+            src << flavor.opPrefix << "intersection(" << data << ".blend_radius, " << l << ", "
+                << operand(step.right_src, step.right_index) << (dual ? ")" : ", pt JIT_DEBUG_ARG)");
+            break;
+        case OP_SUBTRACTION:
+            src << flavor.opPrefix << "intersection(" << data << ".blend_radius, " << l << ", -"
+                << operand(step.right_src, step.right_index) << (dual ? ")" : ", pt JIT_DEBUG_ARG)");
+            break;
+        case OP_OFFSET:
+            if (dual)
+                src << l << " - (float4)(0.0f, 0.0f, 0.0f, " << data << ".offset_distance)";
+            else
+                src << l << " - " << data << ".offset_distance";
+            break;
+        case OP_LINBLEND:
+            src << flavor.opPrefix << "linblend(" << data << ".lin_blend, " << l << ", "
+                << operand(step.right_src, step.right_index) << ", pt" << flavor.debugArg << ")";
+            break;
+        case OP_SMOOTHBLEND:
+            src << flavor.opPrefix << "smoothblend(" << data << ".smooth_blend, " << l << ", "
+                << operand(step.right_src, step.right_index) << ", pt" << flavor.debugArg << ")";
+            break;
+        case OP_NONE:
+        default:
+            src << l;
+            break;
+        }
+        src << ";\n";
+        if (regs.size() <= step.dest)
+            regs.resize(step.dest + 1);
+        regs[step.dest] = "s" + std::to_string(si);
+    }
+    src << "  return " << operand(SRC_REG, 0) << ";\n}\n\n";
+}
+
+std::string kernel_jit::generate(const uint32_t* offsets, const uint8_t* types, size_t nEntities,
+    const op_step* steps, size_t nSteps)
+{
+    std::ostringstream src;
+    src << "#define JIT_ENTITY\n"
+        << "#include \"kernel_primitives.clh\"\n"
+        << "#ifdef CLDEBUG\n#define JIT_DEBUG_ARG , debugFlag\n#else\n#define JIT_DEBUG_ARG\n#endif\n\n";
+    write_function(src, VALUE_FLAVOR, offsets, types, nEntities, steps, nSteps);
+    write_function(src, DUAL_FLAVOR, offsets, types, nEntities, steps, nSteps);
+    return src.str();
+}
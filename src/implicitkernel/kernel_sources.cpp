@@ -10,10 +10,42 @@
 #endif
 
 static constexpr const char* renderKernelName = "render.cl";
+static constexpr int MAX_INCLUDE_DEPTH = 16;
 
 std::string cl_kernel_sources::render_kernel()
 {
-    return load_source(renderKernelName);
+    return expand_includes(load_source(renderKernelName));
+}
+
+static void append_expanded(const std::string& source, std::ostream& out, int depth)
+{
+    if (depth > MAX_INCLUDE_DEPTH)
+        throw "Kernel includes are nested too deeply";
+    std::istringstream lines(source);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        size_t pos = line.find_first_not_of(" \t");
+        if (pos != std::string::npos && line.compare(pos, 8, "#include") == 0)
+        {
+            size_t begin = line.find('"', pos + 8);
+            size_t end = begin == std::string::npos ? begin : line.find('"', begin + 1);
+            if (end != std::string::npos)
+            {
+                append_expanded(load_source(line.substr(begin + 1, end - begin - 1).c_str()), out, depth + 1);
+                out << '\n';
+                continue;
+            }
+        }
+        out << line << '\n';
+    }
+}
+
+std::string cl_kernel_sources::expand_includes(const std::string& source)
+{
+    std::ostringstream out;
+    append_expanded(source, out, 0);
+    return out.str();
 }
 
 std::string cl_kernel_sources::abs_path()
@@ -62,11 +94,14 @@ return 0;
 
 std::string load_source(const char* filename)
 {
+    std::string source;
+    if (cl_kernel_sources::find_embedded(filename, source))
+        return source;
+    // Not embedded, look next to the executable.
     char absPath[MAX_PATH];
     get_absolute_path(filename, absPath, MAX_PATH);
     std::ifstream f;
     f.open(absPath);
-    std::string source;
     if (f.is_open())
     {
         std::ostringstream ss;
@@ -0,0 +1,668 @@
+#include <implicitkernel/mesher.h>
+#include <implicitkernel/work_pool.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Cells per edge of an octree leaf.
+static constexpr int LEAF_CELLS = 8;
+// Points per edge of an octree leaf.
+static constexpr int LEAF_POINTS = LEAF_CELLS + 1;
+// Cells per edge of a root node, which is also the height of a slab.
+static constexpr int ROOT_CELLS = 32;
+// Offset of the samples used for the normals, relative to the cell size.
+static constexpr float NORMAL_STEP = 0.1f;
+// Weight of the pull towards the mass point when solving for the vertex of a cell.
+static constexpr float QEF_BIAS = 0.05f;
+
+namespace mesher
+{
+    /**
+     * \brief The sampling grid. Point (0, 0, 0) is one cell outside the minimum bounds, and the
+     * points on the outer layer of the grid are treated as outside the entity.
+     */
+    struct grid
+    {
+        glm::vec3 origin;
+        float cellSize;
+        glm::ivec3 numCells;
+
+        glm::vec3 point(int i, int j, int k) const
+        {
+            return glm::vec3(origin.x + float(i) * cellSize, origin.y + float(j) * cellSize,
+                origin.z + float(k) * cellSize);
+        }
+
+        bool on_boundary(int i, int j, int k) const
+        {
+            return i <= 0 || j <= 0 || k <= 0 || i >= numCells.x || j >= numCells.y || k >= numCells.z;
+        }
+    };
+
+    struct leaf
+    {
+        glm::ivec3 origin; // Index of the first cell.
+        std::shared_ptr<const cpu_eval::program> prog; // Specialized for the box of the leaf.
+        float values[LEAF_POINTS * LEAF_POINTS * LEAF_POINTS];
+        uint32_t vertIndices[LEAF_CELLS * LEAF_CELLS * LEAF_CELLS];
+        glm::vec3 vertPositions[LEAF_CELLS * LEAF_CELLS * LEAF_CELLS];
+
+        static size_t point_index(int i, int j, int k)
+        {
+            return size_t(i) + LEAF_POINTS * (size_t(j) + LEAF_POINTS * size_t(k));
+        }
+
+        static size_t cell_index(int i, int j, int k)
+        {
+            return size_t(i) + LEAF_CELLS * (size_t(j) + LEAF_CELLS * size_t(k));
+        }
+    };
+
+    static constexpr uint32_t NO_VERTEX = UINT32_MAX;
+
+    static uint64_t leaf_key(int i, int j, int k)
+    {
+        // Cell indices divided by the leaf size, 21 bits each.
+        return uint64_t(i / LEAF_CELLS) | (uint64_t(j / LEAF_CELLS) << 21) | (uint64_t(k / LEAF_CELLS) << 42);
+    }
+
+    typedef std::unordered_map<uint64_t, leaf*> leaf_map;
+
+    /**
+     * \brief Output file. All functions are thread safe.
+     */
+    class mesh_stream
+    {
+    public:
+        virtual ~mesh_stream() = default;
+        virtual bool open(const std::string& path) = 0;
+        virtual void write_vertices(uint32_t first, const glm::vec3* positions, size_t count) = 0;
+        virtual void write_triangles(const uint32_t* indices, const glm::vec3* positions, size_t count) = 0;
+        virtual bool finish(size_t nVertices, size_t nTriangles) = 0;
+    };
+
+    class stl_stream : public mesh_stream
+    {
+        std::ofstream m_file;
+        std::mutex m_mutex;
+        std::vector<char> m_buffer;
+
+    public:
+        bool open(const std::string& path) override
+        {
+            m_file.open(path, std::ios::binary | std::ios::trunc);
+            if (!m_file)
+                return false;
+            char header[80];
+            std::memset(header, 0, sizeof(header));
+            std::snprintf(header, sizeof(header), "implicitv1");
+            uint32_t count = 0;
+            m_file.write(header, sizeof(header));
+            m_file.write((const char*)&count, sizeof(count));
+            return bool(m_file);
+        }
+
+        void write_vertices(uint32_t, const glm::vec3*, size_t) override
+        {
+            // STL has no shared vertices.
+        }
+
+        void write_triangles(const uint32_t*, const glm::vec3* positions, size_t count) override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_buffer.assign(count * 50, 0);
+            char* dst = m_buffer.data();
+            for (size_t i = 0; i < count; i++)
+            {
+                const glm::vec3* tri = positions + 3 * i;
+                glm::vec3 norm = glm::cross(tri[1] - tri[0], tri[2] - tri[0]);
+                float len = glm::length(norm);
+                if (len > 0.0f)
+                    norm /= len;
+                float data[12] = {norm.x, norm.y, norm.z, tri[0].x, tri[0].y, tri[0].z, tri[1].x, tri[1].y,
+                    tri[1].z, tri[2].x, tri[2].y, tri[2].z};
+                std::memcpy(dst, data, sizeof(data));
+                dst += 50; // Last two bytes are the attribute count, zero.
+            }
+            m_file.write(m_buffer.data(), m_buffer.size());
+        }
+
+        bool finish(size_t, size_t nTriangles) override
+        {
+            uint32_t count = uint32_t(nTriangles);
+            m_file.seekp(80);
+            m_file.write((const char*)&count, sizeof(count));
+            m_file.close();
+            return !m_file.fail();
+        }
+    };
+
+    /**
+     * \brief Binary PLY. The vertices are written in place at their final offset as soon as they
+     * are known. The faces go to a temporary file that is appended after the vertices at the end,
+     * and the element counts in the header are patched in.
+     */
+    class ply_stream : public mesh_stream
+    {
+        static constexpr int COUNT_WIDTH = 10;
+        std::ofstream m_file;
+        std::ofstream m_faces;
+        std::string m_facesPath;
+        std::mutex m_vertMutex;
+        std::mutex m_faceMutex;
+        std::vector<char> m_buffer;
+        std::streamoff m_vertCountPos;
+        std::streamoff m_faceCountPos;
+        std::streamoff m_headerSize;
+
+    public:
+        bool open(const std::string& path) override
+        {
+            m_file.open(path, std::ios::binary | std::ios::trunc);
+            m_facesPath = path + ".faces.tmp";
+            m_faces.open(m_facesPath, std::ios::binary | std::ios::trunc);
+            if (!m_file || !m_faces)
+                return false;
+            std::string blank(COUNT_WIDTH, ' ');
+            m_file << "ply\nformat binary_little_endian 1.0\ncomment implicitv1\nelement vertex ";
+            m_vertCountPos = m_file.tellp();
+            m_file << blank << "\nproperty float x\nproperty float y\nproperty float z\nelement face ";
+            m_faceCountPos = m_file.tellp();
+            m_file << blank << "\nproperty list uchar uint vertex_indices\nend_header\n";
+            m_headerSize = m_file.tellp();
+            return bool(m_file);
+        }
+
+        void write_vertices(uint32_t first, const glm::vec3* positions, size_t count) override
+        {
+            std::lock_guard<std::mutex> lock(m_vertMutex);
+            m_file.seekp(m_headerSize + std::streamoff(first) * std::streamoff(sizeof(glm::vec3)));
+            for (size_t i = 0; i < count; i++)
+            {
+                float data[3] = {positions[i].x, positions[i].y, positions[i].z};
+                m_file.write((const char*)data, sizeof(data));
+            }
+        }
+
+        void write_triangles(const uint32_t* indices, const glm::vec3*, size_t count) override
+        {
+            static constexpr size_t FACE_SIZE = 1 + 3 * sizeof(uint32_t);
+            std::lock_guard<std::mutex> lock(m_faceMutex);
+            m_buffer.resize(count * FACE_SIZE);
+            char* dst = m_buffer.data();
+            for (size_t i = 0; i < count; i++)
+            {
+                *(dst++) = 3;
+                std::memcpy(dst, indices + 3 * i, 3 * sizeof(uint32_t));
+                dst += 3 * sizeof(uint32_t);
+            }
+            m_faces.write(m_buffer.data(), m_buffer.size());
+        }
+
+        bool finish(size_t nVertices, size_t nTriangles) override
+        {
+            m_faces.close();
+            bool success = !m_faces.fail();
+            m_file.seekp(m_headerSize + std::streamoff(nVertices) * std::streamoff(sizeof(glm::vec3)));
+            {
+                std::ifstream faces(m_facesPath, std::ios::binary);
+                if (faces.peek() != std::ifstream::traits_type::eof())
+                    m_file << faces.rdbuf();
+            }
+            std::remove(m_facesPath.c_str());
+            char count[COUNT_WIDTH + 1];
+            std::snprintf(count, sizeof(count), "%-*zu", COUNT_WIDTH, nVertices);
+            m_file.seekp(m_vertCountPos);
+            m_file.write(count, COUNT_WIDTH);
+            std::snprintf(count, sizeof(count), "%-*zu", COUNT_WIDTH, nTriangles);
+            m_file.seekp(m_faceCountPos);
+            m_file.write(count, COUNT_WIDTH);
+            m_file.close();
+            return success && !m_file.fail();
+        }
+    };
+
+    /**
+     * \brief Solves for the point minimizing the squared distances to the tangent planes,
+     * pulled slightly towards the mass point so that the system is never singular.
+     */
+    static glm::vec3 solve_qef(const glm::vec3* points, const glm::vec3* normals, size_t count)
+    {
+        glm::vec3 mass(0.0f);
+        for (size_t i = 0; i < count; i++)
+            mass += points[i];
+        mass /= float(count);
+        // Symmetric matrix A = sum(n n^T) + bias * I, and b = sum(n (n . (p - mass))).
+        float a00 = QEF_BIAS, a01 = 0.0f, a02 = 0.0f, a11 = QEF_BIAS, a12 = 0.0f, a22 = QEF_BIAS;
+        glm::vec3 b(0.0f);
+        for (size_t i = 0; i < count; i++)
+        {
+            const glm::vec3& n = normals[i];
+            a00 += n.x * n.x;
+            a01 += n.x * n.y;
+            a02 += n.x * n.z;
+            a11 += n.y * n.y;
+            a12 += n.y * n.z;
+            a22 += n.z * n.z;
+            b += n * glm::dot(n, points[i] - mass);
+        }
+        float c00 = a11 * a22 - a12 * a12;
+        float c01 = a02 * a12 - a01 * a22;
+        float c02 = a01 * a12 - a02 * a11;
+        float det = a00 * c00 + a01 * c01 + a02 * c02;
+        if (std::abs(det) < 1e-12f)
+            return mass;
+        float c11 = a00 * a22 - a02 * a02;
+        float c12 = a01 * a02 - a00 * a12;
+        float c22 = a00 * a11 - a01 * a01;
+        return mass + glm::vec3(c00 * b.x + c01 * b.y + c02 * b.z, c01 * b.x + c11 * b.y + c12 * b.z,
+                          c02 * b.x + c12 * b.y + c22 * b.z) /
+                          det;
+    }
+
+    class octree_mesher
+    {
+        const cpu_eval::program& m_program;
+        const grid& m_grid;
+        mesh_stream& m_stream;
+        util::work_pool m_pool;
+        std::mutex m_leafMutex;
+        std::vector<std::unique_ptr<leaf>> m_leaves;
+        std::vector<std::unique_ptr<leaf>> m_prevLeaves;
+        leaf_map m_map;
+        leaf_map m_prevMap;
+        std::atomic<size_t> m_numVertices;
+        std::atomic<size_t> m_numTriangles;
+        size_t m_numLeaves;
+
+        struct node
+        {
+            glm::ivec3 origin;
+            int size;
+            std::shared_ptr<const cpu_eval::program> prog;
+        };
+
+        bool touches_boundary(const node& n) const
+        {
+            return m_grid.on_boundary(n.origin.x, n.origin.y, n.origin.z) ||
+                   m_grid.on_boundary(n.origin.x + n.size, n.origin.y + n.size, n.origin.z + n.size);
+        }
+
+        /**
+         * \brief Bounds the field inside the node with interval arithmetic. If the node can contain
+         * the surface, it gets the program specialized for its box and true is returned.
+         */
+        bool specialize(node& nd, const cpu_eval::program& parent) const
+        {
+            // Padded so that the samples for the normals are covered too.
+            glm::vec3 pad(NORMAL_STEP * m_grid.cellSize);
+            glm::vec3 lo = m_grid.point(nd.origin.x, nd.origin.y, nd.origin.z) - pad;
+            glm::vec3 hi = m_grid.point(nd.origin.x + nd.size, nd.origin.y + nd.size, nd.origin.z + nd.size) + pad;
+            cpu_eval::interval bounds;
+            cpu_eval::program prog = parent.specialize(lo, hi, &bounds);
+            if (bounds.lo > 0.0f)
+                return false;
+            // Inside nodes on the boundary of the grid still produce the closing faces.
+            if (bounds.hi < 0.0f && !touches_boundary(nd))
+                return false;
+            nd.prog = std::make_shared<const cpu_eval::program>(std::move(prog));
+            return true;
+        }
+
+        void subdivide(const node& nd)
+        {
+            if (nd.size == LEAF_CELLS)
+            {
+                std::unique_ptr<leaf> lf(new leaf());
+                lf->origin = nd.origin;
+                lf->prog = nd.prog;
+                std::lock_guard<std::mutex> lock(m_leafMutex);
+                m_leaves.push_back(std::move(lf));
+                return;
+            }
+            int half = nd.size / 2;
+            for (int c = 0; c < 8; c++)
+            {
+                node child = {glm::ivec3(nd.origin.x + ((c & 1) ? half : 0), nd.origin.y + ((c & 2) ? half : 0),
+                                  nd.origin.z + ((c & 4) ? half : 0)),
+                    half, nullptr};
+                if (child.origin.x >= m_grid.numCells.x || child.origin.y >= m_grid.numCells.y ||
+                    child.origin.z >= m_grid.numCells.z || !specialize(child, *nd.prog))
+                    continue;
+                m_pool.push([this, child]() { subdivide(child); });
+            }
+        }
+
+        /**
+         * \brief Samples the leaf and computes the vertices of its cells.
+         */
+        void process_leaf(leaf& lf)
+        {
+            static constexpr size_t NPTS = LEAF_POINTS * LEAF_POINTS * LEAF_POINTS;
+            std::vector<float> buf(3 * NPTS);
+            float *x = buf.data(), *y = x + NPTS, *z = y + NPTS;
+            for (int k = 0; k < LEAF_POINTS; k++)
+                for (int j = 0; j < LEAF_POINTS; j++)
+                    for (int i = 0; i < LEAF_POINTS; i++)
+                    {
+                        size_t pi = leaf::point_index(i, j, k);
+                        glm::vec3 p = m_grid.point(lf.origin.x + i, lf.origin.y + j, lf.origin.z + k);
+                        x[pi] = p.x;
+                        y[pi] = p.y;
+                        z[pi] = p.z;
+                    }
+            lf.prog->eval(x, y, z, lf.values, NPTS, 1);
+            for (int k = 0; k < LEAF_POINTS; k++)
+                for (int j = 0; j < LEAF_POINTS; j++)
+                    for (int i = 0; i < LEAF_POINTS; i++)
+                    {
+                        float& v = lf.values[leaf::point_index(i, j, k)];
+                        if (m_grid.on_boundary(lf.origin.x + i, lf.origin.y + j, lf.origin.z + k) && v <= 0.0f)
+                            v = 0.5f * m_grid.cellSize;
+                        else if (v == 0.0f)
+                            v = -1e-7f; // Zero counts as inside, consistently for every cell sharing the point.
+                    }
+
+            // Surface crossings on the edges of the leaf, and the normals there.
+            std::vector<int32_t> edgeCrossings(3 * NPTS, -1);
+            std::vector<glm::vec3> crossings;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int k = 0; k < LEAF_POINTS; k++)
+                    for (int j = 0; j < LEAF_POINTS; j++)
+                        for (int i = 0; i < LEAF_POINTS; i++)
+                        {
+                            glm::ivec3 a(i, j, k);
+                            glm::ivec3 b = a;
+                            b[axis]++;
+                            if (b[axis] >= LEAF_POINTS)
+                                continue;
+                            float va = lf.values[leaf::point_index(a.x, a.y, a.z)];
+                            float vb = lf.values[leaf::point_index(b.x, b.y, b.z)];
+                            if ((va < 0.0f) == (vb < 0.0f))
+                                continue;
+                            glm::vec3 p = m_grid.point(lf.origin.x + i, lf.origin.y + j, lf.origin.z + k);
+                            p[axis] += m_grid.cellSize * (va / (va - vb));
+                            edgeCrossings[axis * NPTS + leaf::point_index(i, j, k)] = int32_t(crossings.size());
+                            crossings.push_back(p);
+                        }
+            }
+            size_t nc = crossings.size();
+            std::vector<glm::vec3> normals(nc, glm::vec3(0.0f));
+            if (nc > 0)
+            {
+                float h = NORMAL_STEP * m_grid.cellSize;
+                std::vector<float> samples(6 * nc * 4);
+                float *sx = samples.data(), *sy = sx + 6 * nc, *sz = sy + 6 * nc, *sv = sz + 6 * nc;
+                for (size_t c = 0; c < nc; c++)
+                {
+                    for (int s = 0; s < 6; s++)
+                    {
+                        glm::vec3 p = crossings[c];
+                        p[s / 2] += (s % 2) ? -h : h;
+                        sx[6 * c + s] = p.x;
+                        sy[6 * c + s] = p.y;
+                        sz[6 * c + s] = p.z;
+                    }
+                }
+                lf.prog->eval(sx, sy, sz, sv, 6 * nc, 1);
+                for (size_t c = 0; c < nc; c++)
+                {
+                    const float* v = sv + 6 * c;
+                    glm::vec3 grad(v[0] - v[1], v[2] - v[3], v[4] - v[5]);
+                    float len = glm::length(grad);
+                    if (len > 0.0f)
+                        normals[c] = grad / len;
+                }
+            }
+
+            // One vertex for every cell with a sign change.
+            std::vector<glm::vec3> verts;
+            glm::vec3 cellPts[12], cellNorms[12];
+            for (int k = 0; k < LEAF_CELLS; k++)
+                for (int j = 0; j < LEAF_CELLS; j++)
+                    for (int i = 0; i < LEAF_CELLS; i++)
+                    {
+                        size_t ci = leaf::cell_index(i, j, k);
+                        lf.vertIndices[ci] = NO_VERTEX;
+                        size_t count = 0;
+                        for (int axis = 0; axis < 3; axis++)
+                        {
+                            int u = (axis + 1) % 3, w = (axis + 2) % 3;
+                            for (int e = 0; e < 4; e++)
+                            {
+                                glm::ivec3 p(i, j, k);
+                                p[u] += e & 1;
+                                p[w] += (e >> 1) & 1;
+                                int32_t cr = edgeCrossings[axis * NPTS + leaf::point_index(p.x, p.y, p.z)];
+                                if (cr < 0)
+                                    continue;
+                                cellPts[count] = crossings[cr];
+                                cellNorms[count] = normals[cr];
+                                count++;
+                            }
+                        }
+                        if (count == 0)
+                            continue;
+                        glm::vec3 lo = m_grid.point(lf.origin.x + i, lf.origin.y + j, lf.origin.z + k);
+                        glm::vec3 hi = m_grid.point(lf.origin.x + i + 1, lf.origin.y + j + 1, lf.origin.z + k + 1);
+                        glm::vec3 v = glm::min(glm::max(solve_qef(cellPts, cellNorms, count), lo), hi);
+                        lf.vertIndices[ci] = uint32_t(verts.size());
+                        lf.vertPositions[ci] = v;
+                        verts.push_back(v);
+                    }
+            if (verts.empty())
+                return;
+            uint32_t first = uint32_t(m_numVertices.fetch_add(verts.size()));
+            for (size_t ci = 0; ci < LEAF_CELLS * LEAF_CELLS * LEAF_CELLS; ci++)
+                if (lf.vertIndices[ci] != NO_VERTEX)
+                    lf.vertIndices[ci] += first;
+            m_stream.write_vertices(first, verts.data(), verts.size());
+        }
+
+        bool find_vertex(const glm::ivec3& cell, uint32_t& index, glm::vec3& pos) const
+        {
+            uint64_t key = leaf_key(cell.x, cell.y, cell.z);
+            auto match = m_map.find(key);
+            if (match == m_map.end())
+            {
+                match = m_prevMap.find(key);
+                if (match == m_prevMap.end())
+                    return false;
+            }
+            const leaf& lf = *match->second;
+            size_t ci = leaf::cell_index(cell.x - lf.origin.x, cell.y - lf.origin.y, cell.z - lf.origin.z);
+            index = lf.vertIndices[ci];
+            pos = lf.vertPositions[ci];
+            return index != NO_VERTEX;
+        }
+
+        /**
+         * \brief Emits a quad for every sign changing edge owned by the leaf, i.e. the edges
+         * starting at one of its cells, connecting the vertices of the four cells around it.
+         */
+        void connect_leaf(const leaf& lf)
+        {
+            std::vector<uint32_t> indices;
+            std::vector<glm::vec3> positions;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                int u = (axis + 1) % 3, w = (axis + 2) % 3;
+                for (int k = 0; k < LEAF_CELLS; k++)
+                    for (int j = 0; j < LEAF_CELLS; j++)
+                        for (int i = 0; i < LEAF_CELLS; i++)
+                        {
+                            glm::ivec3 a(i, j, k);
+                            glm::ivec3 b = a;
+                            b[axis]++;
+                            float va = lf.values[leaf::point_index(a.x, a.y, a.z)];
+                            float vb = lf.values[leaf::point_index(b.x, b.y, b.z)];
+                            if ((va < 0.0f) == (vb < 0.0f))
+                                continue;
+                            glm::ivec3 g(lf.origin.x + i, lf.origin.y + j, lf.origin.z + k);
+                            if (g[u] < 1 || g[w] < 1)
+                                continue;
+                            glm::ivec3 cells[4] = {g, g, g, g};
+                            cells[0][u]--;
+                            cells[0][w]--;
+                            cells[1][w]--;
+                            cells[3][u]--;
+                            uint32_t qi[4];
+                            glm::vec3 qp[4];
+                            bool complete = true;
+                            for (int c = 0; c < 4 && complete; c++)
+                                complete = find_vertex(cells[c], qi[c], qp[c]);
+                            if (!complete)
+                                continue;
+                            // Counter clockwise around the axis if the surface faces the positive direction.
+                            static constexpr int FORWARD[6] = {0, 1, 2, 0, 2, 3};
+                            static constexpr int BACKWARD[6] = {0, 2, 1, 0, 3, 2};
+                            const int* order = va < 0.0f ? FORWARD : BACKWARD;
+                            for (int t = 0; t < 6; t++)
+                            {
+                                indices.push_back(qi[order[t]]);
+                                positions.push_back(qp[order[t]]);
+                            }
+                        }
+            }
+            if (indices.empty())
+                return;
+            m_numTriangles += indices.size() / 3;
+            m_stream.write_triangles(indices.data(), positions.data(), indices.size() / 3);
+        }
+
+    public:
+        octree_mesher(const cpu_eval::program& program, const grid& g, mesh_stream& stream) :
+            m_program(program),
+            m_grid(g),
+            m_stream(stream),
+            m_numVertices(0),
+            m_numTriangles(0),
+            m_numLeaves(0)
+        {
+        }
+
+        void run()
+        {
+            for (int sz = 0; sz < m_grid.numCells.z; sz += ROOT_CELLS)
+            {
+                // Collect the leaves of this slab, subdividing the root nodes in parallel.
+                for (int sy = 0; sy < m_grid.numCells.y; sy += ROOT_CELLS)
+                    for (int sx = 0; sx < m_grid.numCells.x; sx += ROOT_CELLS)
+                    {
+                        m_pool.push([this, sx, sy, sz]() {
+                            node root = {glm::ivec3(sx, sy, sz), ROOT_CELLS, nullptr};
+                            if (specialize(root, m_program))
+                                subdivide(root);
+                        });
+                    }
+                m_pool.wait();
+                m_numLeaves += m_leaves.size();
+                for (const std::unique_ptr<leaf>& lf : m_leaves)
+                    m_map.emplace(leaf_key(lf->origin.x, lf->origin.y, lf->origin.z), lf.get());
+
+                for (const std::unique_ptr<leaf>& lf : m_leaves)
+                {
+                    leaf* ptr = lf.get();
+                    m_pool.push([this, ptr]() { process_leaf(*ptr); });
+                }
+                m_pool.wait();
+                for (const std::unique_ptr<leaf>& lf : m_leaves)
+                {
+                    const leaf* ptr = lf.get();
+                    m_pool.push([this, ptr]() { connect_leaf(*ptr); });
+                }
+                m_pool.wait();
+
+                // Only the last layer of cells of this slab is needed by the next one.
+                m_prevLeaves = std::move(m_leaves);
+                m_prevMap = std::move(m_map);
+                m_leaves.clear();
+                m_map.clear();
+            }
+        }
+
+        void get_stats(mesh_stats& stats) const
+        {
+            stats.numVertices = m_numVertices;
+            stats.numTriangles = m_numTriangles;
+            stats.numLeaves = m_numLeaves;
+        }
+    };
+}
+
+static std::string lower_extension(const std::string& path)
+{
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return "";
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return char(std::tolower(c)); });
+    return ext;
+}
+
+bool mesher::export_mesh(const entities::ent_ref& entity, const glm::vec3& minBounds, const glm::vec3& maxBounds,
+    float cellSize, const std::string& path, mesh_stats* stats)
+{
+    if (!(cellSize > 0.0f))
+    {
+        std::cerr << "The cell size must be positive.\n";
+        return false;
+    }
+    glm::vec3 size = maxBounds - minBounds;
+    if (!(size.x > 0.0f && size.y > 0.0f && size.z > 0.0f))
+    {
+        std::cerr << "The bounds of the mesh are empty.\n";
+        return false;
+    }
+    grid g;
+    g.cellSize = cellSize;
+    g.origin = minBounds - glm::vec3(cellSize);
+    // One cell of padding on either side.
+    g.numCells = glm::ivec3(int(std::ceil(size.x / cellSize)) + 2, int(std::ceil(size.y / cellSize)) + 2,
+        int(std::ceil(size.z / cellSize)) + 2);
+    static constexpr int MAX_CELLS = (1 << 21) - ROOT_CELLS;
+    if (g.numCells.x > MAX_CELLS || g.numCells.y > MAX_CELLS || g.numCells.z > MAX_CELLS)
+    {
+        std::cerr << "The cell size is too small for the bounds of the mesh.\n";
+        return false;
+    }
+
+    std::unique_ptr<mesh_stream> stream;
+    std::string ext = lower_extension(path);
+    if (ext == "stl")
+        stream.reset(new stl_stream());
+    else if (ext == "ply")
+        stream.reset(new ply_stream());
+    else
+    {
+        std::cerr << "Unsupported mesh format: " << path << ". Use .stl or .ply.\n";
+        return false;
+    }
+    if (!stream->open(path))
+    {
+        std::cerr << "Cannot open " << path << " for writing.\n";
+        return false;
+    }
+
+    cpu_eval::program program(entity);
+    octree_mesher m(program, g, *stream);
+    m.run();
+    mesh_stats result;
+    m.get_stats(result);
+    if (stats)
+        *stats = result;
+    if (!stream->finish(result.numVertices, result.numTriangles))
+    {
+        std::cerr << "Failed to write " << path << ".\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,182 @@
+#include <implicitkernel/program_cache.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Bump this to invalidate all cached binaries, e.g. if the file layout changes.
+static constexpr uint32_t CACHE_VERSION = 1;
+static constexpr char CACHE_MAGIC[8] = { 'I', 'M', 'P', 'C', 'L', 'B', 'I', 'N' };
+
+static uint64_t fnv1a(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+{
+    for (char c : str)
+    {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string program_cache::directory()
+{
+    const char* custom = std::getenv("IMPLICIT_CL_CACHE");
+    if (custom)
+        return custom;
+#ifdef _WIN32
+    const char* base = std::getenv("LOCALAPPDATA");
+    if (base)
+        return (fs::path(base) / "implicitv1" / "clcache").string();
+#else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return (fs::path(xdg) / "implicitv1" / "clcache").string();
+    const char* home = std::getenv("HOME");
+    if (home)
+        return (fs::path(home) / ".cache" / "implicitv1" / "clcache").string();
+#endif
+    return "";
+}
+
+std::string program_cache::temp_path(const std::string& path)
+{
+    // The pid separates processes and the random number separates threads. Unseeded rand() repeats in every process.
+#ifdef _WIN32
+    long pid = _getpid();
+#else
+    long pid = getpid();
+#endif
+    std::ostringstream name;
+    name << path << '.' << pid << '.' << std::hex << std::random_device()() << ".tmp";
+    return name.str();
+}
+
+/**
+ * \brief Everything the compiled binary depends on. This is stored in the file as well,
+ * so that a hash collision is detected instead of loading the wrong binary.
+ */
+static std::string cache_key(const cl::Device& device, const std::string& source, const std::string& options)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << CACHE_VERSION << '\n'
+        << platform.getInfo<CL_PLATFORM_NAME>() << '\n'
+        << platform.getInfo<CL_PLATFORM_VERSION>() << '\n'
+        << device.getInfo<CL_DEVICE_NAME>() << '\n'
+        << device.getInfo<CL_DEVICE_VERSION>() << '\n'
+        << device.getInfo<CL_DRIVER_VERSION>() << '\n'
+        << options << '\n'
+        << std::hex << fnv1a(source) << '\n';
+    return key.str();
+}
+
+static fs::path cache_file(const std::string& dir, const std::string& key)
+{
+    std::ostringstream name;
+    name << std::hex << fnv1a(key) << ".bin";
+    return fs::path(dir) / name.str();
+}
+
+static bool read_binary(const fs::path& path, const std::string& key, std::vector<unsigned char>& binary)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        return false;
+    char magic[sizeof(CACHE_MAGIC)];
+    uint64_t keySize = 0, binSize = 0;
+    f.read(magic, sizeof(magic));
+    f.read((char*)&keySize, sizeof(keySize));
+    if (!f || std::string(magic, sizeof(magic)) != std::string(CACHE_MAGIC, sizeof(CACHE_MAGIC)) || keySize != key.size())
+        return false;
+    std::string storedKey(keySize, '\0');
+    f.read(&storedKey[0], keySize);
+    f.read((char*)&binSize, sizeof(binSize));
+    if (!f || storedKey != key || binSize == 0)
+        return false;
+    binary.resize(binSize);
+    f.read((char*)binary.data(), binSize);
+    return bool(f);
+}
+
+static void write_binary(const fs::path& path, const std::string& key, const std::vector<unsigned char>& binary)
+{
+    std::error_code err;
+    fs::create_directories(path.parent_path(), err);
+    // Written under a temporary name and renamed, so concurrent launches never see a partial file.
+    fs::path temp = program_cache::temp_path(path.string());
+    {
+        std::ofstream f(temp, std::ios::binary | std::ios::trunc);
+        if (!f)
+            return;
+        uint64_t keySize = key.size(), binSize = binary.size();
+        f.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        f.write((const char*)&keySize, sizeof(keySize));
+        f.write(key.data(), keySize);
+        f.write((const char*)&binSize, sizeof(binSize));
+        f.write((const char*)binary.data(), binSize);
+        if (!f)
+        {
+            f.close();
+            fs::remove(temp, err);
+            return;
+        }
+    }
+    fs::rename(temp, path, err);
+    if (err)
+        fs::remove(temp, err);
+}
+
+static bool get_binary(const cl::Program& program, std::vector<unsigned char>& binary)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr) != CL_SUCCESS || size == 0)
+        return false;
+    binary.resize(size);
+    unsigned char* ptr = binary.data();
+    return clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, nullptr) == CL_SUCCESS;
+}
+
+void program_cache::build(const cl::Context& context, const cl::Device& device, const std::string& source,
+    const std::string& options, cl::Program& program)
+{
+    std::string dir = directory();
+    if (dir.empty())
+    {
+        program = cl::Program(context, source, false);
+        program.build(options.c_str());
+        return;
+    }
+
+    std::string key = cache_key(device, source, options);
+    fs::path path = cache_file(dir, key);
+    std::vector<unsigned char> binary;
+    if (read_binary(path, key, binary))
+    {
+        try
+        {
+            cl::Program::Binaries binaries = { { binary.data(), binary.size() } };
+            program = cl::Program(context, { device }, binaries);
+            program.build({ device }, options.c_str());
+            return;
+        }
+        catch (cl::Error)
+        {
+            // Stale or rejected by the driver, rebuild it below.
+        }
+    }
+
+    program = cl::Program(context, source, false);
+    program.build({ device }, options.c_str());
+    if (get_binary(program, binary))
+        write_binary(path, key, binary);
+}
@@ -0,0 +1,501 @@
+#include <implicitkernel/slicer.h>
+#include <implicitkernel/work_pool.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+static constexpr uint32_t NO_SEGMENT = UINT32_MAX;
+
+namespace slicer
+{
+    /**
+     * \brief The samples of one layer. Pixel (i, j) is sampled at its center, and the grid has a
+     * ring of outside values around the pixels, so that every contour closes.
+     */
+    struct layer_grid
+    {
+        glm::vec2 origin; // The minimum corner of pixel (0, 0).
+        float pixelSize;
+        float z;
+        uint32_t width;
+        uint32_t height;
+        std::vector<float> values;
+
+        size_t index(int64_t i, int64_t j) const
+        {
+            return size_t(i + 1) + size_t(width + 2) * size_t(j + 1);
+        }
+
+        glm::vec2 point(int64_t i, int64_t j) const
+        {
+            return origin + glm::vec2(float(i) + 0.5f, float(j) + 0.5f) * pixelSize;
+        }
+
+        glm::vec3 point3(int64_t i, int64_t j) const
+        {
+            glm::vec2 p = point(i, j);
+            return glm::vec3(p.x, p.y, z);
+        }
+    };
+
+    /**
+     * \brief A piece of a contour through one pixel cell of the grid, from the crossing on one edge
+     * of the cell to the crossing on another, with the solid on its left. Edges are identified by the
+     * index of their first point in the grid, times two, plus one for the edges along y.
+     */
+    struct segment
+    {
+        uint64_t from;
+        uint64_t to;
+    };
+
+    typedef std::vector<glm::vec2> contour;
+
+    /**
+     * \brief The edges of a cell, counter clockwise from the one along x at its first corner.
+     */
+    enum cell_edge { EDGE_BOTTOM, EDGE_RIGHT, EDGE_TOP, EDGE_LEFT };
+
+    /**
+     * \brief The segments of every configuration of the corners inside the solid, with bit 0 for
+     * the first corner and the others counter clockwise. The saddles 5 and 10 are listed with their
+     * center outside, and the next two entries of the table are used when it is inside.
+     */
+    static const int8_t SEGMENT_TABLE[18][4] = {
+        { -1, -1, -1, -1 },
+        { EDGE_BOTTOM, EDGE_LEFT, -1, -1 },
+        { EDGE_RIGHT, EDGE_BOTTOM, -1, -1 },
+        { EDGE_RIGHT, EDGE_LEFT, -1, -1 },
+        { EDGE_TOP, EDGE_RIGHT, -1, -1 },
+        { EDGE_BOTTOM, EDGE_LEFT, EDGE_TOP, EDGE_RIGHT },
+        { EDGE_TOP, EDGE_BOTTOM, -1, -1 },
+        { EDGE_TOP, EDGE_LEFT, -1, -1 },
+        { EDGE_LEFT, EDGE_TOP, -1, -1 },
+        { EDGE_BOTTOM, EDGE_TOP, -1, -1 },
+        { EDGE_RIGHT, EDGE_BOTTOM, EDGE_LEFT, EDGE_TOP },
+        { EDGE_RIGHT, EDGE_TOP, -1, -1 },
+        { EDGE_LEFT, EDGE_RIGHT, -1, -1 },
+        { EDGE_BOTTOM, EDGE_RIGHT, -1, -1 },
+        { EDGE_LEFT, EDGE_BOTTOM, -1, -1 },
+        { -1, -1, -1, -1 },
+        { EDGE_BOTTOM, EDGE_RIGHT, EDGE_TOP, EDGE_LEFT }, // 5 with the center inside.
+        { EDGE_LEFT, EDGE_BOTTOM, EDGE_RIGHT, EDGE_TOP }, // 10 with the center inside.
+    };
+
+    class layer_slicer
+    {
+        const cpu_eval::program& m_program;
+        glm::vec2 m_origin;
+        float m_pixelSize;
+        uint32_t m_width;
+        uint32_t m_height;
+        mutable std::atomic<size_t> m_numTiles;
+        mutable std::atomic<size_t> m_numSampledTiles;
+
+        struct tile
+        {
+            uint32_t first[2]; // The first pixel.
+            uint32_t end[2]; // One past the last pixel.
+            cpu_eval::program prog;
+        };
+
+        /**
+         * \brief Samples the layer tile by tile. Tiles whose bounds don't contain zero are filled with
+         * the bound nearest to zero first, then the other tiles are sampled with their specialized
+         * programs, which overwrite the shared pixels on the borders with exact values. So an edge
+         * can only have a sign change if both its ends are sampled.
+         */
+        void sample(layer_grid& grid) const
+        {
+            grid.values.assign(size_t(m_width + 2) * size_t(m_height + 2), m_pixelSize);
+            glm::vec3 lo = grid.point3(0, 0);
+            glm::vec3 hi = grid.point3(m_width - 1, m_height - 1);
+            cpu_eval::interval bounds;
+            cpu_eval::program layerProg = m_program.specialize(lo, hi, &bounds);
+            if (bounds.lo > 0.0f)
+                return; // Nothing is solid in this layer.
+            std::vector<tile> sampled;
+            for (uint32_t ty = 0; ty < m_height; ty += TILE_PIXELS)
+            {
+                for (uint32_t tx = 0; tx < m_width; tx += TILE_PIXELS)
+                {
+                    // The tiles share the pixels on their borders, so the cells between tiles are covered.
+                    uint32_t end[2] = { std::min(m_width, tx + TILE_PIXELS + 1), std::min(m_height, ty + TILE_PIXELS + 1) };
+                    glm::vec3 tileLo = grid.point3(tx, ty);
+                    glm::vec3 tileHi = grid.point3(end[0] - 1, end[1] - 1);
+                    cpu_eval::interval tileBounds;
+                    cpu_eval::program prog = layerProg.specialize(tileLo, tileHi, &tileBounds);
+                    m_numTiles++;
+                    if (tileBounds.lo > 0.0f || tileBounds.hi < 0.0f)
+                    {
+                        float fill = tileBounds.lo > 0.0f ? tileBounds.lo : tileBounds.hi;
+                        for (uint32_t j = ty; j < end[1]; j++)
+                            std::fill_n(grid.values.begin() + grid.index(tx, j), end[0] - tx, fill);
+                        continue;
+                    }
+                    sampled.push_back({ { tx, ty }, { end[0], end[1] }, std::move(prog) });
+                }
+            }
+            m_numSampledTiles += sampled.size();
+            std::vector<float> x, y, z, v;
+            for (const tile& tl : sampled)
+            {
+                size_t n = size_t(tl.end[0] - tl.first[0]) * size_t(tl.end[1] - tl.first[1]);
+                x.resize(n);
+                y.resize(n);
+                z.assign(n, grid.z);
+                v.resize(n);
+                size_t si = 0;
+                for (uint32_t j = tl.first[1]; j < tl.end[1]; j++)
+                {
+                    for (uint32_t i = tl.first[0]; i < tl.end[0]; i++, si++)
+                    {
+                        glm::vec2 p = grid.point(i, j);
+                        x[si] = p.x;
+                        y[si] = p.y;
+                    }
+                }
+                tl.prog.eval(x.data(), y.data(), z.data(), v.data(), n, 1);
+                si = 0;
+                for (uint32_t j = tl.first[1]; j < tl.end[1]; j++)
+                {
+                    std::copy_n(v.begin() + si, tl.end[0] - tl.first[0], grid.values.begin() + grid.index(tl.first[0], j));
+                    si += tl.end[0] - tl.first[0];
+                }
+            }
+        }
+
+        static uint64_t edge_key(const layer_grid& grid, int64_t i, int64_t j, int edge)
+        {
+            switch (edge)
+            {
+            case EDGE_BOTTOM:
+                return uint64_t(grid.index(i, j)) * 2;
+            case EDGE_RIGHT:
+                return uint64_t(grid.index(i + 1, j)) * 2 + 1;
+            case EDGE_TOP:
+                return uint64_t(grid.index(i, j + 1)) * 2;
+            default:
+                return uint64_t(grid.index(i, j)) * 2 + 1;
+            }
+        }
+
+        /**
+         * \brief Where the field crosses zero on the edge, interpolated linearly.
+         */
+        static glm::vec2 crossing(const layer_grid& grid, uint64_t key)
+        {
+            size_t first = size_t(key / 2);
+            size_t stride = key % 2 ? size_t(grid.width + 2) : 1;
+            int64_t i = int64_t(first % (grid.width + 2)) - 1;
+            int64_t j = int64_t(first / (grid.width + 2)) - 1;
+            float va = grid.values[first];
+            float vb = grid.values[first + stride];
+            glm::vec2 p = grid.point(i, j);
+            p[key % 2] += grid.pixelSize * (va / (va - vb));
+            return p;
+        }
+
+        /**
+         * \brief Marching squares over the cells between the samples, including those reaching
+         * into the ring around the pixels. Zero counts as inside.
+         */
+        static std::vector<segment> march(const layer_grid& grid)
+        {
+            std::vector<segment> segments;
+            for (int64_t j = -1; j < int64_t(grid.height); j++)
+            {
+                for (int64_t i = -1; i < int64_t(grid.width); i++)
+                {
+                    float corners[4] = { grid.values[grid.index(i, j)], grid.values[grid.index(i + 1, j)],
+                        grid.values[grid.index(i + 1, j + 1)], grid.values[grid.index(i, j + 1)] };
+                    int config = 0;
+                    for (int c = 0; c < 4; c++)
+                        config |= corners[c] <= 0.0f ? 1 << c : 0;
+                    if (config == 0 || config == 15)
+                        continue;
+                    if ((config == 5 || config == 10) &&
+                        corners[0] + corners[1] + corners[2] + corners[3] <= 0.0f)
+                        config = config == 5 ? 16 : 17;
+                    const int8_t* edges = SEGMENT_TABLE[config];
+                    for (int s = 0; s < 4 && edges[s] >= 0; s += 2)
+                        segments.push_back({ edge_key(grid, i, j, edges[s]), edge_key(grid, i, j, edges[s + 1]) });
+                }
+            }
+            return segments;
+        }
+
+        /**
+         * \brief Joins the segments into closed contours. Every crossing starts one segment and
+         * ends another, so following the segments from any of them leads back to it.
+         */
+        static std::vector<contour> link(const layer_grid& grid, const std::vector<segment>& segments)
+        {
+            std::unordered_map<uint64_t, uint32_t> starting;
+            starting.reserve(segments.size());
+            for (uint32_t s = 0; s < segments.size(); s++)
+                starting.emplace(segments[s].from, s);
+            std::vector<bool> used(segments.size(), false);
+            std::vector<contour> contours;
+            for (uint32_t first = 0; first < segments.size(); first++)
+            {
+                if (used[first])
+                    continue;
+                contour points;
+                uint32_t s = first;
+                while (s != NO_SEGMENT && !used[s])
+                {
+                    used[s] = true;
+                    points.push_back(crossing(grid, segments[s].from));
+                    auto next = starting.find(segments[s].to);
+                    s = next == starting.end() ? NO_SEGMENT : next->second;
+                }
+                if (points.size() >= 3)
+                    contours.push_back(std::move(points));
+            }
+            return contours;
+        }
+
+        static bool write_svg(const std::string& path, const layer_grid& grid, const std::vector<contour>& contours)
+        {
+            std::ofstream file(path, std::ios::trunc);
+            if (!file)
+                return false;
+            float width = grid.width * grid.pixelSize;
+            float height = grid.height * grid.pixelSize;
+            // SVG has y down, so the layer is flipped to look the same as from above.
+            file << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height
+                << "\" viewBox=\"0 0 " << width << " " << height << "\">\n"
+                << "<!-- z=" << grid.z << " -->\n"
+                << "<path fill=\"black\" fill-rule=\"evenodd\" d=\"";
+            for (const contour& points : contours)
+            {
+                for (size_t p = 0; p < points.size(); p++)
+                {
+                    file << (p ? " L" : "M") << points[p].x - grid.origin.x << "," << height - (points[p].y - grid.origin.y);
+                }
+                file << " Z ";
+            }
+            file << "\"/>\n</svg>\n";
+            return !file.fail();
+        }
+
+        static bool write_polygons(const std::string& path, const layer_grid& grid, const std::vector<contour>& contours)
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            if (!file)
+                return false;
+            polygon_header header;
+            std::memcpy(header.magic, POLYGON_MAGIC, sizeof(POLYGON_MAGIC));
+            header.version = FORMAT_VERSION;
+            header.numContours = uint32_t(contours.size());
+            header.numPoints = 0;
+            header.z = grid.z;
+            std::vector<uint32_t> counts;
+            for (const contour& points : contours)
+            {
+                counts.push_back(uint32_t(points.size()));
+                header.numPoints += uint32_t(points.size());
+            }
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)counts.data(), counts.size() * sizeof(uint32_t));
+            for (const contour& points : contours)
+                file.write((const char*)points.data(), points.size() * sizeof(glm::vec2));
+            return !file.fail();
+        }
+
+        static bool write_bitmap(const std::string& path, const layer_grid& grid)
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            if (!file)
+                return false;
+            std::vector<uint32_t> rows(grid.height + 1, 0);
+            std::vector<uint32_t> runs; // First pixel and length.
+            for (uint32_t j = 0; j < grid.height; j++)
+            {
+                const float* row = grid.values.data() + grid.index(0, j);
+                for (uint32_t i = 0; i < grid.width;)
+                {
+                    if (row[i] > 0.0f)
+                    {
+                        i++;
+                        continue;
+                    }
+                    uint32_t start = i;
+                    while (i < grid.width && row[i] <= 0.0f)
+                        i++;
+                    runs.push_back(start);
+                    runs.push_back(i - start);
+                }
+                rows[j + 1] = uint32_t(runs.size() / 2);
+            }
+            bitmap_header header;
+            std::memcpy(header.magic, BITMAP_MAGIC, sizeof(BITMAP_MAGIC));
+            header.version = FORMAT_VERSION;
+            header.width = grid.width;
+            header.height = grid.height;
+            header.pixelSize = grid.pixelSize;
+            header.origin[0] = grid.origin.x;
+            header.origin[1] = grid.origin.y;
+            header.z = grid.z;
+            header.numRuns = rows.back();
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)rows.data(), rows.size() * sizeof(uint32_t));
+            file.write((const char*)runs.data(), runs.size() * sizeof(uint32_t));
+            return !file.fail();
+        }
+
+    public:
+        layer_slicer(const cpu_eval::program& program, const glm::vec2& origin, float pixelSize, uint32_t width,
+            uint32_t height) :
+            m_program(program),
+            m_origin(origin),
+            m_pixelSize(pixelSize),
+            m_width(width),
+            m_height(height),
+            m_numTiles(0),
+            m_numSampledTiles(0)
+        {
+        }
+
+        /**
+         * \brief Samples the layer at the given height and writes it to the file.
+         * \return The number of contours, or -1 if the file could not be written.
+         */
+        int64_t slice_layer(float z, layer_format format, const std::string& path) const
+        {
+            layer_grid grid;
+            grid.origin = m_origin;
+            grid.pixelSize = m_pixelSize;
+            grid.z = z;
+            grid.width = m_width;
+            grid.height = m_height;
+            sample(grid);
+            if (format == layer_format::rle)
+                return write_bitmap(path, grid) ? 0 : -1;
+            std::vector<contour> contours = link(grid, march(grid));
+            bool written = format == layer_format::svg ? write_svg(path, grid, contours) : write_polygons(path, grid, contours);
+            return written ? int64_t(contours.size()) : -1;
+        }
+
+        size_t num_tiles() const
+        {
+            return m_numTiles;
+        }
+
+        size_t num_sampled_tiles() const
+        {
+            return m_numSampledTiles;
+        }
+    };
+}
+
+bool slicer::parse_format(const std::string& name, layer_format& format)
+{
+    if (name == "svg")
+        format = layer_format::svg;
+    else if (name == "polygons")
+        format = layer_format::polygons;
+    else if (name == "rle")
+        format = layer_format::rle;
+    else
+        return false;
+    return true;
+}
+
+static const char* extension(slicer::layer_format format)
+{
+    switch (format)
+    {
+    case slicer::layer_format::svg:
+        return ".svg";
+    case slicer::layer_format::polygons:
+        return ".slc";
+    default:
+        return ".rle";
+    }
+}
+
+bool slicer::slice(const entities::ent_ref& entity, const glm::vec3& minBounds, const glm::vec3& maxBounds,
+    float layerHeight, float pixelSize, layer_format format, const std::string& directory, slice_stats* stats)
+{
+    if (!(layerHeight > 0.0f) || !(pixelSize > 0.0f))
+    {
+        std::cerr << "The layer height and the pixel size must be positive.\n";
+        return false;
+    }
+    glm::vec3 size = maxBounds - minBounds;
+    if (!(size.x > 0.0f && size.y > 0.0f && size.z > 0.0f))
+    {
+        std::cerr << "The bounds of the layers are empty.\n";
+        return false;
+    }
+    // A layer is sampled into one float per pixel, with a border of one pixel. Every worker samples
+    // its own layer, so this bounds the grids of all the workers together to 256 MB.
+    static constexpr double MAX_PIXELS = double(1 << 26);
+    double width = std::ceil(double(size.x) / pixelSize), height = std::ceil(double(size.y) / pixelSize);
+    double layerPixels = (width + 2.0) * (height + 2.0);
+    if (layerPixels > MAX_PIXELS)
+    {
+        std::cerr << "The pixel size is too small for the bounds of the layers.\n";
+        return false;
+    }
+    size_t numLayers = std::max<size_t>(1, size_t(std::floor(double(size.z) / layerHeight)));
+    std::error_code err;
+    fs::create_directories(directory, err);
+    if (err)
+    {
+        std::cerr << "Cannot create the directory " << directory << ".\n";
+        return false;
+    }
+
+    cpu_eval::program program(entity);
+    layer_slicer slicer(program, glm::vec2(minBounds.x, minBounds.y), pixelSize, uint32_t(width), uint32_t(height));
+    std::atomic<size_t> numContours(0);
+    std::atomic<bool> failed(false);
+    {
+        // One layer per task, so a worker samples all the tiles of its layer in turn. Large layers
+        // get fewer workers, so fewer of them are in flight at once.
+        size_t numWorkers = std::max<size_t>(1, std::thread::hardware_concurrency());
+        numWorkers = std::min(numWorkers, std::max<size_t>(1, size_t(MAX_PIXELS / layerPixels)));
+        util::work_pool pool(numWorkers);
+        for (size_t layer = 0; layer < numLayers; layer++)
+        {
+            pool.push([&, layer]() {
+                if (failed)
+                    return;
+                char name[32];
+                std::snprintf(name, sizeof(name), "layer_%05zu%s", layer, extension(format));
+                std::string path = (fs::path(directory) / name).string();
+                float z = minBounds.z + (float(layer) + 0.5f) * layerHeight;
+                int64_t count = slicer.slice_layer(z, format, path);
+                if (count < 0)
+                {
+                    std::cerr << "Failed to write " << path << ".\n";
+                    failed = true;
+                    return;
+                }
+                numContours += size_t(count);
+            });
+        }
+        pool.wait();
+    }
+    if (stats)
+    {
+        stats->numLayers = numLayers;
+        stats->numContours = numContours;
+        stats->numTiles = slicer.num_tiles();
+        stats->numSampledTiles = slicer.num_sampled_tiles();
+    }
+    return !failed;
+}
@@ -0,0 +1,285 @@
+#include <implicitkernel/program_cache.h>
+#include <implicitkernel/split_frame.h>
+#include <implicitkernel/work_group_tuner.h>
+#include <algorithm>
+#include <cmath>
+
+static constexpr uint32_t CONE_TILE = 8; // Must match CONE_TILE in render.cl.
+static constexpr size_t MAX_GROUP_SIZE = 64; // Helpers are not tuned, this is a safe size on most devices.
+
+std::vector<cl::Device> split_frame::all_devices()
+{
+    std::vector<cl::Device> result;
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    for (const cl::Platform& platform : platforms)
+    {
+        std::vector<cl::Device> devices;
+        try
+        {
+            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        }
+        catch (cl::Error)
+        {
+            continue; // The platform has no devices.
+        }
+        result.insert(result.end(), devices.begin(), devices.end());
+    }
+    return result;
+}
+
+std::string split_frame::describe(const cl::Device& device)
+{
+    return cl::Platform(device.getInfo<CL_DEVICE_PLATFORM>()).getInfo<CL_PLATFORM_NAME>() + ": " +
+        device.getInfo<CL_DEVICE_NAME>();
+}
+
+void split_frame::trace_grid(uint32_t width, uint32_t rows, uint8_t lod, bool refine, size_t& nx, size_t& ny)
+{
+    size_t step = (size_t)1 << lod;
+    if (refine)
+    {
+        // Three new pixels in every cell of the coarser level.
+        nx = 3 * ((width + 2 * step - 1) / (2 * step));
+        ny = (rows + 2 * step - 1) / (2 * step);
+    }
+    else
+    {
+        nx = (width + step - 1) / step;
+        ny = (rows + step - 1) / step;
+    }
+}
+
+std::vector<uint32_t> split_frame::balance(const std::vector<double>& shares, uint32_t height, uint32_t granularity)
+{
+    size_t n = shares.size();
+    std::vector<uint32_t> bands(n + 1, 0);
+    bands[n] = height;
+    double total = 0.0;
+    size_t nActive = 0;
+    for (double share : shares)
+    {
+        if (share > 0.0)
+        {
+            total += share;
+            nActive++;
+        }
+    }
+    // The last band with a share also takes the rows after the last whole granule.
+    size_t last = n - 1;
+    while (last > 0 && !(shares[last] > 0.0))
+        last--;
+    uint32_t nGranules = height / granularity;
+    bool minimum = nGranules >= nActive;
+    double sum = 0.0;
+    size_t activeAfter = nActive;
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        if (i >= last)
+        {
+            bands[i + 1] = height;
+            continue;
+        }
+        bool active = shares[i] > 0.0;
+        if (active)
+        {
+            sum += shares[i];
+            activeAfter--;
+        }
+        uint32_t end = total > 0.0 ? (uint32_t)std::lround(sum / total * height / granularity) : 0;
+        uint32_t lo = bands[i] / granularity + (active && minimum ? 1 : 0);
+        uint32_t hi = minimum ? nGranules - (uint32_t)activeAfter : nGranules;
+        end = std::max(lo, std::min(end, hi));
+        bands[i + 1] = end * granularity;
+    }
+    return bands;
+}
+
+split_frame::helper::helper(const cl::Device& device, const std::string& source, const std::string& options)
+    : m_device(device)
+{
+    m_context = cl::Context(device);
+    m_queue = cl::CommandQueue(m_context, device, CL_QUEUE_PROFILING_ENABLE);
+    program_cache::build(m_context, device, source, options, m_program);
+    m_kernel.reset(new trace_kernel(m_program, "k_trace"));
+    // The same limits as on the device presenting the frames.
+    m_maxBufSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 32;
+    m_maxLocalBufSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2;
+    m_regBuf = cl::Local(m_maxLocalBufSize);
+    m_packedBuf = cl::Buffer(m_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, m_maxBufSize);
+    m_typeBuf = cl::Buffer(m_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, m_maxBufSize);
+    m_offsetBuf = cl::Buffer(m_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, m_maxBufSize);
+    m_opStepBuf = cl::Buffer(m_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, m_maxBufSize);
+    m_cullBuf = cl::Buffer(m_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, m_maxBufSize);
+    m_noBake = cl::Image3D(m_context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS, cl::ImageFormat(CL_RGBA, CL_FLOAT), 2, 2, 2);
+}
+
+const cl::Device& split_frame::helper::device() const
+{
+    return m_device;
+}
+
+void split_frame::helper::resize(uint32_t width, uint32_t height)
+{
+    m_queue.finish();
+    m_width = width;
+    m_height = height;
+    size_t nPixels = (size_t)width * height;
+    size_t nTiles = ((width + CONE_TILE - 1) / CONE_TILE) * ((height + CONE_TILE - 1) / CONE_TILE);
+    m_pixels = cl::Buffer(m_context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, nPixels * sizeof(uint32_t));
+    m_depth = cl::Buffer(m_context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, nPixels * sizeof(float));
+    m_cone = cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS, nTiles * sizeof(float));
+    m_queue.enqueueFillBuffer(m_depth, INFINITY, 0, nPixels * sizeof(float));
+    // Nothing is known to be empty.
+    m_queue.enqueueFillBuffer(m_cone, 0.0f, 0, nTiles * sizeof(float));
+    m_queue.finish();
+}
+
+/**
+ * \brief Writes the data to the start of the buffer and waits, returns false if it doesn't fit.
+ */
+template <typename T>
+static bool write_all(const cl::CommandQueue& queue, cl::Buffer& buffer, size_t maxBufSize, const std::vector<T>& data)
+{
+    size_t nBytes = data.size() * sizeof(T);
+    if (nBytes > maxBufSize)
+        return false;
+    if (nBytes)
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, nBytes, data.data());
+    return true;
+}
+
+void split_frame::helper::upload(const std::vector<uint8_t>& packed, const std::vector<uint8_t>& types,
+    const std::vector<uint32_t>& offsets, const std::vector<op_step>& steps,
+    const std::vector<cull_range>& culls, const cl_float8& sceneBounds, float lipschitz)
+{
+    m_fits = write_all(m_queue, m_packedBuf, m_maxBufSize, packed) &&
+        write_all(m_queue, m_typeBuf, m_maxBufSize, types) &&
+        write_all(m_queue, m_offsetBuf, m_maxBufSize, offsets) &&
+        write_all(m_queue, m_opStepBuf, m_maxBufSize, steps) &&
+        write_all(m_queue, m_cullBuf, m_maxBufSize, culls);
+    m_nEntities = types.size();
+    m_nSteps = steps.size();
+    m_nCulls = culls.size();
+    m_nRegisters = 0;
+    for (const op_step& step : steps)
+        m_nRegisters = std::max(m_nRegisters, (size_t)step.dest + 1);
+    m_sceneBounds = sceneBounds;
+    m_lipschitz = lipschitz;
+    // The writes above waited, and so did those of earlier patches queued before them.
+    m_patched.clear();
+    m_packed = packed;
+    m_steps = steps;
+    m_culls = culls;
+    // Rows of a power of two, which leave every work item its registers in local memory.
+    size_t limit = std::min({ MAX_GROUP_SIZE,
+        m_maxLocalBufSize / (sizeof(float) * std::max((size_t)1, m_nRegisters)),
+        (size_t)m_kernel->getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(m_device) });
+    m_groupSize = 1;
+    while (m_groupSize * 2 <= limit)
+        m_groupSize *= 2;
+}
+
+void split_frame::helper::patch(const std::vector<uint8_t>& packed, const std::vector<op_step>& steps,
+    const std::vector<std::pair<size_t, size_t>>& byteRanges, const std::vector<size_t>& changedSteps,
+    const std::vector<cull_range>& culls, const cl_float8& sceneBounds, float lipschitz)
+{
+    if (!m_fits)
+        return;
+    if (!m_patched.empty())
+        cl::Event::waitForEvents(m_patched);
+    m_patched.clear();
+    for (const auto& [offset, size] : byteRanges)
+    {
+        std::copy_n(packed.begin() + offset, size, m_packed.begin() + offset);
+        m_patched.emplace_back();
+        m_queue.enqueueWriteBuffer(m_packedBuf, CL_FALSE, offset, size, m_packed.data() + offset, nullptr,
+            &m_patched.back());
+    }
+    for (size_t si : changedSteps)
+    {
+        m_steps[si] = steps[si];
+        m_patched.emplace_back();
+        m_queue.enqueueWriteBuffer(m_opStepBuf, CL_FALSE, si * sizeof(op_step), sizeof(op_step), &m_steps[si],
+            nullptr, &m_patched.back());
+    }
+    m_culls = culls;
+    m_nCulls = culls.size();
+    if (m_nCulls * sizeof(cull_range) > m_maxBufSize)
+    {
+        m_fits = false;
+        return;
+    }
+    if (m_nCulls)
+    {
+        m_patched.emplace_back();
+        m_queue.enqueueWriteBuffer(m_cullBuf, CL_FALSE, 0, m_nCulls * sizeof(cull_range), m_culls.data(), nullptr,
+            &m_patched.back());
+    }
+    m_sceneBounds = sceneBounds;
+    m_lipschitz = lipschitz;
+    m_queue.flush();
+}
+
+bool split_frame::helper::can_trace() const
+{
+    return m_fits && m_nRegisters * sizeof(float) <= m_maxLocalBufSize;
+}
+
+void split_frame::helper::trace(const cl_float16& view, uint8_t lod, bool refine, uint32_t first, uint32_t end,
+    uint32_t* colors, float* depths)
+{
+    m_traced = cl::Event();
+    m_read = cl::Event();
+    if (first >= end)
+        return;
+    size_t offset = (size_t)first * m_width;
+    size_t count = (size_t)(end - first) * m_width;
+    if (!refine)
+        m_queue.enqueueFillBuffer(m_depth, INFINITY, offset * sizeof(float), count * sizeof(float));
+    size_t nx, ny;
+    trace_grid(m_width, end - first, lod, refine, nx, ny);
+    nx = ((nx + m_groupSize - 1) / m_groupSize) * m_groupSize;
+    m_traced = (*m_kernel)(
+        cl::EnqueueArgs(m_queue, cl::NDRange(nx, ny), cl::NDRange(m_groupSize, 1ULL)),
+        m_pixels,
+        m_packedBuf,
+        m_typeBuf,
+        m_offsetBuf,
+        m_regBuf,
+        (cl_uint)m_nEntities,
+        m_opStepBuf,
+        (cl_uint)m_nSteps,
+        m_cullBuf,
+        (cl_uint)m_nCulls,
+        m_sceneBounds,
+        m_lipschitz,
+        view,
+        m_depth,
+        m_cone,
+        m_noBake,
+        m_noBake,
+        m_noBake,
+        cl_float4{},
+        cl_uint2{ { m_width, m_height } },
+        cl_uint2{ { first, end } },
+        (cl_uchar)lod,
+        (cl_uchar)refine,
+        (cl_uchar)work_group_tuner::ORDER_ROWS
+#ifdef CLDEBUG
+        , cl_uint2{ { UINT32_MAX, UINT32_MAX } }
+#endif // CLDEBUG
+    );
+    m_queue.enqueueReadBuffer(m_pixels, CL_FALSE, offset * sizeof(uint32_t), count * sizeof(uint32_t), colors);
+    m_queue.enqueueReadBuffer(m_depth, CL_FALSE, offset * sizeof(float), count * sizeof(float), depths, nullptr, &m_read);
+    m_queue.flush();
+}
+
+double split_frame::helper::finish()
+{
+    if (!m_read())
+        return 0.0;
+    m_read.wait();
+    return (m_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+        m_traced.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+}
@@ -5,13 +5,24 @@
 #include <condition_variable>
 #include <cmath>
 #include <math.h>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <implicitkernel/cpu_eval.h>
+#include <implicitkernel/field_bake.h>
+#include <implicitkernel/frame_stats.h>
+#include <implicitkernel/kernel_jit.h>
 #include <implicitkernel/kernel_sources.h>
+#include <implicitkernel/program_cache.h>
+#include <implicitkernel/split_frame.h>
 #include <implicitkernel/viewer.h>
+#include <implicitkernel/work_group_tuner.h>
 #pragma warning(push)
 #pragma warning(disable: 4244 4996)
 #include <boost/gil/image.hpp>
 #include <boost/gil/typedefs.hpp>
 #include <boost/gil/extension/io/bmp.hpp>
+#include <boost/gil/extension/io/png.hpp>
 namespace bgil = boost::gil;
 #include <boost/algorithm/string/case_conv.hpp>
 #pragma warning(pop)
@@ -44,34 +55,162 @@ static glm::dvec2 s_mousePos = { 0.0, 0.0 };
 
 static uint8_t s_lowestLOD = 0;
 
-//static constexpr uint32_t WIN_W = 960, WIN_H = 640;
-static constexpr uint32_t WIN_W = 1024, WIN_H = 728;
-//static constexpr uint32_t WIN_W = 1, WIN_H = 1;
+// The size of the window, headless frames can be resized with set_resolution.
+static uint32_t s_winW = 1024, s_winH = 728;
 static GLFWwindow* s_window;
-static cl::ImageGL s_texture;
 static cl::Context s_context;
 static cl::CommandQueue s_queue;
-static uint32_t s_pboId = 0; // Pixel buffer to be rendered to screen, controlled by OpenGL.
+/*The frames in flight. While one frame is traced, the previous one is presented, and the
+two only synchronize through the events of the command queue.*/
+static constexpr size_t FRAME_COUNT = 2;
+struct frame_target
+{
+    uint32_t texture = 0; // Texture drawn to the screen, controlled by OpenGL.
+    cl::ImageGL image; // The same texture, written by OpenCL.
+    cl::Buffer pixels; // The frame when headless, there is nothing to share with OpenGL then.
+    uint32_t step = 1; // Pixel stride of the traced samples, 2 ^ the level of detail of the last pass.
+    // The rows traced by the helpers, read back to be composited into the frame.
+    std::vector<uint32_t> bandColors;
+    std::vector<float> bandDepths;
+    cl::Event composited; // The write of the bands into the frame, done before the helpers read into them again.
+    cl::Event done; // Completes when the frame is traced and released back to OpenGL.
+    bool pending = false; // Traced, but not presented yet.
+};
+static frame_target s_frames[FRAME_COUNT];
+static size_t s_frameIndex = 0; // The frame to render into next.
+static size_t s_lastFrame = 0; // The frame rendered most recently.
+static bool s_glEvents = false; // With cl_khr_gl_event, acquiring the pixels implicitly waits for OpenGL.
+/*Other devices tracing bands of rows of every frame, see split_frame. The first band is traced
+by s_device, the following ones by the helpers in order. The bands are rebalanced whenever a new
+view starts, from how fast every device traced its band, and stay the same while it is refined.*/
+static std::vector<std::unique_ptr<split_frame::helper>> s_helpers;
+static std::vector<uint32_t> s_bands; // The first row of every band, and the height.
+static std::vector<double> s_bandShares; // The fraction of the frame every device traces in the same time.
+static std::vector<double> s_bandTimes; // Milliseconds every device took for its band of the last frame.
+static cl::Event s_bandTrace; // The trace of s_device in the last frame, timed once it completes.
+static bool s_bandsPending = false; // The helpers traced bands that are not composited yet.
+static size_t s_bandFrame = 0; // The frame whose bandColors receive the pending bands.
+static uint32_t s_bandFirst = 0; // The first row of the pending bands.
+static constexpr double BAND_SMOOTHING = 0.5; // Weight of the old shares, so one slow frame doesn't swing the bands.
+
+/**
+ * \brief A brick map on the device, see field_bake. A zero cell size in bake means nothing is baked.
+ */
+struct baked_field
+{
+    uint64_t generation = 0;
+    cl::Image3D coarse;
+    cl::Image3D bricks;
+    cl::Image3D atlas;
+    cl_float4 bake = {}; // The first corner of the cells, and their size.
+};
+static bool s_bakeEnabled = false;
+static bool s_bakeFormats = false; // The device can sample the image formats of the brick maps.
+static std::unique_ptr<field_bake::baker> s_baker;
+/*Guards the generation and the published field. The render loop holds it while enqueueing the
+traces, so the field never goes stale between choosing it and tracing with it.*/
+static std::mutex s_bakeMutex;
+static uint64_t s_bakeGeneration = 0; // Bumped whenever the render data or the bounds change.
+static baked_field s_baked; // Published by the baker thread, used while its generation is current.
+static baked_field s_noBake; // Tiny images, bound while nothing is baked.
+/*The frames are presented by drawing their texture with one triangle covering the window. The
+samples of coarse frames are interpolated on the GPU, instead of showing them as blocks.*/
+static uint32_t s_presentProgram = 0;
+static uint32_t s_presentVao = 0; // Empty, the vertices are made from gl_VertexID.
+static int32_t s_stepLocation = -1;
+static uint32_t s_presentQuery = 0; // Times the drawing on the GPU.
+static bool s_presentQueryPending = false;
+static bool s_smoothUpscale = true;
+
+// Profiled commands whose timings are read once they complete.
+static std::mutex s_profileMutex;
+static std::vector<std::pair<const char*, cl::Event>> s_profiledEvents;
 static cl::Program s_program;
-static cl::make_kernel<
-    cl::BufferGL&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg,
-    cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uchar
-#ifdef CLDEBUG
-    , cl_uint2
-#endif // CLDEBUG
->* s_kernel;
-static cl::make_kernel<cl::BufferGL&, cl_uchar>* s_repeatPixelKernel;
+static trace_kernel* s_interpKernel; // Interprets the render data, works for any tree.
+static trace_kernel* s_privateKernel; // Interpreter with the registers in private memory, built when first enabled.
+static cl::Program s_privateProgram;
+static constexpr size_t PRIVATE_STACK_SIZE = 16; // Registers available to the private memory interpreter.
+static bool s_privateStack = false;
+static trace_kernel* s_kernel; // The kernel currently used for rendering, either the interpreter or a compiled one.
+// Counts the march iterations and field evaluations of every pixel, for benchmarks.
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&,
+    cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uint, cl_float8, cl_float, cl_float16,
+    cl::Buffer&, cl::Image3D&, cl::Image3D&, cl::Image3D&, cl_float4, cl_uchar
+> march_stats_kernel;
+static march_stats_kernel* s_marchStatsKernel;
+static cl::make_kernel<cl::Buffer&, cl::Buffer&, cl_float16, cl_float16, cl_uint2>* s_reprojectKernel;
+// Marches a cone per screen tile, to skip the empty space in front of all the rays of the tile.
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&,
+    cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uint, cl_float8, cl_float, cl_float16, cl_uint2
+> cone_kernel;
+static cone_kernel* s_coneKernel;
+static constexpr uint32_t CONE_TILE = 8; // Must match CONE_TILE in render.cl.
+static cl::Device s_device;
+static std::string s_buildOptions;
+static std::string s_renderSource; // The render kernel with its includes expanded.
+
+/*Kernels compiled for the structure of a csg tree, keyed by the structural hash.
+The source is kept to rule out hash collisions.*/
+struct jit_program
+{
+    std::string source;
+    cl::Program program;
+    std::unique_ptr<trace_kernel> kernel;
+};
+static constexpr size_t JIT_CACHE_SIZE = 16;
+static std::unordered_map<uint64_t, jit_program> s_jitCache;
+static std::deque<uint64_t> s_jitOrder; // Least recently used first, for eviction.
+static bool s_jitEnabled = true;
 
-static cl::BufferGL s_pBuffer; // Pixels to be rendered to the screen. Controlled by OpenCL.
+static bool s_headless = false; // No window, OpenGL or shared buffers, the frames are only exported.
 static cl::Buffer s_packedBuf; // Packed bytes of simple entities.
 static cl::Buffer s_typeBuf; // The types of simple entities.
 static cl::Buffer s_offsetBuf; // Offsets where the simple entities start in the packedBuf.
 static cl::Buffer s_opStepBuf; // Buffer containing csg operators.
-static cl::Buffer s_viewerDataBuf; // Buffer contains viewer data, camera position, direction and build volume bounds.
+static cl::Buffer s_cullBuf; // Subtrees of the steps the interpreter skips far from their boxes, see cull_range.
+static size_t s_cullCount = 0;
+static cl_float8 s_sceneBounds; // Box around the solid, the rays are clipped to it.
+static float s_lipschitz = 1.0f; // Bound of the gradient of the field, scales the steps of the rays.
 static uint8_t s_levelOfDetail = s_lowestLOD;
-static cl::LocalSpaceArg s_valueBuf; // Local buffer for storing the values of implicit functions when computing csg operations.
+static bool s_refining = false; // The coarser levels are traced, only the new pixels of s_levelOfDetail are left.
+/*The progressively refined frame. The passes of one view go to different frames in flight, so
+they are accumulated here and copied to the frame.*/
+static cl::Buffer s_accumBuf;
+/*The hit distance of every pixel, as seen from s_depthView. When the view changes, the hits are
+reprojected into the new view, and the rays start a little before them, see k_reproject.*/
+static cl::Buffer s_depthBuf;
+static cl::Buffer s_reprojBuf; // Target of the reprojection, swapped with s_depthBuf afterwards.
+static cl_float16 s_depthView;
+static bool s_depthValid = false; // False when the render data changed, so the old hits mean nothing.
+static bool s_depthSettled = false; // Every pixel of s_depthView was traced cold at full detail, see prepare_depth.
+static cl::Buffer s_coneBuf; // How far the cone of every screen tile is empty.
+static cl_float16 s_coneView;
+static bool s_coneValid = false;
 static cl::LocalSpaceArg s_regBuf; // Register to store intermediate csg values.
+static cl::LocalSpaceArg s_unusedLocalBuf; // Compiled kernels keep their values in private memory.
 static size_t s_numCurrentEntities = 0;
+// The entity shown with show_entity, and where the render data of its parts can be patched.
+static entities::ent_ref s_shownEntity;
+static std::unordered_map<const entities::entity*, uint32_t> s_shownSlots;
+// Host copy of the render data, the source of the partial uploads of parameter changes.
+static cpu_eval::program s_hostProgram;
+static cpu_eval::step_boxes s_hostBoxes; // The boxes of the steps of s_hostProgram, for the cull ranges.
+static std::vector<cull_range> s_cullsHost;
+/*A parameter change from set_param. The changes are applied by the render thread before its next
+frame, so the render data never changes while a frame is being enqueued.*/
+struct param_patch
+{
+    uint32_t slot; // The simple entity or the step.
+    bool simple;
+    std::vector<uint8_t> bytes; // The packed bytes of a simple entity.
+    op_defn op; // The operator of a step.
+};
+static std::mutex s_patchMutex;
+static std::vector<param_patch> s_patches;
+static std::vector<cl::Event> s_patchWrites; // They read the host copies until they finish.
+static size_t s_numCurrentRegisters = 0; // Registers used by the csg steps, the interpreter keeps them in local memory.
 static size_t s_opStepCount = 0;
 
 static size_t s_globalMemSize = 0;
@@ -80,11 +219,26 @@ static size_t s_constMemSize = 0;
 static size_t s_maxBufSize = 0;
 static size_t s_maxLocalBufSize = 0;
 static size_t s_maxWorkGroupSize = 0;
-static size_t s_workGroupSize = 0;
+static work_group_tuner::shape s_traceShape; // Work groups of the trace kernel.
+static std::string s_tuneKey; // Device, kernel and scene class the shape is tuned for.
+static bool s_tuneEnabled = true; // Off, the work groups always have the untuned shape.
+static bool s_tunePending = false; // Nothing was tuned for s_tuneKey yet, done over the next frames.
+static constexpr size_t TUNE_RUNS = 2; // Timed frames per candidate shape, the fastest counts.
+// The shapes being timed for s_tuneKey, see tune_work_group.
+struct tune_state
+{
+    std::vector<work_group_tuner::shape> shapes;
+    std::vector<double> times; // The fastest trace of every shape so far.
+    size_t next = 0; // The next run to enqueue, the first warms up and then TUNE_RUNS per shape.
+    std::deque<std::pair<size_t, cl::Event>> pending; // The shape and trace of the runs in flight.
+};
+static tune_state s_tune;
 
 static std::mutex s_mutex;
 static std::condition_variable s_cv;
 static bool s_pauseRender = false;
+static bool s_rendering = false; // The render loop is between acquire_lock and the end of the frame.
+static std::thread::id s_renderThread; // The thread of the render loop.
 static bool s_shouldExit = false;
 
 static glm::vec3 s_minBounds = { -20.0f, -20.0f, -20.0f };
@@ -129,21 +283,142 @@ void viewer::clear_gl_errors()
     }
 }
 
+static const char* PRESENT_VERTEX_SRC = R"(#version 330 core
+out vec2 uv;
+void main()
+{
+    // (-1, -1), (3, -1), (-1, 3): covers the window, and the corners outside are clipped.
+    vec2 pos = vec2((gl_VertexID & 1) * 4 - 1, (gl_VertexID >> 1) * 4 - 1);
+    uv = pos * 0.5 + 0.5;
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
+)";
+
+static const char* PRESENT_FRAGMENT_SRC = R"(#version 330 core
+uniform sampler2D frame;
+uniform int step; // Pixel stride of the traced samples, 1 if every pixel is traced.
+in vec2 uv;
+out vec4 color;
+void main()
+{
+    ivec2 size = textureSize(frame, 0);
+    vec2 pixel = uv * vec2(size);
+    if (step <= 1)
+    {
+        color = texelFetch(frame, min(ivec2(pixel), size - 1), 0);
+        return;
+    }
+    // A sample is traced at the first pixel of every block, interpolate between the four around.
+    vec2 p = (pixel - 0.5) / float(step);
+    ivec2 last = (size - 1) / step;
+    ivec2 i0 = clamp(ivec2(floor(p)), ivec2(0), last);
+    ivec2 i1 = min(i0 + 1, last);
+    vec2 t = fract(p);
+    vec4 c00 = texelFetch(frame, i0 * step, 0);
+    vec4 c10 = texelFetch(frame, ivec2(i1.x, i0.y) * step, 0);
+    vec4 c01 = texelFetch(frame, ivec2(i0.x, i1.y) * step, 0);
+    vec4 c11 = texelFetch(frame, i1 * step, 0);
+    color = mix(mix(c00, c10, t.x), mix(c01, c11, t.x), t.y);
+}
+)";
+
+static uint32_t compile_shader(GLenum type, const char* src)
+{
+    uint32_t shader = glCreateShader(type);
+    GL_CALL(glShaderSource(shader, 1, &src, nullptr));
+    GL_CALL(glCompileShader(shader));
+    GLint status = GL_FALSE;
+    GL_CALL(glGetShaderiv(shader, GL_COMPILE_STATUS, &status));
+    if (status != GL_TRUE)
+    {
+        char log[1024];
+        GL_CALL(glGetShaderInfoLog(shader, sizeof(log), nullptr, log));
+        std::cerr << "Failed to compile the present shader:\n" << log << std::endl;
+        exit(1);
+    }
+    return shader;
+}
+
+/**
+ * \brief Builds the program drawing the frames, see PRESENT_FRAGMENT_SRC.
+ */
+static void init_present()
+{
+    uint32_t vertex = compile_shader(GL_VERTEX_SHADER, PRESENT_VERTEX_SRC);
+    uint32_t fragment = compile_shader(GL_FRAGMENT_SHADER, PRESENT_FRAGMENT_SRC);
+    s_presentProgram = glCreateProgram();
+    GL_CALL(glAttachShader(s_presentProgram, vertex));
+    GL_CALL(glAttachShader(s_presentProgram, fragment));
+    GL_CALL(glLinkProgram(s_presentProgram));
+    GL_CALL(glDeleteShader(vertex));
+    GL_CALL(glDeleteShader(fragment));
+    GLint status = GL_FALSE;
+    GL_CALL(glGetProgramiv(s_presentProgram, GL_LINK_STATUS, &status));
+    if (status != GL_TRUE)
+    {
+        std::cerr << "Failed to link the present shaders." << std::endl;
+        exit(1);
+    }
+    GL_CALL(glUseProgram(s_presentProgram));
+    GL_CALL(glUniform1i(glGetUniformLocation(s_presentProgram, "frame"), 0));
+    s_stepLocation = glGetUniformLocation(s_presentProgram, "step");
+    GL_CALL(glGenVertexArrays(1, &s_presentVao));
+    GL_CALL(glGenQueries(1, &s_presentQuery));
+    GL_CALL(glDisable(GL_DEPTH_TEST));
+}
+
+/**
+ * \brief Draws the texture of the frame over the whole window.
+ */
+static void present(const frame_target& frame)
+{
+    // The GPU time of the previous present, if it is known by now.
+    if (s_presentQueryPending)
+    {
+        GLint available = GL_FALSE;
+        GL_CALL(glGetQueryObjectiv(s_presentQuery, GL_QUERY_RESULT_AVAILABLE, &available));
+        if (available)
+        {
+            GLuint64 ns = 0;
+            GL_CALL(glGetQueryObjectui64v(s_presentQuery, GL_QUERY_RESULT, &ns));
+            frame_stats::record("present", ns * 1e-6);
+            s_presentQueryPending = false;
+        }
+    }
+    bool timed = !s_presentQueryPending;
+    if (timed)
+        GL_CALL(glBeginQuery(GL_TIME_ELAPSED, s_presentQuery));
+    GL_CALL(glUseProgram(s_presentProgram));
+    GL_CALL(glUniform1i(s_stepLocation, s_smoothUpscale ? (GLint)frame.step : 1));
+    GL_CALL(glActiveTexture(GL_TEXTURE0));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, frame.texture));
+    GL_CALL(glBindVertexArray(s_presentVao));
+    // The triangle covers every pixel, so nothing has to be cleared.
+    GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 3));
+    GL_CALL(glBindVertexArray(0));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    if (timed)
+    {
+        GL_CALL(glEndQuery(GL_TIME_ELAPSED));
+        s_presentQueryPending = true;
+    }
+}
+
 void viewer::init_ogl()
 {
     /* Initialize the library */
-    glfwWindowHint(GLFW_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_VERSION_MINOR, 6);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
     if (!glfwInit())
     {
         std::cout << "GlewInit failed." << std::endl;
         return;
     }
+    // The hints only apply once the library is initialized. Presenting needs shaders and timer queries.
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
     /* Create a windowed mode window and its OpenGL context */
-    s_window = glfwCreateWindow(WIN_W, WIN_H, "Viewer", NULL, NULL);
+    s_window = glfwCreateWindow(s_winW, s_winH, "Viewer", NULL, NULL);
     glfwSetWindowAttrib(s_window, GLFW_RESIZABLE, GLFW_FALSE);
     if (!s_window)
     {
@@ -154,6 +429,7 @@ void viewer::init_ogl()
     /* Make the window's context current */
     glfwMakeContextCurrent(s_window);
 
+    glewExperimental = GL_TRUE; // Otherwise GLEW misses functions of core profiles.
     GLenum err = glewInit();
     if (err != GLEW_OK)
     {
@@ -162,6 +438,7 @@ void viewer::init_ogl()
     }
 
     std::cout << "Using OpenGL Version: " << glGetString(GL_VERSION) << std::endl;
+    init_present();
 
     // Register mouse event handlers.
     GL_CALL(glfwSetCursorPosCallback(s_window, camera::on_mouse_move));
@@ -357,27 +634,37 @@ bool viewer::window_should_close()
 
 void viewer::acquire_lock()
 {
-    while (s_pauseRender)
-    {
-        std::unique_lock<std::mutex> lock(s_mutex);
-        s_cv.wait(lock);
-        lock.unlock();
-    }
+    std::unique_lock<std::mutex> lock(s_mutex);
+    s_cv.wait(lock, [] { return !s_pauseRender; });
+    s_rendering = true;
+}
+
+/**
+ * \brief Ends the frame started by acquire_lock, after which the render loop no longer uses the
+ * render data or the devices until the next acquire_lock.
+ */
+static void release_lock()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_rendering = false;
+    s_cv.notify_all();
 }
 
 uint32_t viewer::win_height()
 {
-    return WIN_H;
+    return s_winH;
 }
 
 uint32_t viewer::win_width()
 {
-    return WIN_W;
+    return s_winW;
 }
 
 void viewer::render_loop()
 {
     /* Loop until the user closes the window */
+    auto frameStart = std::chrono::steady_clock::now();
+    s_renderThread = std::this_thread::get_id();
     while (!viewer::window_should_close() && !s_shouldExit)
     {
         viewer::acquire_lock();
@@ -385,13 +672,15 @@ void viewer::render_loop()
         if (s_debugMode) s_framestart = std::chrono::high_resolution_clock::now();
 #endif
         viewer::render();
-        GL_CALL(glClear(GL_COLOR_BUFFER_BIT));
-        GL_CALL(glDisable(GL_DEPTH_TEST));
-
-        GL_CALL(glRasterPos2i(-1, -1));
-        GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pboId));
-        GL_CALL(glDrawPixels(WIN_W, WIN_H, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
-        GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+        // Present the previous frame while the one queued above is traced.
+        frame_target& frame = s_frames[(s_frameIndex + FRAME_COUNT - 2) % FRAME_COUNT];
+        if (frame.pending)
+        {
+            frame.done.wait();
+            frame.pending = false;
+            present(frame);
+        }
+        release_lock();
 
         /* Swap front and back buffers */
         GL_CALL(glfwSwapBuffers(s_window));
@@ -399,6 +688,11 @@ void viewer::render_loop()
         /* Poll for and process events */
         GL_CALL(glfwPollEvents());
 
+        auto frameEnd = std::chrono::steady_clock::now();
+        frame_stats::record("frame", std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+        frameStart = frameEnd;
+        frame_stats::tick();
+
 #ifdef CLDEBUG
         if (s_debugMode)
         {
@@ -413,34 +707,444 @@ void viewer::render_loop()
     }
 }
 
+static void composite_bands();
+
 void viewer::stop()
 {
-    GL_CALL(glfwSetWindowShouldClose(s_window, GL_TRUE));
-    glfwTerminate();
-    delete s_kernel;
-    delete s_repeatPixelKernel;
+    // Waits for the layer being baked.
+    s_baker.reset();
+    // Let the frames in flight finish before their buffers go away.
+    if (s_queue())
+    {
+        composite_bands();
+        s_queue.finish();
+    }
+    if (!s_headless)
+    {
+        GL_CALL(glfwSetWindowShouldClose(s_window, GL_TRUE));
+        glfwTerminate();
+    }
+    s_kernel = nullptr;
+    s_helpers.clear();
+    s_jitCache.clear();
+    s_jitOrder.clear();
+    delete s_interpKernel;
+    delete s_privateKernel;
+    delete s_marchStatsKernel;
+    delete s_reprojectKernel;
+    delete s_coneKernel;
+}
+
+/**
+ * \brief Times the command of the event once it completes, see collect_profiling.
+ */
+static void profile(const char* timer, const cl::Event& event)
+{
+    std::lock_guard<std::mutex> lock(s_profileMutex);
+    s_profiledEvents.emplace_back(timer, event);
 }
 
-void viewer::render()
+/**
+ * \brief Records the device time of the profiled commands that have completed.
+ */
+static void collect_profiling()
 {
-    try
+    std::lock_guard<std::mutex> lock(s_profileMutex);
+    auto end = std::remove_if(s_profiledEvents.begin(), s_profiledEvents.end(),
+        [](const std::pair<const char*, cl::Event>& pair) {
+            cl_int status = pair.second.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+            if (status > CL_COMPLETE)
+                return false; // Still in flight.
+            if (status == CL_COMPLETE)
+            {
+                cl_ulong start = pair.second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                cl_ulong stop = pair.second.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                frame_stats::record(pair.first, (double)(stop - start) * 1e-6);
+            }
+            return true;
+        });
+    s_profiledEvents.erase(end, s_profiledEvents.end());
+}
+
+/**
+ * \brief Brings the hit distances in s_depthBuf into the given view, to start the rays from.
+ */
+static void prepare_depth(const cl_float16& view)
+{
+    size_t size = s_winW * s_winH * sizeof(float);
+    bool moved = std::memcmp(&view, &s_depthView, sizeof(view)) != 0;
+    bool fullDetail = s_levelOfDetail == 0 && !s_refining;
+    /*A ray starting from a reprojected hit misses what is in front of it, e.g. where the view
+    uncovered something, and its hit would be the next start again. So the first frame of a still
+    view that traces every pixel starts cold, and the ones after it start from its exact hits.*/
+    if (!s_depthValid || (!moved && fullDetail && !s_depthSettled))
     {
-        cl_mem mem = s_pBuffer();
-        clEnqueueAcquireGLObjects(s_queue(), 1, &mem, 0, 0, 0);
-        s_queue.flush();
-        s_queue.finish();
-        if (s_kernel)
+        s_queue.enqueueFillBuffer(s_depthBuf, INFINITY, 0, size);
+        s_depthValid = true;
+        s_depthSettled = fullDetail;
+    }
+    else if (moved)
+    {
+        s_depthSettled = false;
+        if (s_reprojectKernel)
         {
+            s_queue.enqueueFillBuffer(s_reprojBuf, INFINITY, 0, size);
+            cl::Event reprojected = (*s_reprojectKernel)(cl::EnqueueArgs(s_queue, cl::NDRange(s_winW, s_winH)),
+                s_depthBuf, s_reprojBuf, s_depthView, view, cl_uint2{ { s_winW, s_winH } });
+            profile("reproject", reprojected);
+            std::swap(s_depthBuf, s_reprojBuf);
+        }
+    }
+    s_depthView = view;
+}
+
+static size_t work_group_size(size_t nRegisters);
+static size_t max_group_size();
+static void update_kernel_info();
+static void apply_patches();
+
+/**
+ * \brief Whether the registers of the current csg steps fit in local memory, as the local memory
+ * interpreters of the cone march and the march statistics need. The trace kernel may not need them.
+ */
+static bool local_registers_fit()
+{
+    return s_numCurrentRegisters * sizeof(float) <= s_maxLocalBufSize;
+}
+
+/**
+ * \brief Marches the cones of the screen tiles for the given view, unless they are up to date.
+ * Always interprets the render data, which is cheap enough for one ray per tile.
+ */
+static void prepare_cone(const cl_float16& view)
+{
+    if (s_coneValid && std::memcmp(&view, &s_coneView, sizeof(view)) == 0)
+        return;
+    size_t tilesX = (s_winW + CONE_TILE - 1) / CONE_TILE;
+    size_t tilesY = (s_winH + CONE_TILE - 1) / CONE_TILE;
+    if (!s_coneKernel || !local_registers_fit())
+    {
+        // Nothing is known to be empty.
+        s_queue.enqueueFillBuffer(s_coneBuf, 0.0f, 0, tilesX * tilesY * sizeof(float));
+    }
+    else
+    {
+        size_t groupSize = work_group_size(s_numCurrentRegisters);
+        tilesX = ((tilesX + groupSize - 1) / groupSize) * groupSize;
+        cl::Event marched = (*s_coneKernel)(
+            cl::EnqueueArgs(s_queue, cl::NDRange(tilesX, tilesY), cl::NDRange(groupSize, 1ULL)),
+            s_coneBuf, s_packedBuf, s_typeBuf, s_offsetBuf, s_regBuf, (cl_uint)s_numCurrentEntities,
+            s_opStepBuf, (cl_uint)s_opStepCount, s_cullBuf, (cl_uint)s_cullCount, s_sceneBounds,
+            s_lipschitz, view, cl_uint2{ { s_winW, s_winH } });
+        profile("cone_march", marched);
+    }
+    s_coneView = view;
+    s_coneValid = true;
+}
+
+/**
+ * \brief Enqueues the current kernel, tracing the pixels that are new at the given level of detail
+ * into the accumulated frame, see k_trace.
+ */
+static cl::Event enqueue_trace(const work_group_tuner::shape& shape, const cl_float16& view, baked_field& bake,
+    uint8_t lod, bool refine, uint32_t firstRow, uint32_t endRow)
+{
 #ifdef CLDEBUG
-            cl_uint2 mousePos = { UINT32_MAX, UINT32_MAX };
-            if (viewer::getdebugmode())
+    cl_uint2 mousePos = { UINT32_MAX, UINT32_MAX };
+    if (viewer::getdebugmode())
+    {
+        uint32_t x, y;
+        camera::get_mouse_pos(x, y);
+        mousePos = { x, s_winH - y };
+    }
+#endif // CLDEBUG
+    // Only the pixels that are new at this level are dispatched.
+    size_t nx, ny;
+    split_frame::trace_grid(s_winW, endRow - firstRow, lod, refine, nx, ny);
+    // Rounded up to whole work groups, the kernel skips the work items outside the frame.
+    nx = ((nx + shape.x - 1) / shape.x) * shape.x;
+    ny = ((ny + shape.y - 1) / shape.y) * shape.y;
+    bool interpreted = s_kernel == s_interpKernel;
+    return (*s_kernel)(
+        cl::EnqueueArgs(s_queue, cl::NDRange(nx, ny), cl::NDRange(shape.x, shape.y)),
+        s_accumBuf,
+        s_packedBuf,
+        s_typeBuf,
+        s_offsetBuf,
+        interpreted ? s_regBuf : s_unusedLocalBuf,
+        (cl_uint)s_numCurrentEntities,
+        s_opStepBuf,
+        (cl_uint)s_opStepCount,
+        s_cullBuf,
+        (cl_uint)s_cullCount,
+        s_sceneBounds,
+        s_lipschitz,
+        view,
+        s_depthBuf,
+        s_coneBuf,
+        bake.coarse,
+        bake.bricks,
+        bake.atlas,
+        bake.bake,
+        cl_uint2{ { s_winW, s_winH } },
+        cl_uint2{ { firstRow, endRow } },
+        (cl_uchar)lod,
+        (cl_uchar)refine,
+        (cl_uchar)shape.order
+#ifdef CLDEBUG
+        , mousePos
+#endif // CLDEBUG
+    );
+}
+
+static double elapsed_ms(const cl::Event& event)
+{
+    return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+        event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+}
+
+/**
+ * \brief Times full frames of the current view with the candidate shapes of the work groups, one
+ * trace per frame, and keeps the fastest shape once all are timed. The traces are queued before the
+ * frame's own and their times are read once they are done, so the frames keep coming meanwhile. They
+ * are traced at full detail, so they are valid for the view. Headless, there is no one waiting for the
+ * frames, so all the shapes are timed at once.
+ */
+static void tune_work_group(const cl_float16& view, baked_field& bake)
+{
+    if (s_tune.shapes.empty())
+    {
+        s_tune.shapes = work_group_tuner::candidates(max_group_size());
+        s_tune.shapes.push_back(s_traceShape); // The untuned shape, which the others have to beat.
+        s_tune.times.assign(s_tune.shapes.size(), INFINITY);
+        s_tune.next = 0;
+        s_tune.pending.clear();
+    }
+    size_t nRuns = s_tune.shapes.size() * TUNE_RUNS + 1; // The first run warms up.
+    do
+    {
+        while (!s_tune.pending.empty())
+        {
+            const auto& [index, traced] = s_tune.pending.front();
+            if (s_headless)
+                traced.wait();
+            cl_int status = traced.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+            if (status > CL_COMPLETE)
+                break; // The queue is in order, so the later traces aren't done either.
+            if (status == CL_COMPLETE && index < s_tune.times.size())
+                s_tune.times[index] = std::min(s_tune.times[index], elapsed_ms(traced));
+            s_tune.pending.pop_front();
+        }
+        if (s_tune.next < nRuns)
+        {
+            size_t run = s_tune.next++;
+            size_t index = run ? (run - 1) / TUNE_RUNS : SIZE_MAX;
+            const work_group_tuner::shape& shape = run ? s_tune.shapes[index] : s_traceShape;
+            try
             {
-                uint32_t x, y;
-                camera::get_mouse_pos(x, y);
-                mousePos = { x, WIN_H - y };
+                s_tune.pending.push_back({ index, enqueue_trace(shape, view, bake, 0, false, 0, s_winH) });
             }
-#endif // CLDEBUG
-            cl::EnqueueArgs args = cl::EnqueueArgs(s_queue, cl::NDRange(WIN_W, WIN_H), cl::NDRange(s_workGroupSize, 1ULL));
+            catch (cl::Error)
+            {
+                // The kernel can't run with this shape, skip its other runs.
+                s_tune.next = std::max(s_tune.next, (index + 1) * TUNE_RUNS + 1);
+            }
+        }
+    } while (s_headless && (s_tune.next < nRuns || !s_tune.pending.empty()));
+    if (s_tune.next < nRuns || !s_tune.pending.empty())
+        return;
+
+    work_group_tuner::shape best = s_traceShape;
+    double bestTime = INFINITY;
+    for (size_t i = 0; i < s_tune.shapes.size(); i++)
+    {
+        if (s_tune.times[i] < bestTime)
+        {
+            bestTime = s_tune.times[i];
+            best = s_tune.shapes[i];
+        }
+    }
+    s_tune = tune_state();
+    s_tunePending = false;
+    s_traceShape = best;
+    work_group_tuner::store(s_tuneKey, best);
+    update_kernel_info();
+    std::cout << "Tuned the work groups to " << best.x << " x " << best.y
+        << (best.order == work_group_tuner::ORDER_MORTON ? " in Morton order" : "") << std::endl;
+}
+
+/**
+ * \brief Updates the shares of the devices from how fast they traced their bands of the last frame,
+ * once the trace of s_device is done. Devices without rows keep their share.
+ */
+static void measure_bands()
+{
+    if (!s_bandTrace())
+        return;
+    cl_int status = s_bandTrace.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+    if (status > CL_COMPLETE)
+        return; // Still in flight, measured before the next frame.
+    if (status == CL_COMPLETE)
+    {
+        s_bandTimes[0] = elapsed_ms(s_bandTrace);
+        std::vector<double> speeds(s_bandTimes.size(), 0.0);
+        double totalSpeed = 0.0, totalShare = 0.0;
+        for (size_t i = 0; i < speeds.size(); i++)
+        {
+            uint32_t rows = s_bands[i + 1] - s_bands[i];
+            if (rows == 0 || s_bandTimes[i] <= 0.0)
+                continue;
+            speeds[i] = rows / s_bandTimes[i];
+            totalSpeed += speeds[i];
+            totalShare += s_bandShares[i];
+        }
+        for (size_t i = 0; i < speeds.size() && totalSpeed > 0.0; i++)
+        {
+            if (speeds[i] > 0.0)
+            {
+                double share = totalShare * speeds[i] / totalSpeed;
+                s_bandShares[i] = BAND_SMOOTHING * s_bandShares[i] + (1.0 - BAND_SMOOTHING) * share;
+            }
+        }
+    }
+    s_bandTrace = cl::Event();
+}
+
+/**
+ * \brief Splits the rows of the next frame between the devices. Must only be called when a new view
+ * starts, because the refining passes only trace the pixels of the coarser levels of the same band.
+ */
+static void rebalance_bands()
+{
+    std::vector<double> shares = s_bandShares;
+    for (size_t i = 0; i < s_helpers.size(); i++)
+    {
+        if (!s_helpers[i]->can_trace())
+            shares[i + 1] = 0.0;
+    }
+    // The grids of all levels down from the coarsest start on the first row of every band.
+    s_bands = split_frame::balance(shares, s_winH, 2u << std::max(s_lowestLOD, s_levelOfDetail));
+}
+
+/**
+ * \brief Forgets the measured shares, every device starts with an equal band.
+ */
+static void reset_bands()
+{
+    size_t nDevices = s_helpers.size() + 1;
+    s_bandShares.assign(nDevices, 1.0 / nDevices);
+    s_bandTimes.assign(nDevices, 0.0);
+    s_bandTrace = cl::Event();
+    s_bands = split_frame::balance(s_bandShares, s_winH, 2u << s_lowestLOD);
+}
+
+static cl::size_t<3> frame_origin()
+{
+    cl::size_t<3> origin;
+    origin[0] = origin[1] = origin[2] = 0;
+    return origin;
+}
+
+static cl::size_t<3> frame_region()
+{
+    cl::size_t<3> region;
+    region[0] = s_winW;
+    region[1] = s_winH;
+    region[2] = 1;
+    return region;
+}
+
+/**
+ * \brief Hands the frame back to OpenGL, to be presented once everything queued for it is done.
+ */
+static void release_frame(frame_target& frame)
+{
+    cl_mem mem = frame.image();
+    cl_event done = nullptr;
+    clEnqueueReleaseGLObjects(s_queue(), 1, &mem, 0, 0, &done);
+    frame.done = cl::Event(done);
+    frame.pending = true;
+    profile("gl_release", frame.done);
+}
+
+/**
+ * \brief Waits for the bands the helpers traced, and writes them into their frame and the hit
+ * distances. With a window, that is done at the start of the next frame, when the helpers had a
+ * whole frame to read them back, so the wait rarely blocks. The frame is only released to OpenGL
+ * then, which costs no latency, as the render loop presents every frame after queueing the next.
+ * Headless, every frame is composited right after its own trace.
+ */
+static void composite_bands()
+{
+    if (!s_bandsPending)
+        return;
+    s_bandsPending = false;
+    double slowest = 0.0;
+    for (size_t i = 0; i < s_helpers.size(); i++)
+    {
+        s_bandTimes[i + 1] = s_helpers[i]->finish();
+        slowest = std::max(slowest, s_bandTimes[i + 1]);
+    }
+    frame_stats::record("helpers", slowest);
+    frame_target& frame = s_frames[s_bandFrame];
+    size_t offset = (size_t)s_bandFirst * s_winW;
+    size_t count = (size_t)(s_winH - s_bandFirst) * s_winW;
+    if (count > 0)
+    {
+        // Not blocking, the helpers only read into the bands again once frame.composited is done.
+        if (s_headless)
+        {
+            s_queue.enqueueWriteBuffer(frame.pixels, CL_FALSE, offset * sizeof(uint32_t), count * sizeof(uint32_t),
+                frame.bandColors.data());
+        }
+        else
+        {
+            cl::size_t<3> origin = frame_origin();
+            origin[1] = s_bandFirst;
+            cl::size_t<3> region = frame_region();
+            region[1] = s_winH - s_bandFirst;
+            s_queue.enqueueWriteImage(frame.image, CL_FALSE, origin, region, 0, 0, frame.bandColors.data());
+        }
+        s_queue.enqueueWriteBuffer(s_depthBuf, CL_FALSE, offset * sizeof(float), count * sizeof(float),
+            frame.bandDepths.data(), nullptr, &frame.composited);
+        profile("composite", frame.composited);
+    }
+    if (!s_headless)
+        release_frame(frame);
+}
+
+/**
+ * \brief The field to trace with, the published one if it belongs to the current render data.
+ * s_bakeMutex must be held while the field is in use.
+ */
+static baked_field& current_bake()
+{
+    bool current = s_bakeEnabled && s_baked.coarse() && s_baked.generation == s_bakeGeneration;
+    return current ? s_baked : s_noBake;
+}
+
+void viewer::render()
+{
+    try
+    {
+        collect_profiling();
+        apply_patches();
+        // The bands of the previous frame, before its hit distances are reprojected.
+        composite_bands();
+        frame_target& frame = s_frames[s_frameIndex];
+        cl_mem mem = frame.image();
+        if (!s_headless)
+        {
+            // OpenGL may still be drawing from this texture, from FRAME_COUNT frames ago.
+            if (!s_glEvents)
+                GL_CALL(glFinish());
+            cl_event acquired = nullptr;
+            clEnqueueAcquireGLObjects(s_queue(), 1, &mem, 0, 0, &acquired);
+            if (acquired)
+                profile("gl_acquire", cl::Event(acquired));
+        }
+        if (s_kernel)
+        {
             viewer_data vdata
             {
                 camera::distance(), camera::theta(), camera::phi(),
@@ -448,63 +1152,288 @@ void viewer::render()
                 s_minBounds,
                 s_maxBounds
             };
-            s_queue.enqueueWriteBuffer(s_viewerDataBuf, CL_TRUE, 0, sizeof(vdata), &vdata);
-            (*s_kernel)(
-                args,
-                s_pBuffer,
-                s_packedBuf,
-                s_typeBuf,
-                s_offsetBuf,
-                s_valueBuf,
-                s_regBuf,
-                (cl_uint)s_numCurrentEntities,
-                s_opStepBuf,
-                (cl_uint)s_opStepCount,
-                s_viewerDataBuf,
-                (cl_uchar)s_levelOfDetail
-#ifdef CLDEBUG
-                , mousePos
-#endif // CLDEBUG
-            );
-            if (s_repeatPixelKernel && s_levelOfDetail > 0)
+            // The camera is passed by value, so nothing has to be uploaded and waited for.
+            cl_float16 view = {};
+            static_assert(sizeof(vdata) <= sizeof(view), "The viewer data doesn't fit in the kernel argument");
+            std::memcpy(&view, &vdata, sizeof(vdata));
+            prepare_depth(view);
+            prepare_cone(view);
+            std::unique_lock<std::mutex> bakeLock(s_bakeMutex);
+            baked_field& bake = current_bake();
+            if (s_tunePending)
+                tune_work_group(view, bake);
+            measure_bands();
+            if (!s_refining)
+                rebalance_bands();
+            if (!s_helpers.empty())
+            {
+                if (frame.composited())
+                    frame.composited.wait();
+                size_t nPixels = (size_t)(s_winH - s_bands[1]) * s_winW;
+                if (frame.bandColors.size() < nPixels)
+                {
+                    frame.bandColors.resize(nPixels);
+                    frame.bandDepths.resize(nPixels);
+                }
+            }
+            // The helpers first, so that they trace at the same time as s_device.
+            for (size_t i = 0; i < s_helpers.size(); i++)
+            {
+                size_t offset = (size_t)(s_bands[i + 1] - s_bands[1]) * s_winW;
+                s_helpers[i]->trace(view, s_levelOfDetail, s_refining, s_bands[i + 1], s_bands[i + 2],
+                    frame.bandColors.data() + offset, frame.bandDepths.data() + offset);
+            }
+            if (!s_helpers.empty())
+            {
+                s_bandsPending = true;
+                s_bandFrame = s_frameIndex;
+                s_bandFirst = s_bands[1];
+            }
+            if (s_bands[1] > 0)
             {
-                (*s_repeatPixelKernel)(args, s_pBuffer, (cl_uchar)s_levelOfDetail);
+                cl::Event traced = enqueue_trace(s_traceShape, view, bake, s_levelOfDetail, s_refining, 0, s_bands[1]);
+                profile("trace", traced);
+                s_bandTrace = traced;
             }
+            bakeLock.unlock();
+            cl::Event copied;
+            if (s_headless)
+                s_queue.enqueueCopyBuffer(s_accumBuf, frame.pixels, 0, 0, s_winW * s_winH * sizeof(uint32_t), nullptr, &copied);
+            else
+                s_queue.enqueueCopyBufferToImage(s_accumBuf, frame.image, 0, frame_origin(), frame_region(), nullptr, &copied);
+            profile("copy", copied);
+            if (s_headless)
+                composite_bands();
+            frame.step = 1u << s_levelOfDetail;
             update_LOD();
         }
-        clEnqueueReleaseGLObjects(s_queue(), 1, &mem, 0, 0, 0);
+        s_lastFrame = s_frameIndex;
+        if (s_headless)
+        {
+            s_queue.finish();
+            collect_profiling();
+            return;
+        }
+        // With bands of helpers, the frame is released once they are composited.
+        if (!s_bandsPending)
+            release_frame(frame);
+        s_frameIndex = (s_frameIndex + 1) % FRAME_COUNT;
         s_queue.flush();
+#ifdef CLDEBUG
+        // Kernel printf output belongs to this frame.
+        if (s_debugMode)
+            s_queue.finish();
+#endif // CLDEBUG
+    }
+    CATCH_EXIT_CL_ERR;
+}
+
+/**
+ * \brief The most work items per group, if every one of them needs the given number of registers
+ * in local memory.
+ */
+static size_t local_group_limit(size_t nRegisters)
+{
+    return std::min(s_maxWorkGroupSize,
+        std::max((size_t)1, s_maxLocalBufSize / (sizeof(float) * std::max((size_t)1, nRegisters))));
+}
+
+/**
+ * \brief The most work items per group of the current trace kernel.
+ */
+static size_t max_group_size()
+{
+    // Compiled kernels do not use the local buffers, so they don't limit the work group size.
+    size_t limit = local_group_limit(s_kernel == s_interpKernel ? s_numCurrentRegisters : 1);
+    return std::min(limit, (size_t)s_kernel->getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(s_device));
+}
+
+/**
+ * \brief The largest work group size that divides the width of the frame and leaves every work item
+ * the given number of registers in the local buffer.
+ */
+static size_t work_group_size(size_t nRegisters)
+{
+    std::vector<size_t> factors;
+    auto fIter = std::back_inserter(factors);
+    size_t width = (size_t)s_winW;
+    util::factorize(width, fIter);
+    std::sort(factors.begin(), factors.end());
+    size_t size = std::min(width, local_group_limit(nRegisters));
+    if (width % size)
+    {
+        size_t newSize = width;
+        for (size_t f : factors)
+        {
+            newSize /= f;
+            if (newSize <= size) break;
+        }
+        size = newSize;
+    }
+    return size;
+}
+
+void viewer::render_headless(uint8_t lod, bool cold)
+{
+    // There is no one to look at the coarse frames, so go straight to the requested detail.
+    s_levelOfDetail = lod;
+    s_refining = false;
+    if (cold)
+    {
+        s_depthValid = false;
+        s_coneValid = false;
+    }
+    viewer::render();
+}
+
+void viewer::set_resolution(uint32_t width, uint32_t height)
+{
+    if (!s_headless)
+        throw "The resolution can only be changed in headless mode";
+    if (width == 0 || height == 0)
+        throw "The resolution cannot be zero";
+    try
+    {
         s_queue.finish();
+        s_winW = width;
+        s_winH = height;
+        for (frame_target& frame : s_frames)
+        {
+            frame.pixels = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, s_winW * s_winH * sizeof(uint32_t));
+            frame.done = cl::Event();
+            frame.pending = false;
+        }
+        s_accumBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(uint32_t));
+        s_depthBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(float));
+        s_reprojBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(float));
+        s_depthValid = false;
+        s_coneBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            ((s_winW + CONE_TILE - 1) / CONE_TILE) * ((s_winH + CONE_TILE - 1) / CONE_TILE) * sizeof(float));
+        s_coneValid = false;
+        for (auto& helper : s_helpers)
+            helper->resize(s_winW, s_winH);
+        reset_bands();
+        set_work_group_size();
     }
     CATCH_EXIT_CL_ERR;
 }
 
+void viewer::set_camera(float distance, float theta, float phi, const glm::vec3& target)
+{
+    s_camDist = distance;
+    s_camTheta = theta;
+    s_camPhi = std::min(MAX_PHI, std::max(-MAX_PHI, phi));
+    s_camTarget = target;
+    reset_LOD();
+}
+
+viewer::march_stats viewer::measure_march(uint8_t lod)
+{
+    march_stats stats;
+    if (!s_marchStatsKernel)
+        return stats;
+    if (!local_registers_fit())
+    {
+        std::cerr << "The csg tree needs more registers than fit in local memory, the march is not counted.\n";
+        return stats;
+    }
+    try
+    {
+        // Always interprets the render data, the counts are the same for the compiled kernels.
+        size_t nPixels = s_winW * s_winH;
+        cl::Buffer counts(s_context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, nPixels * sizeof(cl_uint4));
+        viewer_data vdata
+        {
+            camera::distance(), camera::theta(), camera::phi(),
+            camera::target(),
+            s_minBounds,
+            s_maxBounds
+        };
+        cl_float16 view = {};
+        std::memcpy(&view, &vdata, sizeof(vdata));
+        prepare_cone(view);
+        cl::EnqueueArgs args(s_queue, cl::NDRange(s_winW, s_winH), cl::NDRange(work_group_size(s_numCurrentRegisters), 1ULL));
+        {
+            std::lock_guard<std::mutex> bakeLock(s_bakeMutex);
+            baked_field& bake = current_bake();
+            (*s_marchStatsKernel)(args, counts, s_packedBuf, s_typeBuf, s_offsetBuf, s_regBuf,
+                (cl_uint)s_numCurrentEntities, s_opStepBuf, (cl_uint)s_opStepCount, s_cullBuf, (cl_uint)s_cullCount,
+                s_sceneBounds, s_lipschitz, view, s_coneBuf, bake.coarse, bake.bricks, bake.atlas, bake.bake,
+                (cl_uchar)lod);
+        }
+        std::vector<cl_uint4> host(nPixels);
+        s_queue.enqueueReadBuffer(counts, CL_TRUE, 0, nPixels * sizeof(cl_uint4), host.data());
+        for (const cl_uint4& c : host)
+        {
+            stats.rays += c.s[0];
+            stats.marchedRays += c.s[1];
+            stats.iterations += c.s[2];
+            stats.evaluations += c.s[3];
+        }
+    }
+    CATCH_EXIT_CL_ERR;
+    return stats;
+}
+
+entities::ent_ref viewer::shown_entity()
+{
+    return s_shownEntity;
+}
+
+void viewer::clear()
+{
+    add_render_data(nullptr, 0, nullptr, nullptr, 0, nullptr, 0);
+}
+
+void viewer::device_info(std::string& platform, std::string& device, std::string& driver)
+{
+    platform = cl::Platform(s_device.getInfo<CL_DEVICE_PLATFORM>()).getInfo<CL_PLATFORM_NAME>();
+    device = s_device.getInfo<CL_DEVICE_NAME>();
+    driver = s_device.getInfo<CL_DRIVER_VERSION>();
+}
+
 void viewer::update_LOD()
 {
     if (s_levelOfDetail)
+    {
         s_levelOfDetail--;
+        s_refining = true;
+    }
+    else
+        s_refining = false; // Converged, the next frame traces every pixel again.
 }
 
 void viewer::reset_LOD()
 {
     s_levelOfDetail = s_lowestLOD;
+    s_refining = false;
 }
 
 bool viewer::exportframe(const std::string& path)
 {
     try
     {
-        size_t nPixels = WIN_W * WIN_H;
+        size_t nPixels = s_winW * s_winH;
         std::vector<uint8_t> pdata(nPixels * 4); // 4 channels per pixel.
+        if (s_headless)
+        {
+            render_headless();
+            s_queue.enqueueReadBuffer(s_frames[s_lastFrame].pixels, true, 0, nPixels * sizeof(uint32_t), pdata.data());
+        }
+        else
         {
-            cl_mem mem = s_pBuffer();
             pause_render_loop();
+            // The latest frame may still be in flight, or wait for the bands of the helpers.
+            composite_bands();
+            s_queue.finish();
+            cl::ImageGL& image = s_frames[s_lastFrame].image;
+            cl_mem mem = image();
             clEnqueueAcquireGLObjects(s_queue(), 1, &mem, 0, 0, 0);
-            s_queue.enqueueReadBuffer(s_pBuffer, true, 0, nPixels * sizeof(uint32_t), pdata.data());
+            s_queue.enqueueReadImage(image, true, frame_origin(), frame_region(), 0, 0, pdata.data());
             clEnqueueReleaseGLObjects(s_queue(), 1, &mem, 0, 0, 0);
             resume_render_loop();
         }
-        bgil::rgba8_image_t img(WIN_W, WIN_H);
+        bgil::rgba8_image_t img(s_winW, s_winH);
         auto dataIt = pdata.cbegin();
         // We need the flipped view because the y-axis in boost goes from bottom to top.
         auto flippedView = bgil::flipped_up_down_view(bgil::view(img));
@@ -522,6 +1451,10 @@ bool viewer::exportframe(const std::string& path)
         {
             bgil::write_view(path, bgil::view(img), bgil::bmp_tag{});
         }
+        else if (check_format(path, ".png"))
+        {
+            bgil::write_view(path, bgil::view(img), bgil::png_tag{});
+        }
         else
         {
             std::cerr << "Cannot export this format." << std::endl;
@@ -533,14 +1466,251 @@ bool viewer::exportframe(const std::string& path)
     CATCH_EXIT_CL_ERR;
 }
 
+static cl::size_t<3> image_region(size_t width, size_t height, size_t depth)
+{
+    cl::size_t<3> region;
+    region[0] = width;
+    region[1] = height;
+    region[2] = depth;
+    return region;
+}
+
+/**
+ * \brief Uploads a brick map from the baker thread. The images are new for every generation, and
+ * later layers are written in order with the frames tracing the earlier ones, so a frame never sees
+ * a brick before its samples.
+ */
+static void publish_bake(const field_bake::brick_map& map)
+{
+    try
+    {
+        baked_field field;
+        {
+            std::lock_guard<std::mutex> lock(s_bakeMutex);
+            if (map.generation != s_bakeGeneration)
+                return;
+            if (map.layer != field_bake::NO_LAYER)
+                field = s_baked;
+        }
+        if (map.layer == field_bake::NO_LAYER)
+        {
+            field.generation = map.generation;
+            field.bake = { { map.min.x, map.min.y, map.min.z, map.cellSize } };
+            cl::ImageFormat sample(CL_R, CL_FLOAT);
+            field.coarse = cl::Image3D(s_context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, sample,
+                map.cells[0] + 1, map.cells[1] + 1, map.cells[2] + 1);
+            s_queue.enqueueWriteImage(field.coarse, CL_TRUE, frame_origin(),
+                image_region(map.cells[0] + 1, map.cells[1] + 1, map.cells[2] + 1), 0, 0, map.coarse.data());
+            field.bricks = cl::Image3D(s_context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
+                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT16), map.cells[0], map.cells[1], map.cells[2]);
+            field.atlas = map.layers ? cl::Image3D(s_context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, sample,
+                field_bake::ATLAS_BRICKS * field_bake::BRICK_SIZE, field_bake::ATLAS_BRICKS * field_bake::BRICK_SIZE,
+                map.layers * field_bake::BRICK_SIZE) : s_noBake.atlas;
+        }
+        else
+        {
+            cl::size_t<3> origin = frame_origin();
+            origin[2] = map.layer * field_bake::BRICK_SIZE;
+            size_t width = field_bake::ATLAS_BRICKS * field_bake::BRICK_SIZE;
+            s_queue.enqueueWriteImage(field.atlas, CL_TRUE, origin, image_region(width, width, field_bake::BRICK_SIZE),
+                0, 0, map.layerSamples.data());
+        }
+        // The bricks of the layer are marked as baked after their samples are written.
+        s_queue.enqueueWriteImage(field.bricks, CL_TRUE, frame_origin(),
+            image_region(map.cells[0], map.cells[1], map.cells[2]), 0, 0, map.index.data());
+        std::lock_guard<std::mutex> lock(s_bakeMutex);
+        if (map.generation == s_bakeGeneration)
+            s_baked = field;
+    }
+    catch (cl::Error err)
+    {
+        std::cerr << "OpenCL Error: " << viewer::cl_err_str(err.err()) << " when uploading the baked field" << std::endl;
+    }
+}
+
+/**
+ * \brief Stops tracing with the baked field, which no longer matches the render data or the bounds,
+ * and abandons its bake. Must be called before the render data on the device changes.
+ */
+static void invalidate_bake()
+{
+    std::lock_guard<std::mutex> lock(s_bakeMutex);
+    s_bakeGeneration++;
+    s_baked = baked_field();
+    if (s_baker)
+        s_baker->cancel(s_bakeGeneration);
+}
+
+/**
+ * \brief Bakes the field of the render data inside the bounds in the background, if baking is enabled.
+ */
+static void request_bake()
+{
+    // The render thread applies parameter patches to the render data under the same lock.
+    std::lock_guard<std::mutex> lock(s_bakeMutex);
+    if (!s_bakeEnabled || !s_baker || s_hostProgram.types.empty())
+        return;
+    // The rays are clipped to both boxes.
+    cpu_eval::aabb box = {
+        glm::max(s_minBounds, glm::vec3(s_sceneBounds.s[0], s_sceneBounds.s[1], s_sceneBounds.s[2])),
+        glm::min(s_maxBounds, glm::vec3(s_sceneBounds.s[4], s_sceneBounds.s[5], s_sceneBounds.s[6])) };
+    if (box.min.x >= box.max.x || box.min.y >= box.max.y || box.min.z >= box.max.z)
+        return; // Nothing is solid.
+    s_baker->request(s_bakeGeneration, s_hostProgram, s_lipschitz, box);
+}
+
 void viewer::setbounds(float(&bounds)[6])
 {
-    s_minBounds.x = bounds[0];
-    s_minBounds.y = bounds[1];
-    s_minBounds.z = bounds[2];
-    s_maxBounds.x = bounds[3];
-    s_maxBounds.y = bounds[4];
-    s_maxBounds.z = bounds[5];
+    invalidate_bake();
+    {
+        // Read by request_bake on the render thread.
+        std::lock_guard<std::mutex> lock(s_bakeMutex);
+        s_minBounds.x = bounds[0];
+        s_minBounds.y = bounds[1];
+        s_minBounds.z = bounds[2];
+        s_maxBounds.x = bounds[3];
+        s_maxBounds.y = bounds[4];
+        s_maxBounds.z = bounds[5];
+    }
+    request_bake();
+}
+
+void viewer::getbounds(float(&bounds)[6])
+{
+    bounds[0] = s_minBounds.x;
+    bounds[1] = s_minBounds.y;
+    bounds[2] = s_minBounds.z;
+    bounds[3] = s_maxBounds.x;
+    bounds[4] = s_maxBounds.y;
+    bounds[5] = s_maxBounds.z;
+}
+
+void viewer::upscale_mode(bool flag)
+{
+    s_smoothUpscale = flag;
+}
+
+void viewer::bake_mode(bool flag)
+{
+    if (flag && !s_bakeFormats)
+        throw "The device cannot sample the baked field from 3d images";
+    if (flag && !s_baker)
+        s_baker.reset(new field_bake::baker(publish_bake));
+    {
+        std::lock_guard<std::mutex> lock(s_bakeMutex);
+        s_bakeEnabled = flag;
+    }
+    invalidate_bake();
+    request_bake();
+}
+
+void viewer::jit_mode(bool flag)
+{
+    s_jitEnabled = flag;
+}
+
+void viewer::tune_mode(bool flag)
+{
+    s_tuneEnabled = flag;
+    set_work_group_size();
+}
+
+void viewer::list_devices()
+{
+    std::vector<cl::Device> devices = split_frame::all_devices();
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        std::cout << i << ": " << split_frame::describe(devices[i]);
+        if (devices[i]() == s_device())
+            std::cout << " (presenting)";
+        for (const auto& helper : s_helpers)
+        {
+            if (devices[i]() == helper->device()())
+                std::cout << " (tracing bands)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+void viewer::use_devices(const std::vector<size_t>& indices)
+{
+    std::vector<cl::Device> devices = split_frame::all_devices();
+    for (size_t index : indices)
+    {
+        if (index >= devices.size())
+            throw "There is no device with this index, see devices()";
+    }
+    // Build before pausing, so the current frame keeps rendering meanwhile.
+    std::vector<std::unique_ptr<split_frame::helper>> helpers;
+    for (size_t index : indices)
+    {
+        const cl::Device& device = devices[index];
+        if (device() == s_device())
+            continue; // Already traces the first band.
+        try
+        {
+            helpers.emplace_back(new split_frame::helper(device, s_renderSource, s_buildOptions));
+        }
+        catch (cl::Error error)
+        {
+            std::cerr << "Error - " << error.err() << " when building the kernel program for "
+                << split_frame::describe(device) << ", the device is not used." << std::endl;
+        }
+    }
+    pause_render_loop();
+    try
+    {
+        // By the old helpers, which may still be reading them back.
+        composite_bands();
+        s_queue.finish();
+        s_helpers = std::move(helpers);
+        for (auto& helper : s_helpers)
+        {
+            helper->resize(s_winW, s_winH);
+            helper->upload(s_hostProgram.bytes, s_hostProgram.types, s_hostProgram.offsets, s_hostProgram.steps,
+                s_cullsHost, s_sceneBounds, s_lipschitz);
+        }
+        reset_bands();
+        // The bands only change with a new view.
+        reset_LOD();
+    }
+    CATCH_EXIT_CL_ERR;
+    resume_render_loop();
+}
+
+/**
+ * \brief The interpreter to use for a tree needing the given number of registers.
+ */
+static trace_kernel* interpreter(size_t nRegisters)
+{
+    return s_privateStack && s_privateKernel && nRegisters <= PRIVATE_STACK_SIZE ? s_privateKernel : s_interpKernel;
+}
+
+void viewer::private_stack_mode(bool flag)
+{
+    if (flag && !s_privateKernel)
+    {
+        try
+        {
+            program_cache::build(s_context, s_device, s_renderSource,
+                s_buildOptions + " -D PRIVATE_STACK -D PRIVATE_STACK_SIZE=" + std::to_string(PRIVATE_STACK_SIZE),
+                s_privateProgram);
+            s_privateKernel = new trace_kernel(s_privateProgram, "k_trace");
+        }
+        catch (cl::Error error)
+        {
+            std::cerr << "Error - " << error.err() << " when building the private stack kernel. Error log: " << std::endl;
+            std::cerr << s_privateProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(s_device) << std::endl;
+            throw "Cannot build the private stack kernel";
+        }
+    }
+    pause_render_loop();
+    s_privateStack = flag;
+    // Compiled kernels are left alone, only switch between the interpreters.
+    if (s_kernel == s_interpKernel || s_kernel == s_privateKernel)
+        s_kernel = interpreter(s_numCurrentRegisters);
+    set_work_group_size();
+    resume_render_loop();
 }
 
 void viewer::adaptive_rendermode(uint8_t lod)
@@ -567,59 +1737,97 @@ void viewer::debugstep()
 }
 #endif // CLDEBUG
 
-void viewer::init_ocl()
+static void find_any_device(cl::Platform& platform, std::vector<cl::Device>& devices)
+{
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    // Prefer GPUs, but any device will do, for example a CPU device provided by pocl.
+    for (cl_device_type type : { (cl_device_type)CL_DEVICE_TYPE_GPU, (cl_device_type)CL_DEVICE_TYPE_ALL })
+    {
+        for (const cl::Platform& p : platforms)
+        {
+            try
+            {
+                p.getDevices(type, &devices);
+            }
+            catch (cl::Error)
+            {
+                devices.clear();
+            }
+            if (!devices.empty())
+            {
+                platform = p;
+                return;
+            }
+        }
+    }
+}
+
+void viewer::init_ocl(bool headless)
 {
     try
     {
-        cl::Platform platform = cl::Platform::getDefault();
-        #ifdef _WIN32
-        cl_context_properties props[] =
+        s_headless = headless;
+        cl::Platform platform;
+        std::vector<cl::Device> devices;
+        std::vector<cl_context_properties> props;
+        if (s_headless)
         {
-            CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-            CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-            CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
-            0
-        };
-        #else
-        cl_context_properties props[] =
+            find_any_device(platform, devices);
+            props = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0 };
+        }
+        else
         {
-            CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(), 
-            CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(), 
-            CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
-            0
-        };
-        #endif
-        std::vector<cl::Device> devices;
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+            platform = cl::Platform::getDefault();
+#ifdef _WIN32
+            props =
+            {
+                CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+                CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+                CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
+                0
+            };
+#else
+            props =
+            {
+                CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
+                CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+                CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
+                0
+            };
+#endif
+            platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+        }
         if (devices.empty())
         {
             std::cerr << "No devices found" << std::endl;
             exit(1);
         }
-        s_context = cl::Context(devices[0], props);
-        s_queue = cl::CommandQueue(s_context, devices[0]);
-        s_program = cl::Program(s_context, cl_kernel_sources::render_kernel(), false);
-        std::string optionStr = "-I \"" + cl_kernel_sources::abs_path() + "\"";
+        std::cout << "\tUsing device: " << devices[0].getInfo<CL_DEVICE_NAME>() << std::endl;
+        s_device = devices[0];
+        s_glEvents = s_device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_gl_event") != std::string::npos;
+        s_context = cl::Context(devices[0], props.data());
+        s_queue = cl::CommandQueue(s_context, devices[0], CL_QUEUE_PROFILING_ENABLE);
+        s_renderSource = cl_kernel_sources::render_kernel();
+        s_buildOptions = "";
 #ifdef CLDEBUG
-        optionStr += " -D CLDEBUG";
+        s_buildOptions += " -D CLDEBUG";
 #endif // CLDEBUG
         try
         {
-            s_program.build(optionStr.c_str());
+            program_cache::build(s_context, s_device, s_renderSource, s_buildOptions, s_program);
 
-            s_kernel = new cl::make_kernel<
-                cl::BufferGL&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg,
-                cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uchar
-#ifdef CLDEBUG
-                , cl_uint2
-#endif // CLDEBUG
-            >(s_program, "k_trace");
+            s_interpKernel = new trace_kernel(s_program, "k_trace");
+            s_kernel = s_interpKernel;
 
-            s_repeatPixelKernel = new cl::make_kernel<cl::BufferGL&, cl_uchar>(s_program, "k_repeatPixels");
+            s_marchStatsKernel = new march_stats_kernel(s_program, "k_marchStats");
+            s_reprojectKernel = new cl::make_kernel<cl::Buffer&, cl::Buffer&, cl_float16, cl_float16, cl_uint2>(
+                s_program, "k_reproject");
+            s_coneKernel = new cone_kernel(s_program, "k_coneMarch");
         }
         catch (cl::Error error)
         {
-            std::string log = s_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(cl::Device::getDefault());
+            std::string log = s_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
             std::cerr << "Error - " << error.err() << " when building the kernel program. Error log: " << std::endl;
             std::cerr << log << std::endl;
         }
@@ -627,90 +1835,146 @@ void viewer::init_ocl()
         s_maxBufSize = s_globalMemSize / 32;
         s_localMemSize = devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
         s_constMemSize = devices[0].getInfo< CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
-        s_maxLocalBufSize = s_localMemSize / 4;
-        s_valueBuf = cl::Local(s_maxLocalBufSize);
+        s_maxLocalBufSize = s_localMemSize / 2;
         s_regBuf = cl::Local(s_maxLocalBufSize);
+        s_unusedLocalBuf = cl::Local(sizeof(float));
         s_maxWorkGroupSize = devices[0].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
         viewer::set_work_group_size();
+        std::vector<cl::ImageFormat> formats;
+        s_context.getSupportedImageFormats(CL_MEM_READ_ONLY, CL_MEM_OBJECT_IMAGE3D, &formats);
+        auto supported = [&formats](cl_uint order, cl_uint type) {
+            return std::any_of(formats.begin(), formats.end(), [=](const cl::ImageFormat& format) {
+                return format.image_channel_order == order && format.image_channel_data_type == type;
+            });
+        };
+        s_bakeFormats = supported(CL_R, CL_FLOAT) && supported(CL_RGBA, CL_UNSIGNED_INT16);
+        // Never sampled, the kernel only needs some image for every argument.
+        s_noBake.coarse = cl::Image3D(s_context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS,
+            cl::ImageFormat(CL_RGBA, CL_FLOAT), 2, 2, 2);
+        s_noBake.bricks = s_noBake.coarse;
+        s_noBake.atlas = s_noBake.coarse;
     }
     CATCH_EXIT_CL_ERR;
 }
 
 void viewer::init_buffers()
 {
-    // Initialize the pixel buffer object.
-    if (s_pboId)
+    // Initialize the frame textures.
+    for (frame_target& frame : s_frames)
     {
-        GL_CALL(clReleaseMemObject(s_pBuffer()));
-        GL_CALL(glDeleteBuffers(1, &s_pboId));
+        frame.pixels = cl::Buffer();
+        frame.image = cl::ImageGL();
+        frame.done = cl::Event();
+        frame.pending = false;
+        frame.step = 1;
+        if (frame.texture)
+        {
+            GL_CALL(glDeleteTextures(1, &frame.texture));
+            frame.texture = 0;
+        }
     }
-
-    std::vector<uint32_t> temp(WIN_W * WIN_H);
-    std::generate(temp.begin(), temp.end(), []() { return (uint32_t)std::rand(); });
-
-    GL_CALL(glGenBuffers(1, &s_pboId));
-    GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pboId));
-    GL_CALL(glBufferData(GL_PIXEL_UNPACK_BUFFER, WIN_W * WIN_H * sizeof(uint32_t), temp.data(), GL_STREAM_DRAW));
-    GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    s_frameIndex = 0;
+    s_lastFrame = 0;
 
     try
     {
-        cl_int err = 0;
-        s_pBuffer = cl::BufferGL(s_context, CL_MEM_WRITE_ONLY, s_pboId, &err);
-        if (err)
+        for (frame_target& frame : s_frames)
         {
-            std::cerr << "OpenCL Error" << std::endl;
-            exit(1);
+            cl_int err = 0;
+            if (s_headless)
+                frame.pixels = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, s_winW * s_winH * sizeof(uint32_t), nullptr, &err);
+            else
+            {
+                std::vector<uint32_t> temp(s_winW * s_winH);
+                std::generate(temp.begin(), temp.end(), []() { return (uint32_t)std::rand(); });
+                GL_CALL(glGenTextures(1, &frame.texture));
+                GL_CALL(glBindTexture(GL_TEXTURE_2D, frame.texture));
+                GL_CALL(glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, s_winW, s_winH));
+                GL_CALL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, s_winW, s_winH, GL_RGBA, GL_UNSIGNED_BYTE, temp.data()));
+                // The shader only fetches texels, but the texture must be complete without mipmaps.
+                GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+                GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+                GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+                frame.image = cl::ImageGL(s_context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, frame.texture, &err);
+            }
+            if (err)
+            {
+                std::cerr << "OpenCL Error" << std::endl;
+                exit(1);
+            }
         }
 
+        s_accumBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(uint32_t));
+        s_depthBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(float));
+        s_reprojBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, s_winW * s_winH * sizeof(float));
+        s_depthValid = false;
+        s_coneBuf = cl::Buffer(s_context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            ((s_winW + CONE_TILE - 1) / CONE_TILE) * ((s_winH + CONE_TILE - 1) / CONE_TILE) * sizeof(float));
+        s_coneValid = false;
         s_packedBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
         s_typeBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
         s_offsetBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
         s_opStepBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
-        s_viewerDataBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, 12 * sizeof(float));
+        s_cullBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, sizeof(cull_range));
+        s_cullCount = 0;
+        for (auto& helper : s_helpers)
+            helper->resize(s_winW, s_winH);
+        reset_bands();
     }
     CATCH_EXIT_CL_ERR;
 }
 
+static const char* kernel_name()
+{
+    return s_kernel == s_interpKernel ? "interpreter" : s_kernel == s_privateKernel ? "private stack" : "compiled";
+}
+
+static void update_kernel_info()
+{
+    frame_stats::kernel_info info;
+    info.name = kernel_name();
+    info.privateMemSize = (size_t)s_kernel->getKernel().getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(s_device);
+    info.localMemSize = (size_t)s_kernel->getKernel().getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(s_device);
+    info.workGroupSize = s_traceShape.x * s_traceShape.y;
+    info.numRegisters = s_numCurrentRegisters;
+    frame_stats::set_kernel_info(info);
+}
+
 void viewer::set_work_group_size()
 {
-    if (s_numCurrentEntities > MAX_ENTITY_COUNT)
-    {
-        throw "too many entities";
-    }
-    size_t nEntities = std::max((uint64_t)1ULL, (uint64_t)s_numCurrentEntities);
-    std::vector<size_t> factors;
-    auto fIter = std::back_inserter(factors);
-    size_t width = (size_t)WIN_W;
-    util::factorize(width, fIter);
-    std::sort(factors.begin(), factors.end());
-    s_workGroupSize =
-        std::min(width, std::min(
-            s_maxWorkGroupSize,
-            (size_t)std::ceil(s_maxLocalBufSize / (sizeof(float) * nEntities))));
-    if (width % s_workGroupSize)
+    s_tunePending = false;
+    s_tune = tune_state();
+    if (!s_kernel)
+        return;
+    // Rows of pixels, which is what the kernel falls back to if nothing better is found.
+    s_traceShape = { (uint32_t)work_group_size(s_kernel == s_interpKernel ? s_numCurrentRegisters : 1), 1,
+        work_group_tuner::ORDER_ROWS };
+    s_tuneKey = work_group_tuner::key(s_device, kernel_name(), s_numCurrentRegisters, s_opStepCount);
+    if (s_tuneEnabled)
     {
-        size_t newSize = width;
-        for (size_t f : factors)
-        {
-            newSize /= f;
-            if (newSize <= s_workGroupSize) break;
-        }
-        s_workGroupSize = newSize;
+        work_group_tuner::shape tuned;
+        if (work_group_tuner::lookup(s_tuneKey, tuned) && tuned.x * tuned.y <= max_group_size())
+            s_traceShape = tuned;
+        else
+            s_tunePending = true;
     }
+    update_kernel_info();
 }
 
 void viewer::pause_render_loop()
 {
-    std::lock_guard<std::mutex> lock(s_mutex);
+    std::unique_lock<std::mutex> lock(s_mutex);
     s_pauseRender = true;
+    // Waits for the frame being rendered, unless that is the caller, e.g. a handler of the window's events.
+    if (std::this_thread::get_id() != s_renderThread)
+        s_cv.wait(lock, [] { return !s_rendering; });
 }
 
 void viewer::resume_render_loop()
 {
     std::lock_guard<std::mutex> lock(s_mutex);
     s_pauseRender = false;
-    s_cv.notify_one();
+    s_cv.notify_all();
 }
 
 template <typename T>
@@ -724,21 +1988,226 @@ void write_buf(cl::Buffer& buffer, T* data, size_t size)
     }
     if (nBytes == 0) return;
 
-    s_queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size * sizeof(T), data);
+    cl::Event written;
+    s_queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size * sizeof(T), data, nullptr, &written);
+    profile("upload", written);
 };
 
+/**
+ * \brief Recomputes the box around the solid, the cull ranges and the Lipschitz bound from the
+ * host copies of the render data and the boxes of its steps. Only the host side, the callers upload them.
+ */
+static void update_bounds()
+{
+    s_cullsHost = s_hostBoxes.cull_ranges(s_hostProgram);
+    cpu_eval::aabb box = s_hostBoxes.solid_bounds(s_hostProgram);
+    s_sceneBounds = { { box.min.x, box.min.y, box.min.z, 0.0f, box.max.x, box.max.y, box.max.z, 0.0f } };
+    s_lipschitz = s_hostProgram.lipschitz_bound();
+}
+
+/**
+ * \brief Writes s_cullsHost to s_cullBuf. The number of ranges depends on the parameters too, e.g. on
+ * whether a blend radius is zero, so a new buffer is made whenever it changes. The frames in flight keep
+ * the buffer that matches the count they were enqueued with.
+ * \param writes If not null, the write doesn't wait and its event is added here.
+ */
+static void upload_culls(std::vector<cl::Event>* writes)
+{
+    size_t nBytes = s_cullsHost.size() * sizeof(cull_range);
+    if (nBytes > s_maxBufSize)
+    {
+        std::cerr << "Device buffer overflow... terminating application" << std::endl;
+        exit(1);
+    }
+    if (s_cullsHost.size() != s_cullCount)
+    {
+        s_cullBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY,
+            std::max(nBytes, sizeof(cull_range)));
+        s_cullCount = s_cullsHost.size();
+    }
+    if (!writes)
+    {
+        write_buf(s_cullBuf, s_cullsHost.data(), s_cullsHost.size());
+        return;
+    }
+    if (nBytes == 0)
+        return;
+    writes->emplace_back();
+    s_queue.enqueueWriteBuffer(s_cullBuf, CL_FALSE, 0, nBytes, s_cullsHost.data(), nullptr, &writes->back());
+    profile("upload", writes->back());
+}
+
+/**
+ * \brief Applies the parameter changes queued by set_param. Only the changed bytes and steps, and the
+ * cull ranges, are written, without waiting for the frames in flight. The writes are queued in order
+ * with the frames, and the host copies they read are left alone until they finish.
+ */
+static void apply_patches()
+{
+    std::vector<param_patch> patches;
+    {
+        std::lock_guard<std::mutex> lock(s_patchMutex);
+        patches.swap(s_patches);
+    }
+    if (patches.empty())
+        return;
+    if (!s_patchWrites.empty())
+        cl::Event::waitForEvents(s_patchWrites);
+    s_patchWrites.clear();
+    invalidate_bake();
+    std::vector<std::pair<size_t, size_t>> byteRanges;
+    std::vector<size_t> changedSteps;
+    {
+        // request_bake copies the render data, bounds and Lipschitz bound under this lock on the Lua thread.
+        std::lock_guard<std::mutex> lock(s_bakeMutex);
+        for (const param_patch& patch : patches)
+        {
+            if (patch.simple)
+            {
+                size_t offset = s_hostProgram.offsets[patch.slot];
+                std::copy(patch.bytes.begin(), patch.bytes.end(), s_hostProgram.bytes.begin() + offset);
+                // Only the boxes of the steps using the entity change.
+                s_hostBoxes.entity_changed(s_hostProgram, patch.slot);
+                byteRanges.push_back({ offset, patch.bytes.size() });
+            }
+            else
+            {
+                s_hostProgram.steps[patch.slot].op = patch.op;
+                s_hostBoxes.step_changed(s_hostProgram, patch.slot);
+                changedSteps.push_back(patch.slot);
+            }
+        }
+        update_bounds();
+    }
+    for (const auto& [offset, size] : byteRanges)
+    {
+        s_patchWrites.emplace_back();
+        s_queue.enqueueWriteBuffer(s_packedBuf, CL_FALSE, offset, size, s_hostProgram.bytes.data() + offset,
+            nullptr, &s_patchWrites.back());
+        profile("upload", s_patchWrites.back());
+    }
+    for (size_t si : changedSteps)
+    {
+        s_patchWrites.emplace_back();
+        s_queue.enqueueWriteBuffer(s_opStepBuf, CL_FALSE, si * sizeof(op_step) + offsetof(op_step, op),
+            sizeof(op_defn), &s_hostProgram.steps[si].op, nullptr, &s_patchWrites.back());
+        profile("upload", s_patchWrites.back());
+    }
+    upload_culls(&s_patchWrites);
+    for (auto& helper : s_helpers)
+    {
+        helper->patch(s_hostProgram.bytes, s_hostProgram.steps, byteRanges, changedSteps, s_cullsHost,
+            s_sceneBounds, s_lipschitz);
+    }
+    viewer::reset_LOD();
+    s_depthValid = false; // The surface may have moved closer.
+    s_coneValid = false;
+    request_bake();
+}
+
+/**
+ * \brief Finds or builds the kernel compiled for the structure of the given render data.
+ * Returns nullptr if the kernel cannot be built, in which case the interpreter is used.
+ */
+static trace_kernel* jit_kernel(uint8_t* types, uint32_t* offsets, size_t nEntities, op_step* steps, size_t nSteps)
+{
+    uint64_t hash = kernel_jit::structural_hash(offsets, types, nEntities, steps, nSteps);
+    std::string source = kernel_jit::generate(offsets, types, nEntities, steps, nSteps);
+    auto match = s_jitCache.find(hash);
+    if (match != s_jitCache.end() && match->second.source == source)
+    {
+        s_jitOrder.erase(std::find(s_jitOrder.begin(), s_jitOrder.end(), hash));
+        s_jitOrder.push_back(hash);
+        return match->second.kernel.get();
+    }
+
+    jit_program jit;
+    jit.source = source;
+    try
+    {
+        program_cache::build(s_context, s_device, cl_kernel_sources::expand_includes(source) + s_renderSource,
+            s_buildOptions, jit.program);
+        jit.kernel.reset(new trace_kernel(jit.program, "k_trace"));
+    }
+    catch (cl::Error error)
+    {
+        std::cerr << "Error - " << error.err() << " when compiling the csg tree, using the interpreter. Error log: " << std::endl;
+        std::cerr << jit.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(s_device) << std::endl;
+        return nullptr;
+    }
+
+    if (match != s_jitCache.end())
+    {
+        // Hash collision, replace the old program.
+        s_jitOrder.erase(std::find(s_jitOrder.begin(), s_jitOrder.end(), hash));
+        s_jitCache.erase(match);
+    }
+    else if (s_jitCache.size() >= JIT_CACHE_SIZE)
+    {
+        // The least recently used kernel that is not currently in use.
+        auto oldest = std::find_if(s_jitOrder.begin(), s_jitOrder.end(),
+            [](uint64_t key) { return s_jitCache[key].kernel.get() != s_kernel; });
+        if (oldest != s_jitOrder.end())
+        {
+            s_jitCache.erase(*oldest);
+            s_jitOrder.erase(oldest);
+        }
+    }
+    s_jitOrder.push_back(hash);
+    trace_kernel* kernel = jit.kernel.get();
+    s_jitCache.emplace(hash, std::move(jit));
+    return kernel;
+}
+
 void viewer::add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities, op_step* steps, size_t nSteps)
 {
     try
     {
+        // Compile before pausing, so the current frame keeps rendering meanwhile.
+        trace_kernel* kernel = s_jitEnabled ? jit_kernel(types, offsets, nEntities, steps, nSteps) : nullptr;
+        size_t nRegisters = 0;
+        for (size_t i = 0; i < nSteps; i++)
+            nRegisters = std::max(nRegisters, (size_t)steps[i].dest + 1);
+        if (!kernel)
+            kernel = interpreter(nRegisters);
+        // The local memory interpreter needs the registers of at least one work item in local memory.
+        if (kernel == s_interpKernel && nRegisters * sizeof(float) > s_maxLocalBufSize)
+            throw "The csg tree needs more registers than fit in local memory";
         pause_render_loop();
+        invalidate_bake();
+        s_kernel = kernel;
         write_buf(s_packedBuf, bytes, nBytes);
         write_buf(s_typeBuf, types, nEntities);
         write_buf(s_offsetBuf, offsets, nEntities);
         write_buf(s_opStepBuf, steps, nSteps);
+        // The writes above are blocking, so no partial upload is reading the old host copies anymore.
+        s_patchWrites.clear();
+        {
+            // Queued changes refer to the entities and steps of the old data.
+            std::lock_guard<std::mutex> lock(s_patchMutex);
+            s_patches.clear();
+        }
+        s_hostProgram = cpu_eval::program(bytes, nBytes, offsets, types, nEntities, steps, nSteps);
+        s_hostBoxes = cpu_eval::step_boxes(s_hostProgram);
+        update_bounds();
+        upload_culls(nullptr);
+        // The helpers get all the render data again, it is small next to a frame.
+        for (auto& helper : s_helpers)
+        {
+            helper->upload(s_hostProgram.bytes, s_hostProgram.types, s_hostProgram.offsets, s_hostProgram.steps,
+                s_cullsHost, s_sceneBounds, s_lipschitz);
+        }
+        s_shownEntity.reset();
+        s_shownSlots.clear();
         s_numCurrentEntities = nEntities;
+        s_numCurrentRegisters = nRegisters;
         s_opStepCount = nSteps;
         set_work_group_size();
+        // The coarse pixels that are already traced, and their hits, show the old data.
+        reset_LOD();
+        s_depthValid = false;
+        s_coneValid = false;
+        request_bake();
 
         // Resume the render loop.
         resume_render_loop();
@@ -756,15 +2225,43 @@ void viewer::show_entity(entities::ent_ref entity)
     std::vector<op_step> steps(nSteps);
 
     // Copy the render data into these buffers.
+    std::unordered_map<const entities::entity*, uint32_t> slots;
     {
         uint8_t* bptr = bytes.data();
         uint32_t* optr = offsets.data();
         uint8_t* tptr = types.data();
         op_step* sptr = steps.data();
-        entity->copy_render_data(bptr, optr, tptr, sptr);
+        entity->copy_render_data(bptr, optr, tptr, sptr, &slots);
     }
 
     viewer::add_render_data(bytes.data(), nBytes, types.data(), offsets.data(), nEntities, steps.data(), nSteps);
+    s_shownEntity = entity;
+    s_shownSlots = std::move(slots);
+}
+
+void viewer::set_param(entities::ent_ref entity, const std::string& name, float value)
+{
+    if (!entity->set_param(name, value))
+        throw "The entity has no parameter with this name";
+    auto match = s_shownEntity ? s_shownSlots.find(entity.get()) : s_shownSlots.end();
+    if (match == s_shownSlots.end())
+        return; // Not part of the shown entity.
+    if (match->second == entities::NO_SLOT)
+    {
+        // The render data is shared with an identical entity, so the shown tree has to be flattened again.
+        show_entity(s_shownEntity);
+        return;
+    }
+    param_patch patch;
+    patch.slot = match->second;
+    patch.simple = entity->simple();
+    if (patch.simple)
+        static_cast<const entities::simp_entity&>(*entity).render_bytes(patch.bytes);
+    else
+        patch.op = static_cast<const entities::comp_entity&>(*entity).op;
+    // The render thread applies it before its next frame, see apply_patches.
+    std::lock_guard<std::mutex> lock(s_patchMutex);
+    s_patches.push_back(std::move(patch));
 }
 
 bool check_format(const std::string& path, const std::string& ext)
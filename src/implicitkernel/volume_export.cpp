@@ -0,0 +1,257 @@
+#include <implicitkernel/volume_export.h>
+#include <implicitkernel/work_pool.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+using namespace volume_export;
+
+// Tiles per edge of a root node, which is also the height of a slab in tiles.
+static constexpr uint32_t ROOT_TILES = 8;
+static constexpr size_t TILE_SAMPLES = TILE_SIZE * TILE_SIZE * TILE_SIZE;
+static constexpr float QUANT_MAX = 32767.0f;
+
+namespace volume_export
+{
+    struct tile
+    {
+        uint32_t origin[3]; // In tiles.
+        float scale;
+        int16_t values[TILE_SAMPLES];
+    };
+
+    class tile_sampler
+    {
+        const cpu_eval::program& m_program;
+        glm::vec3 m_origin;
+        float m_voxelSize;
+        float m_bandWidth;
+        uint32_t m_numTiles[3];
+        util::work_pool m_pool;
+        std::mutex m_tileMutex;
+        std::vector<std::unique_ptr<tile>> m_tiles; // Of the current slab.
+        size_t m_numSampled;
+
+        struct node
+        {
+            uint32_t origin[3]; // In tiles.
+            uint32_t size; // In tiles.
+            std::shared_ptr<const cpu_eval::program> prog;
+        };
+
+        glm::vec3 sample_point(uint64_t i, uint64_t j, uint64_t k) const
+        {
+            return m_origin + glm::vec3(float(i), float(j), float(k)) * m_voxelSize;
+        }
+
+        /**
+         * \brief Bounds the field inside the samples of the node with interval arithmetic. If the
+         * band can reach into the node, it gets the program specialized for its box and true is returned.
+         */
+        bool specialize(node& nd, const cpu_eval::program& parent) const
+        {
+            glm::vec3 lo = sample_point(uint64_t(nd.origin[0]) * TILE_SIZE, uint64_t(nd.origin[1]) * TILE_SIZE,
+                uint64_t(nd.origin[2]) * TILE_SIZE);
+            glm::vec3 hi = lo + glm::vec3(float(nd.size * TILE_SIZE - 1) * m_voxelSize);
+            cpu_eval::interval bounds;
+            cpu_eval::program prog = parent.specialize(lo, hi, &bounds);
+            if (bounds.lo > m_bandWidth || bounds.hi < -m_bandWidth)
+                return false;
+            nd.prog = std::make_shared<const cpu_eval::program>(std::move(prog));
+            return true;
+        }
+
+        void subdivide(const node& nd)
+        {
+            if (nd.size == 1)
+            {
+                sample_tile(nd);
+                return;
+            }
+            uint32_t half = nd.size / 2;
+            for (uint32_t c = 0; c < 8; c++)
+            {
+                node child = { { nd.origin[0] + ((c & 1) ? half : 0), nd.origin[1] + ((c & 2) ? half : 0),
+                    nd.origin[2] + ((c & 4) ? half : 0) }, half, nullptr };
+                if (child.origin[0] >= m_numTiles[0] || child.origin[1] >= m_numTiles[1] ||
+                    child.origin[2] >= m_numTiles[2] || !specialize(child, *nd.prog))
+                    continue;
+                m_pool.push([this, child]() { subdivide(child); });
+            }
+        }
+
+        /**
+         * \brief Samples the tile and keeps it if any sample is within the band, quantized with the
+         * largest magnitude in the tile.
+         */
+        void sample_tile(const node& nd)
+        {
+            std::vector<float> buf(4 * TILE_SAMPLES);
+            float *x = buf.data(), *y = x + TILE_SAMPLES, *z = y + TILE_SAMPLES, *v = z + TILE_SAMPLES;
+            size_t si = 0;
+            for (uint32_t k = 0; k < TILE_SIZE; k++)
+                for (uint32_t j = 0; j < TILE_SIZE; j++)
+                    for (uint32_t i = 0; i < TILE_SIZE; i++, si++)
+                    {
+                        glm::vec3 p = sample_point(uint64_t(nd.origin[0]) * TILE_SIZE + i,
+                            uint64_t(nd.origin[1]) * TILE_SIZE + j, uint64_t(nd.origin[2]) * TILE_SIZE + k);
+                        x[si] = p.x;
+                        y[si] = p.y;
+                        z[si] = p.z;
+                    }
+            nd.prog->eval(x, y, z, v, TILE_SAMPLES, 1);
+            float largest = 0.0f;
+            bool inBand = false;
+            for (size_t i = 0; i < TILE_SAMPLES; i++)
+            {
+                v[i] = std::max(-m_bandWidth, std::min(m_bandWidth, v[i]));
+                inBand |= std::abs(v[i]) < m_bandWidth;
+                largest = std::max(largest, std::abs(v[i]));
+            }
+            std::unique_ptr<tile> tl;
+            if (inBand)
+            {
+                tl.reset(new tile());
+                std::copy(nd.origin, nd.origin + 3, tl->origin);
+                tl->scale = largest > 0.0f ? largest / QUANT_MAX : 1.0f;
+                for (size_t i = 0; i < TILE_SAMPLES; i++)
+                    tl->values[i] = int16_t(std::lround(v[i] / tl->scale));
+            }
+            std::lock_guard<std::mutex> lock(m_tileMutex);
+            m_numSampled++;
+            if (tl)
+                m_tiles.push_back(std::move(tl));
+        }
+
+    public:
+        tile_sampler(const cpu_eval::program& program, const glm::vec3& origin, float voxelSize, float bandWidth,
+            const uint32_t(&numTiles)[3]) :
+            m_program(program),
+            m_origin(origin),
+            m_voxelSize(voxelSize),
+            m_bandWidth(bandWidth),
+            m_numSampled(0)
+        {
+            std::copy(numTiles, numTiles + 3, m_numTiles);
+        }
+
+        /**
+         * \brief Samples the tiles of one slab of ROOT_TILES layers of tiles, and returns those near
+         * the surface sorted by z, y and x.
+         */
+        std::vector<std::unique_ptr<tile>> sample_slab(uint32_t firstLayer)
+        {
+            m_tiles.clear();
+            for (uint32_t ty = 0; ty < m_numTiles[1]; ty += ROOT_TILES)
+                for (uint32_t tx = 0; tx < m_numTiles[0]; tx += ROOT_TILES)
+                {
+                    m_pool.push([this, tx, ty, firstLayer]() {
+                        node root = { { tx, ty, firstLayer }, ROOT_TILES, nullptr };
+                        if (specialize(root, m_program))
+                            subdivide(root);
+                    });
+                }
+            m_pool.wait();
+            // The workers finish in any order.
+            std::sort(m_tiles.begin(), m_tiles.end(), [](const std::unique_ptr<tile>& a, const std::unique_ptr<tile>& b) {
+                if (a->origin[2] != b->origin[2])
+                    return a->origin[2] < b->origin[2];
+                if (a->origin[1] != b->origin[1])
+                    return a->origin[1] < b->origin[1];
+                return a->origin[0] < b->origin[0];
+            });
+            return std::move(m_tiles);
+        }
+
+        size_t num_sampled() const
+        {
+            return m_numSampled;
+        }
+    };
+}
+
+bool volume_export::export_volume(const entities::ent_ref& entity, const glm::vec3& minBounds,
+    const glm::vec3& maxBounds, float voxelSize, float bandWidth, const std::string& path, volume_stats* stats)
+{
+    if (!(voxelSize > 0.0f) || !(bandWidth > 0.0f))
+    {
+        std::cerr << "The voxel size and the band width must be positive.\n";
+        return false;
+    }
+    glm::vec3 size = maxBounds - minBounds;
+    if (!(size.x > 0.0f && size.y > 0.0f && size.z > 0.0f))
+    {
+        std::cerr << "The bounds of the volume are empty.\n";
+        return false;
+    }
+    file_header header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.tileSize = TILE_SIZE;
+    header.origin[0] = minBounds.x;
+    header.origin[1] = minBounds.y;
+    header.origin[2] = minBounds.z;
+    header.voxelSize = voxelSize;
+    header.bandWidth = bandWidth;
+    uint32_t numTiles[3];
+    static constexpr double MAX_SAMPLES = double(UINT32_MAX - ROOT_TILES * TILE_SIZE);
+    for (int i = 0; i < 3; i++)
+    {
+        double samples = std::ceil(double(size[i]) / voxelSize) + 1.0;
+        if (samples > MAX_SAMPLES)
+        {
+            std::cerr << "The voxel size is too small for the bounds of the volume.\n";
+            return false;
+        }
+        header.samples[i] = uint32_t(samples);
+        numTiles[i] = (header.samples[i] + TILE_SIZE - 1) / TILE_SIZE;
+    }
+    header.tileCount = 0;
+    header.indexOffset = 0;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        std::cerr << "Cannot open " << path << " for writing.\n";
+        return false;
+    }
+    // Patched once the tiles are written.
+    file.write((const char*)&header, sizeof(header));
+
+    cpu_eval::program program(entity);
+    tile_sampler sampler(program, minBounds, voxelSize, bandWidth, numTiles);
+    std::vector<index_entry> index;
+    uint64_t offset = sizeof(header);
+    for (uint32_t tz = 0; tz < numTiles[2] && file; tz += ROOT_TILES)
+    {
+        std::vector<std::unique_ptr<tile>> tiles = sampler.sample_slab(tz);
+        for (const std::unique_ptr<tile>& tl : tiles)
+        {
+            index.push_back({ { tl->origin[0], tl->origin[1], tl->origin[2] }, tl->scale, offset });
+            file.write((const char*)tl->values, sizeof(tl->values));
+            offset += sizeof(tl->values);
+        }
+    }
+    header.tileCount = index.size();
+    header.indexOffset = offset;
+    file.write((const char*)index.data(), index.size() * sizeof(index_entry));
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+    file.close();
+    if (file.fail())
+    {
+        std::cerr << "Failed to write " << path << ".\n";
+        return false;
+    }
+    if (stats)
+    {
+        stats->numTiles = index.size();
+        stats->numSampledTiles = sampler.num_sampled();
+        stats->fileSize = offset + index.size() * sizeof(index_entry);
+    }
+    return true;
+}
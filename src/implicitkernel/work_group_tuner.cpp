@@ -0,0 +1,162 @@
+#include <implicitkernel/program_cache.h>
+#include <implicitkernel/work_group_tuner.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+static constexpr char CACHE_FILE[] = "workgroups.txt";
+// Bump this when the meaning of a stored shape changes, e.g. the mapping in k_trace.
+static constexpr uint32_t TUNER_VERSION = 1;
+
+static std::mutex s_mutex;
+static std::map<std::string, work_group_tuner::shape> s_shapes;
+static bool s_loaded = false;
+
+static bool is_pow2(uint32_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+std::vector<work_group_tuner::shape> work_group_tuner::candidates(size_t maxGroupSize)
+{
+    std::vector<shape> result;
+    for (uint32_t total : { 32u, 64u, 128u, 256u })
+    {
+        if (total > maxGroupSize)
+            break;
+        for (uint32_t y : { 1u, 2u, 4u, 8u, 16u })
+        {
+            uint32_t x = total / y;
+            if (x < 4)
+                break;
+            result.push_back({ x, y, ORDER_ROWS });
+            if (is_pow2(x) && is_pow2(y) && (x == y || x == 2 * y))
+                result.push_back({ x, y, ORDER_MORTON });
+        }
+    }
+    return result;
+}
+
+/**
+ * \brief Bucket of a count, so that similar scenes share the tuned shape.
+ */
+static uint32_t size_class(size_t n)
+{
+    uint32_t bucket = 0;
+    while (n > 1)
+    {
+        n >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+std::string work_group_tuner::key(const cl::Device& device, const std::string& variant, size_t nRegisters, size_t nSteps)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << TUNER_VERSION << '|'
+        << platform.getInfo<CL_PLATFORM_NAME>() << '|'
+        << device.getInfo<CL_DEVICE_NAME>() << '|'
+        << device.getInfo<CL_DRIVER_VERSION>() << '|'
+        << variant << '|'
+        << size_class(nRegisters) << '|'
+        << size_class(nSteps);
+    std::string str = key.str();
+    // Keys are stored one per line, followed by a tab.
+    for (char& c : str)
+    {
+        if (c == '\t' || c == '\n' || c == '\r')
+            c = ' ';
+    }
+    return str;
+}
+
+static fs::path cache_path()
+{
+    std::string dir = program_cache::directory();
+    return dir.empty() ? fs::path() : fs::path(dir) / CACHE_FILE;
+}
+
+/**
+ * \brief Adds the shapes stored in the file to s_shapes, without replacing the ones it has unless told to.
+ */
+static void read_file(const fs::path& path, bool replace)
+{
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line))
+    {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos)
+            continue;
+        std::istringstream values(line.substr(tab + 1));
+        work_group_tuner::shape s;
+        uint32_t order = 0;
+        if (values >> s.x >> s.y >> order && s.x && s.y && order <= work_group_tuner::ORDER_MORTON)
+        {
+            s.order = (work_group_tuner::pixel_order)order;
+            if (replace)
+                s_shapes[line.substr(0, tab)] = s;
+            else
+                s_shapes.emplace(line.substr(0, tab), s);
+        }
+    }
+}
+
+static void load()
+{
+    if (s_loaded)
+        return;
+    s_loaded = true;
+    fs::path path = cache_path();
+    if (!path.empty())
+        read_file(path, true);
+}
+
+bool work_group_tuner::lookup(const std::string& key, shape& result)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    load();
+    auto match = s_shapes.find(key);
+    if (match == s_shapes.end())
+        return false;
+    result = match->second;
+    return true;
+}
+
+void work_group_tuner::store(const std::string& key, const shape& result)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    load();
+    s_shapes[key] = result;
+    fs::path path = cache_path();
+    if (path.empty())
+        return;
+    // Other processes may have stored shapes since the file was loaded, keep them.
+    read_file(path, false);
+    std::error_code err;
+    fs::create_directories(path.parent_path(), err);
+    // Written under a temporary name and renamed, like the cached binaries.
+    fs::path temp = program_cache::temp_path(path.string());
+    {
+        std::ofstream f(temp, std::ios::trunc);
+        if (!f)
+            return;
+        for (const auto& [k, s] : s_shapes)
+            f << k << '\t' << s.x << ' ' << s.y << ' ' << (uint32_t)s.order << '\n';
+        if (!f)
+        {
+            f.close();
+            fs::remove(temp, err);
+            return;
+        }
+    }
+    fs::rename(temp, path, err);
+    if (err)
+        fs::remove(temp, err);
+}
@@ -0,0 +1,127 @@
+#include <implicitkernel/work_pool.h>
+#include <algorithm>
+
+// The pool and the index of the worker running on the current thread, if any.
+static thread_local util::work_pool* t_pool = nullptr;
+static thread_local size_t t_workerIndex = 0;
+
+util::work_pool::work_pool(size_t nThreads) :
+    m_queued(0),
+    m_pending(0),
+    m_nextQueue(0),
+    m_stop(false)
+{
+    if (nThreads == 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < nThreads; i++)
+        m_queues.emplace_back(new worker_queue());
+    for (size_t i = 0; i < nThreads; i++)
+        m_workers.emplace_back(&work_pool::run_worker, this, i);
+}
+
+util::work_pool::~work_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_sleepCv.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+void util::work_pool::push(task t)
+{
+    size_t qi = t_pool == this ? t_workerIndex : (m_nextQueue++ % m_queues.size());
+    m_pending++;
+    {
+        // Counted before it is visible, so that the count never drops below zero.
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_queued++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_queues[qi]->mutex);
+        m_queues[qi]->tasks.push_back(std::move(t));
+    }
+    m_sleepCv.notify_one();
+}
+
+void util::work_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_doneMutex);
+    m_doneCv.wait(lock, [this]() { return m_pending == 0; });
+    if (m_error)
+    {
+        std::exception_ptr err = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(err);
+    }
+}
+
+size_t util::work_pool::size() const
+{
+    return m_workers.size();
+}
+
+bool util::work_pool::pop_task(size_t index, task& t)
+{
+    {
+        // Own queue, newest task first.
+        worker_queue& own = *m_queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    // Steal the oldest task from someone else.
+    for (size_t i = 1; i < m_queues.size(); i++)
+    {
+        worker_queue& other = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty())
+        {
+            t = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void util::work_pool::run_worker(size_t index)
+{
+    t_pool = this;
+    t_workerIndex = index;
+    while (true)
+    {
+        task t;
+        if (pop_task(index, t))
+        {
+            m_queued--;
+            try
+            {
+                t();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(m_doneMutex);
+                if (!m_error)
+                    m_error = std::current_exception();
+            }
+            if (--m_pending == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_doneMutex);
+                m_doneCv.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_sleepCv.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop)
+            return;
+    }
+}
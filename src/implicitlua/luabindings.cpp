@@ -1,4 +1,5 @@
 #include <fstream>
+#include <implicitkernel/frame_stats.h>
 #include <implicitlua/luabindings.h>
 #include <implicitlua/map_macro.h>
 #define LUA_REG_FUNC(lstate, name) lua_register(lstate, #name, name)
@@ -47,6 +48,22 @@ std::string implicit_lua::read_lua<std::string>(lua_State* L, int i)
     return ret;
 }
 
+template <>
+std::vector<int> implicit_lua::read_lua<std::vector<int>>(lua_State* L, int i)
+{
+    if (!lua_istable(L, i))
+        luathrow(L, "Not a table of numbers");
+    std::vector<int> ret;
+    size_t n = lua_objlen(L, i);
+    for (size_t j = 1; j <= n; j++)
+    {
+        lua_rawgeti(L, i, (int)j);
+        ret.push_back(read_lua<int>(L, -1));
+        lua_pop(L, 1);
+    }
+    return ret;
+}
+
 template <>
 entities::ent_ref implicit_lua::read_lua<entities::ent_ref>(lua_State* L, int i)
 {
@@ -72,6 +89,39 @@ void implicit_lua::push_lua<entities::ent_ref>(lua_State* L, const entities::ent
     viewer::show_entity(ref);
 }
 
+static void set_field(lua_State* L, const char* key, double value)
+{
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, key);
+}
+
+template <>
+void implicit_lua::push_lua<frame_stats::report>(lua_State* L, const frame_stats::report& report)
+{
+    lua_newtable(L);
+    lua_newtable(L);
+    for (const auto& [name, s] : report.timers)
+    {
+        lua_newtable(L);
+        set_field(L, "count", (double)s.count);
+        set_field(L, "mean", s.mean);
+        set_field(L, "p50", s.p50);
+        set_field(L, "p90", s.p90);
+        set_field(L, "p99", s.p99);
+        set_field(L, "max", s.max);
+        lua_setfield(L, -2, name.c_str());
+    }
+    lua_setfield(L, -2, "timers");
+    lua_newtable(L);
+    lua_pushstring(L, report.kernel.name.c_str());
+    lua_setfield(L, -2, "name");
+    set_field(L, "private_mem", (double)report.kernel.privateMemSize);
+    set_field(L, "local_mem", (double)report.kernel.localMemSize);
+    set_field(L, "work_group_size", (double)report.kernel.workGroupSize);
+    set_field(L, "registers", (double)report.kernel.numRegisters);
+    lua_setfield(L, -2, "kernel");
+}
+
 void implicit_lua::init_lua()
 {
     if (s_luaState)
@@ -85,6 +135,7 @@ void implicit_lua::stop()
 {
     lua_State* L = state();
     lua_close(L);
+    s_luaState = nullptr;
 }
 
 int implicit_lua::delete_entity(lua_State* L)
@@ -99,14 +150,17 @@ int implicit_lua::delete_entity(lua_State* L)
     return 0;
 }
 
-void implicit_lua::run_cmd(const std::string& line)
+bool implicit_lua::run_cmd(const std::string& line)
 {
     lua_State* L = state();
     int ret = luaL_dostring(L, line.c_str());
     if (ret != LUA_OK)
     {
         std::cerr << "Lua Error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+        return false;
     }
+    return true;
 }
 
 lua_State* implicit_lua::state()
@@ -198,6 +252,14 @@ LUA_FUNC(void, show, true, "Shows the given entity in the viewer",
     viewer::show_entity(ent);
 }
 
+LUA_FUNC(void, setparam, true, "Sets a parameter of an entity, e.g. the radius of a sphere. If the entity is shown, only its data is uploaded",
+    (ent_ref, ent, "The entity to be edited"),
+    (std::string, name, "The name of the parameter"),
+    (float, value, "The new value of the parameter"))
+{
+    viewer::set_param(ent, name, value);
+}
+
 LUA_FUNC(ent_ref, box, true, "Creates and returns a box entity",
     (float, xcenter, "The x coordinate of the center of the box."),
     (float, ycenter, "The y coordinate of the center of the box."),
@@ -357,7 +419,14 @@ LUA_FUNC(void, load, true, "Runs a lua script into the current environment",
     std::cout << std::endl << std::endl;
     f.close();
 
-    luaL_dofile(state(), filepath.c_str());
+    if (luaL_dofile(state(), filepath.c_str()) != LUA_OK)
+    {
+        // Static, so the message outlives the unwinding until luathrow pushes it.
+        static std::string error;
+        error = lua_tostring(state(), -1);
+        lua_pop(state(), 1);
+        throw error.c_str();
+    }
 }
 
 #ifdef CLDEBUG
@@ -375,8 +444,8 @@ LUA_FUNC(void, viewer_debugstep, false, "Advances the viewer by one frame in the
 }
 #endif
 
-LUA_FUNC(void, exportframe, true, "Exports the current view as a BMP image",
-    (std::string, filepath, "Path of the BMP file to be written"))
+LUA_FUNC(void, exportframe, true, "Exports the current view as a BMP or PNG image",
+    (std::string, filepath, "Path of the BMP or PNG file to be written"))
 {
     if (!viewer::exportframe(filepath))
         throw "Failed to export the frame.";
@@ -395,6 +464,57 @@ LUA_FUNC(void, setbounds, true, "Sets the bounds, or the build volume for the cu
     viewer::setbounds(bounds);
 }
 
+LUA_FUNC(void, exportmesh, true, "Meshes the entity within the bounds and exports it as a binary STL or PLY file",
+    (ent_ref, entity, "The entity to be meshed"),
+    (std::string, filepath, "Path of the STL or PLY file to be written"),
+    (float, cellSize, "The size of the smallest cells of the mesh, i.e. the resolution"))
+{
+    float bounds[6];
+    viewer::getbounds(bounds);
+    mesher::mesh_stats stats;
+    if (!mesher::export_mesh(entity, { bounds[0], bounds[1], bounds[2] }, { bounds[3], bounds[4], bounds[5] },
+        cellSize, filepath, &stats))
+        throw "Failed to export the mesh.";
+    std::cout << "Mesh was exported with " << stats.numVertices << " vertices and " << stats.numTriangles
+        << " triangles.\n";
+}
+
+LUA_FUNC(void, exportvolume, true, "Samples the field of the entity near its surface within the bounds and exports it as a sparse volume file",
+    (ent_ref, entity, "The entity to be sampled"),
+    (std::string, filepath, "Path of the volume file to be written"),
+    (float, voxelSize, "The distance between neighbouring samples"),
+    (float, bandWidth, "Only the tiles of samples within this distance of the surface are written"))
+{
+    float bounds[6];
+    viewer::getbounds(bounds);
+    volume_export::volume_stats stats;
+    if (!volume_export::export_volume(entity, { bounds[0], bounds[1], bounds[2] }, { bounds[3], bounds[4], bounds[5] },
+        voxelSize, bandWidth, filepath, &stats))
+        throw "Failed to export the volume.";
+    std::cout << "Volume was exported with " << stats.numTiles << " tiles of " << stats.numSampledTiles
+        << " sampled, " << stats.fileSize << " bytes.\n";
+}
+
+LUA_FUNC(void, exportlayers, true, "Slices the entity within the bounds into layers along z and writes a file for every layer",
+    (ent_ref, entity, "The entity to be sliced"),
+    (std::string, directory, "The directory the layer files are written to"),
+    (float, layerHeight, "The thickness of the layers"),
+    (float, pixelSize, "The spacing of the samples within a layer"),
+    (std::string, format, "The format of the layer files, svg, polygons or rle"))
+{
+    slicer::layer_format layerFormat;
+    if (!slicer::parse_format(format, layerFormat))
+        throw "Unknown layer format, use svg, polygons or rle.";
+    float bounds[6];
+    viewer::getbounds(bounds);
+    slicer::slice_stats stats;
+    if (!slicer::slice(entity, { bounds[0], bounds[1], bounds[2] }, { bounds[3], bounds[4], bounds[5] },
+        layerHeight, pixelSize, layerFormat, directory, &stats))
+        throw "Failed to export the layers.";
+    std::cout << stats.numLayers << " layers were exported with " << stats.numContours << " contours, "
+        << stats.numSampledTiles << " of " << stats.numTiles << " tiles sampled.\n";
+}
+
 LUA_FUNC(void, help_all, false, "Shows a list of all functions and their descriptions")
 {
     for (const auto& info : s_functionInfos)
@@ -466,11 +586,78 @@ LUA_FUNC(void, adaptive_rendermode, true, "Sets the level of detail for the adap
     viewer::adaptive_rendermode((uint8_t)lod);
 }
 
+LUA_FUNC(void, upscalemode, true, "Enables or disables smoothly upscaling the coarse frames of the adaptive rendering mode",
+    (int, flag, "1 to interpolate between the traced pixels, 0 to show them as blocks"))
+{
+    if (flag != 0 && flag != 1)
+        throw "Argument must be either 0 or 1.";
+    viewer::upscale_mode(flag == 1);
+}
+
+LUA_FUNC(void, jitmode, true, "Enables or disables compiling the csg trees of the shown entities into specialized kernels",
+    (int, flag, "1 to compile the trees, 0 to interpret them"))
+{
+    if (flag != 0 && flag != 1)
+        throw "Argument must be either 0 or 1.";
+    viewer::jit_mode(flag == 1);
+}
+
+LUA_FUNC(void, privatestack, true, "Switches the interpreter between keeping intermediate csg values in a private stack and in local memory",
+    (int, flag, "1 for the private stack, 0 for local memory"))
+{
+    if (flag != 0 && flag != 1)
+        throw "Argument must be either 0 or 1.";
+    viewer::private_stack_mode(flag == 1);
+}
+
+LUA_FUNC(void, devices, false, "Lists the OpenCL devices of the machine, with the indices used by splitframe")
+{
+    viewer::list_devices();
+}
+
+LUA_FUNC(void, splitframe, true, "Splits every frame into bands of rows traced by the given devices at the same time, besides the device showing the frames",
+    (std::vector<int>, indices, "Table of device indices from devices(), empty to only use the device showing the frames"))
+{
+    std::vector<size_t> devices;
+    for (int index : indices)
+    {
+        if (index < 0)
+            throw "Device indices cannot be negative.";
+        devices.push_back((size_t)index);
+    }
+    viewer::use_devices(devices);
+}
+
+LUA_FUNC(void, bakemode, true, "Enables or disables baking the field of the shown entity in the background, and marching the rays through the baked field up to the surface",
+    (int, flag, "1 to bake the field, 0 to always evaluate the csg tree"))
+{
+    if (flag != 0 && flag != 1)
+        throw "Argument must be either 0 or 1.";
+    viewer::bake_mode(flag == 1);
+}
+
+LUA_FUNC(frame_stats::report, stats, false, "Prints and returns the timings of the recent frames in milliseconds, and the resources of the render kernel")
+{
+    frame_stats::report report = frame_stats::get_report();
+    frame_stats::print(report, std::cout);
+    return report;
+}
+
+LUA_FUNC(void, statslog, true, "Periodically logs the frame timings to the console or to a csv file",
+    (float, interval, "Seconds between two log entries, 0 to stop logging"),
+    (std::string, path, "The csv file to append to, or an empty string to print to the console"))
+{
+    if (interval < 0.0f)
+        throw "The interval cannot be negative.";
+    frame_stats::set_log(interval, path);
+}
+
 void implicit_lua::init_functions()
 {
     lua_State* L = state();
     INIT_LUA_FUNC(L, quit);
     INIT_LUA_FUNC(L, show);
+    INIT_LUA_FUNC(L, setparam);
     INIT_LUA_FUNC(L, box);
     INIT_LUA_FUNC(L, sphere);
     INIT_LUA_FUNC(L, cylinder);
@@ -493,10 +680,21 @@ void implicit_lua::init_functions()
 
     INIT_LUA_FUNC(L, exportframe);
     INIT_LUA_FUNC(L, setbounds);
+    INIT_LUA_FUNC(L, exportmesh);
+    INIT_LUA_FUNC(L, exportvolume);
+    INIT_LUA_FUNC(L, exportlayers);
     INIT_LUA_FUNC(L, help_all);
     INIT_LUA_FUNC(L, help);
     INIT_LUA_FUNC(L, filleted_union);
     INIT_LUA_FUNC(L, filleted_intersection);
     INIT_LUA_FUNC(L, filleted_subtraction);
     INIT_LUA_FUNC(L, adaptive_rendermode);
+    INIT_LUA_FUNC(L, upscalemode);
+    INIT_LUA_FUNC(L, jitmode);
+    INIT_LUA_FUNC(L, privatestack);
+    INIT_LUA_FUNC(L, devices);
+    INIT_LUA_FUNC(L, splitframe);
+    INIT_LUA_FUNC(L, bakemode);
+    INIT_LUA_FUNC(L, stats);
+    INIT_LUA_FUNC(L, statslog);
 }
@@ -8,6 +8,13 @@
 #include <assert.h>
 #include <implicitlua/luabindings.h>
 
+struct shell_args
+{
+    bool headless = false;
+    std::string script;
+    std::string exportPath;
+};
+
 static void cmd_loop()
 {
     std::string input;
@@ -23,8 +30,80 @@ static void cmd_loop()
     viewer::close_window();
 };
 
+static void print_usage()
+{
+    std::cout << "Usage:\n"
+        << "\timplicitshell [script.lua]\n"
+        << "\timplicitshell --headless --script <script.lua> [--export <image.png|image.bmp>]\n";
+}
+
+static bool parse_args(int argc, char** argv, shell_args& args)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        if (arg == "--headless")
+            args.headless = true;
+        else if (arg == "--script" && i + 1 < argc)
+            args.script = argv[++i];
+        else if (arg == "--export" && i + 1 < argc)
+            args.exportPath = argv[++i];
+        else if (arg.rfind("--", 0) != 0 && args.script.empty())
+            args.script = arg;
+        else
+            return false;
+    }
+    return !(args.headless && args.script.empty());
+}
+
+static bool load_script(std::string path)
+{
+    std::replace(path.begin(), path.end(), '\\', '/');
+    std::string command = "load(\"" + path + "\")";
+    return implicit_lua::run_cmd(command);
+}
+
+static int run_headless(const shell_args& args)
+{
+    std::cout << "Initializing OpenCL (headless)...\n";
+    viewer::init_ocl(true);
+    std::cout << "\tAllocating device buffers\n";
+    viewer::init_buffers();
+    std::cout << "Initializing Lua bindings...\n";
+    implicit_lua::init_lua();
+    std::cout << "=====================================\n\n";
+
+    int ret = 0;
+    if (!load_script(args.script))
+    {
+        // Callers in batch only have the exit code, and a frame of a broken scene would look fine.
+        std::cerr << "The script failed, nothing was exported." << std::endl;
+        ret = 1;
+    }
+    else if (!args.exportPath.empty())
+    {
+        if (viewer::exportframe(args.exportPath))
+            std::cout << "Frame was exported to " << args.exportPath << std::endl;
+        else
+            ret = 1;
+    }
+    viewer::stop();
+    implicit_lua::stop();
+    return ret;
+}
+
 int main(int argc, char** argv)
 {
+    shell_args args;
+    if (!parse_args(argc, argv, args))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (args.headless)
+        return run_headless(args);
+
     std::cout << "Initializing OpenGL...\n";
     viewer::init_ogl();
     std::cout << "Initializing OpenCL...\n";
@@ -35,12 +114,9 @@ int main(int argc, char** argv)
     implicit_lua::init_lua();
     std::cout << "=====================================\n\n";
 
-    if (argc == 2)
+    if (!args.script.empty())
     {
-        std::string path(argv[1]);
-        std::replace(path.begin(), path.end(), '\\', '/');
-        std::string command = "load(\"" + path + "\")";
-        implicit_lua::run_cmd(command);
+        load_script(args.script);
     }
     std::thread cmdThread(cmd_loop);
     viewer::render_loop();
@@ -49,4 +125,4 @@ int main(int argc, char** argv)
     viewer::stop();
     implicit_lua::stop();
     return 0;
-}
\ No newline at end of file
+}
@@ -7,12 +7,45 @@
 #define DX 0.0001f
 #define AMB_STEP 0.05f
 #define STEP_FOS 0.9f
+#define RELAXATION 1.6f // Over-relaxed step, see sphere_trace.
+#define FOOTPRINT_FOS 0.5f // A hit is accepted within this fraction of the pixel's footprint.
 #define EPSILON 0.0001
 #define NUM_ITERS 500
 #define TOLERANCE 0.00001f
+#define REPROJECT_FOS 0.8f // Fraction of the reprojected hit distance a ray starts at.
+#define CONE_TILE 8 // Width of the square screen tiles marched as one cone, in pixels.
+#define CONE_ITERS 64
+#define ORDER_MORTON 1 // Must match work_group_tuner::ORDER_MORTON.
+#define BRICK_SIZE 8 // Must match field_bake::BRICK_SIZE.
+#define BAKE_ITERS 128
+/*Times the spacing of the baked samples. Trilinear interpolation of a Lipschitz field is off by
+less than sqrt(3) times that, and the rest covers the fixed point weights of the texture units.*/
+#define BAKE_MARGIN 1.8f
 
 #include "kernel_primitives.clh"
 
+/*The field of the csg tree, evaluated inside sphere_trace. If the tree was compiled into
+f_entity_jit (see kernel_jit.cpp), that is used instead of interpreting the render data.
+F_ENTITY_DUAL also returns the gradient, see f_entity_dual.*/
+#ifdef JIT_ENTITY
+#define F_ENTITY_DUAL(ptr) f_entity_jit_dual(packed, steps, ptr)
+#ifdef CLDEBUG
+#define F_ENTITY(ptr) f_entity_jit(packed, steps, ptr, debugFlag)
+#else
+#define F_ENTITY(ptr) f_entity_jit(packed, steps, ptr)
+#endif
+#else
+#define F_ENTITY_DUAL(ptr) f_entity_dual(packed, offsets, types, nEntities, \
+                                         steps, nSteps, culls, nCulls, ptr)
+#ifdef CLDEBUG
+#define F_ENTITY(ptr) f_entity(packed, offsets, types, regBuf, \
+                               nEntities, steps, nSteps, culls, nCulls, ptr, debugFlag)
+#else
+#define F_ENTITY(ptr) f_entity(packed, offsets, types, regBuf, \
+                               nEntities, steps, nSteps, culls, nCulls, ptr)
+#endif
+#endif
+
 #define GRADIENT(func, point, val, grad) {                  \
     point.x += EPSILON; grad.x = (func - val) / EPSILON; point.x -= EPSILON;  \
     point.y += EPSILON; grad.y = (func - val) / EPSILON; point.y -= EPSILON;  \
@@ -36,15 +69,15 @@ tracing of implicit bodies by ignoring anything that is beyond this distance.
 If the distance is set to -1, that means the ray completely misses box, in which
 case background color can be rendered.
 */
-float bound_distance(__constant float* viewerData, float3* pos, float3* dir,
+float bound_distance(float16 viewerData, float3* pos, float3* dir,
                      uint* color
 #ifdef CLDEBUG
                      , uchar debugFlag
 #endif
                      )
 {
-  float3 bmin = vload3(2, viewerData);
-  float3 bmax = vload3(3, viewerData);
+  float3 bmin = viewerData.s678;
+  float3 bmax = viewerData.s9ab;
   *color = BACKGROUND_COLOR;
   if ((*dir).x < 0.0f){
     float3 t = *pos + (*dir) * ((bmin.x - (*pos).x)/((*dir).x));
@@ -95,53 +128,80 @@ float bound_distance(__constant float* viewerData, float3* pos, float3* dir,
 uint sphere_trace(global uchar* packed,
                   global uint* offsets,
                   global uchar* types,
-                  local float* valBuf,
                   local float* regBuf,
                   uint nEntities,
                   global op_step* steps,
                   uint nSteps,
+                  global cull_range* culls,
+                  uint nCulls,
                   float3 pt,
                   float3 dir,
                   int iters,
                   float tolerance,
-                  float boundDist
+                  float lipschitz, // Bound of the gradient of the field, computed on the host.
+                  float pixelAngle, // Angle between neighbouring rays.
+                  float boundDist,
+                  float emptyDist, // The ray is known to be empty up to here, see k_coneMarch.
+                  float startDist, // Where the march starts along the ray, if that is outside.
+                  float* hitDist, // The distance of the hit, or INFINITY.
+                  uint2* work // Counts the march iterations and the field evaluations.
 #ifdef CLDEBUG
                   , uchar debugFlag
 #endif
                   )
 {
-  if (nEntities == 0)
+  *hitDist = INFINITY;
+  if (nEntities == 0 || emptyDist >= boundDist)
     return BACKGROUND_COLOR;
   
   dir = normalize(dir);
   float3 norm = (float3)(0.0f, 0.0f, 0.0f);
   bool found = false;
-  float dTotal = 0.0f;
+  float dTotal = emptyDist;
   float d;
+  pt += dir * emptyDist;
+  if (startDist > dTotal && startDist < boundDist){
+    float3 start = pt + dir * (startDist - dTotal);
+    d = F_ENTITY(&start);
+    (*work).y++;
+    // Inside means the start skipped over a surface, so march from the empty part.
+    if (d >= 0.0f){
+      pt = start;
+      dTotal = startDist;
+    }
+  }
+  /*Enhanced sphere tracing: the field divided by the Lipschitz bound is a distance the surface
+  is at least away, and the steps go further than that by the relaxation factor. That is only
+  safe while the unbounding spheres of consecutive points overlap. Otherwise the point is
+  moved back to the last safe step, and the rest of the ray is marched without relaxation.*/
+  float omega = RELAXATION;
+  float stepLen = 0.0f;
+  float prevRadius = 0.0f;
   for (int i = 0; i < iters; i++){
-    d = f_entity(packed, offsets, types, valBuf, regBuf,
-                       nEntities, steps, nSteps, &pt
-#ifdef CLDEBUG
-                 , debugFlag
-#endif
-                 );
+    d = F_ENTITY(&pt);
+    (*work) += (uint2)(1, 1);
 
     if (d < 0.0f && dTotal == 0.0f) break; // Too close to camera.
-    if (d < tolerance && (-tolerance) < d){
-      GRADIENT(f_entity(packed, offsets, types, valBuf, regBuf,
-                        nEntities, steps, nSteps, &pt
-#ifdef CLDEBUG
-                        , debugFlag
-#endif
-                        ),
-               pt, d, norm);
-      norm = normalize(norm);
+    float radius = d / lipschitz;
+    if (omega > STEP_FOS && fabs(radius) + prevRadius < stepLen){
+      float back = stepLen - prevRadius * STEP_FOS;
+      pt -= dir * back;
+      dTotal -= back;
+      omega = STEP_FOS;
+      stepLen = 0.0f;
+      continue;
+    }
+    // Nothing smaller than a fraction of the pixel can be resolved at this distance.
+    if (fabs(radius) < max(tolerance, FOOTPRINT_FOS * pixelAngle * (2.0f + dTotal))){
       found = true;
+      *hitDist = dTotal;
       break;
     }
 
-    pt += dir * (d * STEP_FOS);
-    dTotal += d * STEP_FOS;
+    stepLen = radius * omega;
+    prevRadius = fabs(radius);
+    pt += dir * stepLen;
+    dTotal += stepLen;
     if (i > 3 && dTotal > boundDist) break;
   }
   
@@ -153,14 +213,22 @@ uint sphere_trace(global uchar* packed,
     return BACKGROUND_COLOR;
   }
 
+  // The exact gradient in one pass, unless the tree is too deep for the dual registers.
+  float4 dual = F_ENTITY_DUAL(&pt);
+  (*work).y++;
+  if (isnan(dual.w)){
+    GRADIENT(F_ENTITY(&pt), pt, d, norm);
+    (*work).y += 3;
+  }
+  else{
+    norm = dual.xyz;
+  }
+  norm = normalize(norm);
+
   pt -= dir * AMB_STEP;
   float old = d;
-  d = f_entity(packed, offsets, types, valBuf, regBuf,
-               nEntities, steps, nSteps, &pt
-#ifdef CLDEBUG
-               , debugFlag
-#endif
-               );
+  d = F_ENTITY(&pt);
+  (*work).y++;
   float amb = (d - old) / AMB_STEP;
   float c = 0.2f + dot(norm, -dir) * (0.6f * amb + 0.3f);
 #ifdef CLDEBUG
@@ -174,7 +242,28 @@ uint sphere_trace(global uchar* packed,
   return colorToInt(c);
 }
 
-void perspective_project(__constant float* viewerData,
+/*The eye is the center of the image plane, the rays go through the image plane from a point
+two units behind it.*/
+void camera_basis(float16 viewerData,
+                  float3* eye,
+                  float3* fwd,
+                  float3* x,
+                  float3* y)
+{
+  float3 camPos = viewerData.s012;
+  float3 camTarget = viewerData.s345;
+  float st, ct, sp, cp;
+  st = sincos(camPos.y, &ct);
+  sp = sincos(camPos.z, &cp);
+
+  *fwd = -(float3)(camPos.x * cp * ct, camPos.x * cp * st, camPos.x * sp);
+  *eye = camTarget - (*fwd);
+  *fwd = normalize(*fwd);
+  *x = normalize(cross(*fwd, (float3)(0, 0, 1)));
+  *y = normalize(cross(*x, *fwd));
+}
+
+void perspective_project(float16 viewerData,
                          uint2 coord,
                          uint2 dims,
                          float3* pos,
@@ -186,20 +275,9 @@ void perspective_project(__constant float* viewerData,
 #endif
                          )
 {
-  float3 camPos = vload3(0, viewerData);
-  float3 camTarget = vload3(1, viewerData);
-  float st, ct, sp, cp;
-  st = sincos(camPos.y, &ct);
-  sp = sincos(camPos.z, &cp);
-
-  *dir = -(float3)(camPos.x * cp * ct, camPos.x * cp * st, camPos.x * sp);
-  *pos = camTarget - (*dir);
-  *dir = normalize(*dir);
-
+  float3 x, y;
+  camera_basis(viewerData, pos, dir, &x, &y);
   float3 center = (*pos) - ((*dir) * 2.0f);
-  
-  float3 x = normalize(cross(*dir, (float3)(0, 0, 1)));
-  float3 y = normalize(cross(x, *dir));
   *pos += 1.5f *
     (x * (((float)coord.x - (float)dims.x / 2.0f) / ((float)dims.x / 2.0f)) +
      y * (((float)coord.y - (float)dims.y / 2.0f) / ((float)dims.x / 2.0f)));
@@ -213,25 +291,179 @@ void perspective_project(__constant float* viewerData,
                               );
 }
 
+/*Clips the ray to the box around the solid, see solid_bounds in cpu_eval.h, as nothing can be
+hit outside of it. If the ray misses the box, the near distance ends up beyond the far one.*/
+void clip_to_scene(float8 sceneBounds,
+                   float3 pos,
+                   float3 dir,
+                   float* nearDist,
+                   float* farDist)
+{
+  float3 bmin = sceneBounds.s012;
+  float3 bmax = sceneBounds.s456;
+  if (any(bmin > bmax)){
+    *nearDist = INFINITY; // Nothing is solid.
+    return;
+  }
+  float3 inv = 1.0f / dir;
+  float3 t0 = (bmin - pos) * inv;
+  float3 t1 = (bmax - pos) * inv;
+  // fmin and fmax drop the NaN of an axis parallel ray starting on a side of the box.
+  float3 tmin = fmin(t0, t1);
+  float3 tmax = fmax(t0, t1);
+  *nearDist = max(*nearDist, max(max(tmin.x, tmin.y), tmin.z));
+  *farDist = min(*farDist, min(min(tmax.x, tmax.y), tmax.z));
+}
+
+__constant sampler_t BAKE_NEAREST = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+__constant sampler_t BAKE_LINEAR = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+/*A distance the surface is at least away from the point, from the baked field, see field_bake.h.
+The bricks of the cells near the surface are sampled where they are baked, the coarse grid
+everywhere else. Points outside the baked box get -INFINITY.*/
+float baked_distance(read_only image3d_t coarse,
+                     read_only image3d_t bricks,
+                     read_only image3d_t atlas,
+                     float4 bake, // The first corner of the cells in xyz, and their size in w.
+                     float lipschitz,
+                     float3 pt)
+{
+  float3 g = (pt - bake.xyz) / bake.w;
+  int4 cells = get_image_dim(bricks);
+  if (any(g < 0.0f) || any(g > convert_float3(cells.xyz)))
+    return -INFINITY;
+  int3 cell = min(convert_int3(g), cells.xyz - 1);
+  uint4 slot = read_imageui(bricks, BAKE_NEAREST, (int4)(cell, 0));
+  float d, spacing;
+  if (slot.w){
+    // The samples of a brick lie on both faces of its cell, the texel centers are at +0.5.
+    float3 local = clamp(g - convert_float3(cell), 0.0f, 1.0f) * (float)(BRICK_SIZE - 1);
+    float3 texel = convert_float3(slot.xyz) * (float)BRICK_SIZE + 0.5f + local;
+    d = read_imagef(atlas, BAKE_LINEAR, (float4)(texel, 0.0f)).x;
+    spacing = bake.w / (float)(BRICK_SIZE - 1);
+  }
+  else{
+    d = read_imagef(coarse, BAKE_LINEAR, (float4)(g + 0.5f, 0.0f)).x;
+    spacing = bake.w;
+  }
+  return d / lipschitz - spacing * BAKE_MARGIN;
+}
+
+/*Sphere traces the baked field from near, as long as it proves the ray empty, and returns where
+the field itself has to take over: within about a brick sample of the surface, when the ray
+leaves the baked box, or at far.*/
+float baked_empty_distance(read_only image3d_t coarse,
+                           read_only image3d_t bricks,
+                           read_only image3d_t atlas,
+                           float4 bake,
+                           float lipschitz,
+                           float3 pos,
+                           float3 dir,
+                           float near,
+                           float far)
+{
+  float fine = bake.w / (float)(BRICK_SIZE - 1);
+  float t = near;
+  for (int i = 0; i < BAKE_ITERS && t < far; i++){
+    float d = baked_distance(coarse, bricks, atlas, bake, lipschitz, pos + dir * t);
+    if (d < fine)
+      break;
+    t += d;
+  }
+  return min(t, far);
+}
+
+/*How far the ray of the pixel starting at pos is empty, from the cone of its tile. The cone
+distances are measured from the apex all the rays go through, and a point of the ray at that
+distance from the apex is never further along the axis of the cone than the verified part.*/
+float cone_empty_distance(global float* cone,
+                          float16 viewerData,
+                          uint2 coord,
+                          uint2 dims,
+                          float3 pos)
+{
+  uint tilesX = (dims.x + CONE_TILE - 1) / CONE_TILE;
+  float dist = cone[coord.x / CONE_TILE + (coord.y / CONE_TILE) * tilesX];
+  if (isinf(dist))
+    return INFINITY;
+  float3 eye, fwd, x, y;
+  camera_basis(viewerData, &eye, &fwd, &x, &y);
+  return max(0.0f, dist - length(pos - (eye - fwd * 2.0f)));
+}
+
+/*Spreads the even bits of n into x and the odd bits into y.*/
+uint2 morton_decode(uint n)
+{
+  uint2 v = (uint2)(n, n >> 1) & 0x55555555u;
+  v = (v | (v >> 1)) & 0x33333333u;
+  v = (v | (v >> 2)) & 0x0f0f0f0fu;
+  v = (v | (v >> 4)) & 0x00ff00ffu;
+  v = (v | (v >> 8)) & 0x0000ffffu;
+  return v;
+}
+
+/*Traces the pixels that are new at the given level of detail, where every traced pixel stands
+for the block of step x step pixels below and to the right of it, until those are traced at a
+finer level. Without refine, every pixel on the grid of the level is traced, which is the first
+pass after the view changes. With refine, the coarser grid is already traced and each of its
+cells only has three new pixels, so the work items are packed densely over those. Refining down
+to level 0 traces every pixel exactly once.
+Only the rows of the band are traced, the other rows belong to other devices, see split_frame. The
+first row of the band is a multiple of twice the coarsest pixel stride, so the grids of all levels
+start on it, and no block crosses into the next band.
+The work groups are tiles of the traced grid, with a shape picked by the work group tuner. In
+Morton order, the work items of a group are shuffled so that consecutive ones, which run
+together, cover small squares instead of rows. That needs a square or 2:1 tile of powers of two.
+With a baked field, the rays march that first and only evaluate the csg tree near the surface.*/
 kernel void k_trace(global uint* pBuffer, // The pixel buffer
                     global uchar* packed, // Bytes of render data for simple bytes.
                     global uchar* types, // Types of simple entities in the csg tree.
                     global uchar* offsets, // The byte offsets of simple entities.
-                    local float* valBuf, // The buffer for local use.
-                    local float* regBuf, // More buffer for local use.
+                    local float* regBuf, // Registers for the csg steps, per work item.
                     uint nEntities, // The number of simple entities.
                     global op_step* steps, // CSG steps.
                     uint nSteps, // Number of csg steps.
-                    __constant float* viewerData,
-                    uchar levelOfDetail
+                    global cull_range* culls, // Subtrees skipped far from their boxes.
+                    uint nCulls, // Number of cull ranges.
+                    float8 sceneBounds, // Box around the solid, min in s012 and max in s456.
+                    float lipschitz, // Bound of the gradient of the field.
+                    float16 viewerData, // Camera distance, theta, phi, target, and the bounds.
+                    global float* depth, // Hit distances of the pixels, reprojected to this view, see k_reproject.
+                    global float* cone, // Empty distances of the screen tiles, see k_coneMarch.
+                    read_only image3d_t coarse, // The baked field, see baked_distance.
+                    read_only image3d_t bricks,
+                    read_only image3d_t atlas,
+                    float4 bake, // The first corner and the size of the baked cells, zero size if nothing is baked.
+                    uint2 dims, // The size of the frame in pixels.
+                    uint2 band, // The first row of the band, and the row after its last.
+                    uchar levelOfDetail, // The pixel stride is 2 ^ levelOfDetail.
+                    uchar refine, // 1 if the next coarser level is already traced.
+                    uchar order // The order of the work items in the group.
 #ifdef CLDEBUG
                     , uint2 mousePos // Mouse position in pixels.
 #endif
                     )
 {
-  uint2 dims = (uint2)(get_global_size(0), get_global_size(1));
-  uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
   uint step = 1 << levelOfDetail;
+  uint2 gid = (uint2)(get_global_id(0), get_global_id(1));
+  if (order == ORDER_MORTON){
+    uint2 size = (uint2)(get_local_size(0), get_local_size(1));
+    gid = (uint2)(get_group_id(0), get_group_id(1)) * size +
+      morton_decode(get_local_id(0) + get_local_id(1) * size.x);
+  }
+  uint2 coord;
+  if (refine){
+    uint cell = gid.x / 3;
+    uint child = gid.x % 3 + 1; // Child 0 is the pixel of the coarser level.
+    coord = (uint2)((cell * 2 + (child & 1)) * step,
+                    band.x + (gid.y * 2 + (child >> 1)) * step);
+  }
+  else{
+    coord = (uint2)(gid.x * step, band.x + gid.y * step);
+  }
+  // The global size is rounded up to the work group size.
+  if (coord.x >= dims.x || coord.y >= min(band.y, dims.y))
+    return;
 #ifdef CLDEBUG
   uchar debugFlag = (uchar)(coord.x == mousePos.x && coord.y == mousePos.y);
   if (debugFlag){
@@ -239,48 +471,249 @@ kernel void k_trace(global uint* pBuffer, // The pixel buffer
     printf("Pixel stride is %u\n", step);
   }
 #endif
-  uint i = coord.x + (coord.y * get_global_size(0));
-  if (coord.x % step == 0 && coord.y % step == 0){
-    float3 pos, dir;
-    float boundDist;
-    uint color;
-    perspective_project(viewerData, coord, dims, &pos, &dir, &boundDist, &color
+  float3 pos, dir;
+  float boundDist;
+  uint color;
+  perspective_project(viewerData, coord, dims, &pos, &dir, &boundDist, &color
 #ifdef CLDEBUG
-                        , debugFlag
+                      , debugFlag
 #endif
-                        );
-    if (boundDist > 0.0f){
-      pBuffer[i] = sphere_trace(packed, offsets, types, valBuf, regBuf,
-                                nEntities, steps, nSteps, pos, dir,
-                                NUM_ITERS, TOLERANCE, boundDist
+                      );
+  uint i = coord.x + coord.y * dims.x;
+  if (boundDist > 0.0f){
+    uint2 work = (uint2)(0, 0); // Unused, optimized away.
+    float hit;
+    float emptyDist = cone_empty_distance(cone, viewerData, coord, dims, pos);
+    clip_to_scene(sceneBounds, pos, dir, &emptyDist, &boundDist);
+    if (bake.w > 0.0f && emptyDist < boundDist)
+      emptyDist = baked_empty_distance(coarse, bricks, atlas, bake, lipschitz, pos, dir, emptyDist, boundDist);
+    uint traced = sphere_trace(packed, offsets, types, regBuf,
+                               nEntities, steps, nSteps, culls, nCulls, pos, dir,
+                               NUM_ITERS, TOLERANCE, lipschitz, 1.5f / (float)dims.x,
+                               boundDist, emptyDist,
+                               depth[i] * REPROJECT_FOS, &hit, &work
 #ifdef CLDEBUG
-                                , debugFlag
+                               , debugFlag
 #endif
-                                );
-      if (pBuffer[i] == BACKGROUND_COLOR) pBuffer[i] = color;
-    }
-    else{
-      pBuffer[i] = BACKGROUND_COLOR;
+                               );
+    depth[i] = hit;
+    if (traced != BACKGROUND_COLOR) color = traced;
+  }
+  else{
+    color = BACKGROUND_COLOR;
+    depth[i] = INFINITY;
+  }
+  // Fill the block this pixel stands for.
+  uint xend = min(coord.x + step, dims.x);
+  uint yend = min(coord.y + step, dims.y);
+  for (uint y = coord.y; y < yend; y++){
+    for (uint x = coord.x; x < xend; x++){
+      pBuffer[x + y * dims.x] = color;
     }
   }
 #ifdef CLDEBUG
   if (debugFlag){
     printf("Screen coords: (%02d, %02d)\n", mousePos.x, mousePos.y);
-    printf("Color: %08x\n", pBuffer[i]);
+    printf("Color: %08x\n", color);
   }
 #endif
 }
 
-kernel void k_repeatPixels(global uint* pBuffer,
-                           uchar levelOfDetail)
+/*Moves the hit points of the previous view into the pixels they fall on in the new view, and
+writes their distances from those pixels, keeping the nearest one with an atomic min. The
+distances are positive, so their bits order the same as unsigned integers. The reprojected
+buffer must be filled with INFINITY before, which stays where nothing lands.*/
+kernel void k_reproject(global float* depth,
+                        global uint* reprojected,
+                        float16 oldView,
+                        float16 newView,
+                        uint2 dims)
+{
+  uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
+  if (coord.x >= dims.x || coord.y >= dims.y)
+    return;
+  float t = depth[coord.x + coord.y * dims.x];
+  if (isinf(t))
+    return;
+  float3 pos, dir;
+  float boundDist;
+  uint color;
+  perspective_project(oldView, coord, dims, &pos, &dir, &boundDist, &color
+#ifdef CLDEBUG
+                      , 0
+#endif
+                      );
+  float3 hit = pos + dir * t;
+
+  float3 eye, fwd, x, y;
+  camera_basis(newView, &eye, &fwd, &x, &y);
+  float3 r = hit - (eye - fwd * 2.0f);
+  float dist = dot(r, fwd);
+  if (dist <= 2.0f)
+    return; // Not in front of the new image plane.
+  float3 onPlane = eye - fwd * 2.0f + r * (2.0f / dist);
+  float scale = (float)dims.x / 2.0f;
+  int px = (int)round(dot(onPlane - eye, x) / 1.5f * scale + (float)dims.x / 2.0f);
+  int py = (int)round(dot(onPlane - eye, y) / 1.5f * scale + (float)dims.y / 2.0f);
+  if (px < 0 || py < 0 || px >= (int)dims.x || py >= (int)dims.y)
+    return;
+  atomic_min(reprojected + px + py * dims.x, as_uint(length(hit - onPlane)));
+}
+
+/*Marches the cone of a CONE_TILE x CONE_TILE tile of the screen, from the apex all the rays go
+through, around every ray of the tile. The ball of radius f / lipschitz around a point is empty, so the cone
+can advance as long as its cross section fits in that ball, and it stops where the field is less
+than the radius of the cone. Returns how far from the apex the cone is empty, or INFINITY if it
+left the bounds without touching anything, and the rays of the tile start there.*/
+float cone_march(global uchar* packed,
+                 global uint* offsets,
+                 global uchar* types,
+                 local float* regBuf,
+                 uint nEntities,
+                 global op_step* steps,
+                 uint nSteps,
+                 global cull_range* culls,
+                 uint nCulls,
+                 float8 sceneBounds,
+                 float lipschitz,
+                 float16 viewerData,
+                 uint2 tile,
+                 uint2 dims,
+                 uint* evaluations // Counts the field evaluations.
+#ifdef CLDEBUG
+                 , uchar debugFlag
+#endif
+                 )
+{
+  float3 eye, fwd, x, y;
+  camera_basis(viewerData, &eye, &fwd, &x, &y);
+  float3 apex = eye - fwd * 2.0f;
+  // The center of the tile on the image plane, as in perspective_project.
+  float scale = (float)dims.x / 2.0f;
+  float2 center = ((float2)((float)(tile.x * CONE_TILE), (float)(tile.y * CONE_TILE)) +
+                   0.5f * (float)(CONE_TILE - 1) -
+                   (float2)((float)dims.x / 2.0f, (float)dims.y / 2.0f)) / scale;
+  float3 axis = eye + 1.5f * (x * center.x + y * center.y) - apex;
+  float s = length(axis);
+  axis /= s;
+  // Half the diagonal of the tile on the image plane, which bounds how far its rays are from the axis.
+  float halfDiag = 1.5f * (float)CONE_TILE * 0.70710678f / scale;
+  float slope = halfDiag / (s - halfDiag);
+  s -= halfDiag; // The image plane is not perpendicular to the axis.
+  // The far corner of the bounds, or of the solid if that is nearer.
+  float sEnd = min(length(max(fabs(viewerData.s678 - apex), fabs(viewerData.s9ab - apex))),
+                   length(max(fabs(sceneBounds.s012 - apex), fabs(sceneBounds.s456 - apex))));
+  for (int i = 0; i < CONE_ITERS && s < sEnd; i++){
+    float3 pt = apex + axis * s;
+    float d = F_ENTITY(&pt) / lipschitz;
+    (*evaluations)++;
+    float r = s * slope;
+    if (d <= r)
+      break;
+    s += (d - r) / (1.0f + slope);
+  }
+  return (nEntities == 0 || s >= sEnd) ? INFINITY : s;
+}
+
+/*Marches one cone per tile of the screen, see cone_march.*/
+kernel void k_coneMarch(global float* cone,
+                        global uchar* packed,
+                        global uchar* types,
+                        global uchar* offsets,
+                        local float* regBuf,
+                        uint nEntities,
+                        global op_step* steps,
+                        uint nSteps,
+                        global cull_range* culls,
+                        uint nCulls,
+                        float8 sceneBounds,
+                        float lipschitz,
+                        float16 viewerData,
+                        uint2 dims)
+{
+  uint2 tile = (uint2)(get_global_id(0), get_global_id(1));
+  uint2 tiles = (dims + CONE_TILE - 1) / CONE_TILE;
+  // The global size is rounded up to the work group size.
+  if (tile.x >= tiles.x || tile.y >= tiles.y)
+    return;
+  uint evaluations = 0; // Unused, optimized away.
+  cone[tile.x + tile.y * tiles.x] = cone_march(packed, offsets, types, regBuf, nEntities, steps, nSteps,
+                                               culls, nCulls, sceneBounds, lipschitz, viewerData, tile, dims,
+                                               &evaluations
+#ifdef CLDEBUG
+                                               , 0
+#endif
+                                               );
+}
+
+/*Traces the same rays as k_trace in a frame at the level of detail without refining, with the
+cones and the baked field but without reprojected hit distances, and without shading any pixels.
+Writes the work done for every pixel: whether a ray was cast, whether it was marched, the march
+iterations and the field evaluations. The first pixel of every cone tile also counts the
+evaluations of marching its cone, see k_coneMarch. Used by the benchmarks.*/
+kernel void k_marchStats(global uint4* counts,
+                         global uchar* packed,
+                         global uchar* types,
+                         global uchar* offsets,
+                         local float* regBuf,
+                         uint nEntities,
+                         global op_step* steps,
+                         uint nSteps,
+                         global cull_range* culls,
+                         uint nCulls,
+                         float8 sceneBounds,
+                         float lipschitz,
+                         float16 viewerData,
+                         global float* cone, // Empty distances of the screen tiles of this view.
+                         read_only image3d_t coarse,
+                         read_only image3d_t bricks,
+                         read_only image3d_t atlas,
+                         float4 bake,
+                         uchar levelOfDetail)
 {
   uint2 dims = (uint2)(get_global_size(0), get_global_size(1));
   uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
   uint step = 1 << levelOfDetail;
   uint i = coord.x + (coord.y * get_global_size(0));
-  if (coord.x % step != 0 || coord.y % step != 0){
-    coord.x -= (coord.x % step);
-    coord.y -= (coord.y % step);
-    pBuffer[i] = pBuffer[coord.x + (coord.y * get_global_size(0))];
+#ifdef CLDEBUG
+  uchar debugFlag = 0;
+#endif
+  uint coneEvaluations = 0;
+  if (coord.x % CONE_TILE == 0 && coord.y % CONE_TILE == 0)
+    cone_march(packed, offsets, types, regBuf, nEntities, steps, nSteps, culls, nCulls, sceneBounds,
+               lipschitz, viewerData, coord / CONE_TILE, dims, &coneEvaluations
+#ifdef CLDEBUG
+               , debugFlag
+#endif
+               );
+  counts[i] = (uint4)(0, 0, 0, coneEvaluations);
+  if (coord.x % step != 0 || coord.y % step != 0)
+    return;
+  float3 pos, dir;
+  float boundDist;
+  uint color;
+  perspective_project(viewerData, coord, dims, &pos, &dir, &boundDist, &color
+#ifdef CLDEBUG
+                      , debugFlag
+#endif
+                      );
+  if (boundDist <= 0.0f){
+    counts[i] = (uint4)(1, 0, 0, coneEvaluations);
+    return;
   }
+  uint2 work = (uint2)(0, 0);
+  float hit;
+  float emptyDist = cone_empty_distance(cone, viewerData, coord, dims, pos);
+  clip_to_scene(sceneBounds, pos, dir, &emptyDist, &boundDist);
+  if (bake.w > 0.0f && emptyDist < boundDist)
+    emptyDist = baked_empty_distance(coarse, bricks, atlas, bake, lipschitz, pos, dir, emptyDist, boundDist);
+  sphere_trace(packed, offsets, types, regBuf,
+               nEntities, steps, nSteps, culls, nCulls, pos, dir,
+               NUM_ITERS, TOLERANCE, lipschitz, 1.5f / (float)dims.x,
+               boundDist, emptyDist, INFINITY, &hit, &work
+#ifdef CLDEBUG
+               , debugFlag
+#endif
+               );
+  counts[i] = (uint4)(1, 1, work.x, work.y + coneEvaluations);
 }